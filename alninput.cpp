@@ -0,0 +1,383 @@
+#include "alninput.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef __WIN32__
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+extern int num_cpus;
+extern bool verbose;
+extern const char* ERR_BAM_SORT;
+
+bool GBamSource::next(GBamRecord& rec, const char*& rname, int& nh, int& hi, char& xs) {
+	while (reader.next(rec)) {
+		if (rec.isUnmapped()) continue;
+		rname=rec.refName();
+		if (rname==NULL) GError("Error: cannot retrieve target seq name from BAM record!\n");
+		rec.getNH_HI_XS(nh, hi, xs);
+		return true;
+	}
+	return false;
+}
+
+#ifndef NOTHREADS
+
+#if defined(_MSC_VER)
+ #define ALN_BARRIER() MemoryBarrier()
+#else
+ #define ALN_BARRIER() __sync_synchronize()
+#endif
+
+#define ALN_WAIT_DATA 0x01 //consumer waits for a loaded record
+#define ALN_WAIT_SLOT 0x02 //producer waits for a free slot
+
+GAlnPrefetch::GAlnPrefetch(GAlnSource& source, int ringdepth):src(source), ring(NULL),
+		depth(ringdepth), head(0), tail(0), done(false), stopping(false), waiting(0),
+		mutex(), haveAln(), haveSlot(), thread() {
+	if (depth<2) depth=2;
+	GMALLOC(ring, depth*sizeof(AlnSlot));
+	for (int i=0;i<depth;i++) {
+		ring[i].rec=new GBamRecord();
+		ring[i].rname=NULL;
+		ring[i].nh=1;
+		ring[i].hi=0;
+		ring[i].xs=0;
+	}
+	thread.kickStart(producer, (void*) this);
+}
+
+GAlnPrefetch::~GAlnPrefetch() {
+	mutex.lock();
+	stopping=true;
+	haveSlot.notify_one();
+	mutex.unlock();
+	thread.join();
+	for (int i=0;i<depth;i++) delete ring[i].rec;
+	GFREE(ring);
+}
+
+bool GAlnPrefetch::ready(int side) {
+	if (side==ALN_WAIT_DATA) return (tail!=head || done);
+	return (tail-head<(unsigned int)depth || stopping);
+}
+
+//block until the other side makes progress; the waiting bit is set before
+//the last check, so a wake() issued after that check cannot be missed
+void GAlnPrefetch::waitFor(int side) {
+	GConditionVar& cond = (side==ALN_WAIT_DATA) ? haveAln : haveSlot;
+	GLockGuard<GMutex> lock(mutex);
+	waiting|=side;
+	ALN_BARRIER();
+	while (!ready(side)) cond.wait(mutex);
+	waiting&=~side;
+}
+
+void GAlnPrefetch::wake(int side) {
+	ALN_BARRIER();
+	if (waiting & side) {
+		GLockGuard<GMutex> lock(mutex);
+		if (side==ALN_WAIT_DATA) haveAln.notify_one();
+		else haveSlot.notify_one();
+	}
+}
+
+void GAlnPrefetch::producer(GThreadData& td) {
+	GAlnPrefetch* pf=(GAlnPrefetch*)td.udata;
+	while (!pf->stopping) {
+		unsigned int t=pf->tail;
+		if (t-pf->head==(unsigned int)pf->depth) {
+			pf->waitFor(ALN_WAIT_SLOT);
+			continue;
+		}
+		AlnSlot& s=pf->ring[t%pf->depth];
+		if (!pf->src.next(*(s.rec), s.rname, s.nh, s.hi, s.xs)) break;
+		ALN_BARRIER(); //record data must be visible before the new tail
+		pf->tail=t+1;
+		pf->wake(ALN_WAIT_DATA);
+	}
+	ALN_BARRIER();
+	pf->done=true;
+	pf->wake(ALN_WAIT_DATA);
+}
+
+bool GAlnPrefetch::next(GBamRecord& rec, const char*& rname, int& nh, int& hi, char& xs) {
+	unsigned int h=head;
+	while (tail==h) {
+		if (done) {
+			ALN_BARRIER();
+			if (tail==h) return false;
+			break;
+		}
+		waitFor(ALN_WAIT_DATA);
+	}
+	ALN_BARRIER();
+	AlnSlot& s=ring[h%depth];
+	rec.exchange(*(s.rec));
+	rname=s.rname;
+	nh=s.nh;
+	hi=s.hi;
+	xs=s.xs;
+	ALN_BARRIER(); //done with the slot before it is handed back
+	head=h+1;
+	wake(ALN_WAIT_SLOT);
+	return true;
+}
+
+#endif
+
+//------------- digest writing
+
+static void digestWrite(FILE* f, const void* p, size_t len, uint64_t& fpos) {
+	if (len>0 && fwrite(p, 1, len, f)!=len)
+		GError("Error writing the digest file!\n");
+	fpos+=len;
+}
+
+static void digestPad(FILE* f, uint64_t& fpos) { //align to 8 bytes
+	static const char zeros[8]={0,0,0,0,0,0,0,0};
+	digestWrite(f, zeros, (8-fpos%8)%8, fpos);
+}
+
+//append the exons collected in fexons for the current reference section
+static void digestEndRef(FILE* f, FILE* fexons, GDigestRef& ref, uint64_t& fpos) {
+	char buf[65536];
+	ref.exonsofs=fpos;
+	size_t left=ref.numexons*sizeof(GDigestExon);
+	fflush(fexons);
+	rewind(fexons);
+	while (left>0) {
+		size_t n=fread(buf, 1, GMIN(left, sizeof(buf)), fexons);
+		if (n==0) GError("Error reading the temporary digest exon data!\n");
+		digestWrite(f, buf, n, fpos);
+		left-=n;
+	}
+	rewind(fexons);
+	digestPad(f, fpos);
+}
+
+void writeDigest(const char* bamfname, const char* fname) {
+	static uint32_t BAM_R2SINGLE = BAM_FREAD2 | BAM_FMUNMAP ;
+	FILE* f=fopen(fname, "wb");
+	if (f==NULL) GError("Error creating digest file %s\n", fname);
+	FILE* fexons=tmpfile(); //exon segments of the current reference section
+	if (fexons==NULL) GError("Error creating temporary file for the digest!\n");
+	GDigestHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, DIGEST_MAGIC, 8);
+	hdr.byteorder=DIGEST_BYTEORDER;
+	uint64_t fpos=0;
+	digestWrite(f, &hdr, sizeof(hdr), fpos);
+
+	GBamReader bamreader(bamfname);
+	if (num_cpus>1) bamreader.setReadAhead(num_cpus);
+	GBamRecord brec;
+	GVec<GDigestRef> refs;
+	GDigestRef ref;
+	GHash<int> seenrefs;
+	GHash<int> hashread; //read_name:pos:hit_index => read index, as in processRead()
+	GStr lastref;
+	int prev_pos=0;
+	unsigned long long int numreads=0;
+	while (bamreader.next(brec)) {
+		if (brec.isUnmapped()) continue;
+		const char* rname=brec.refName();
+		if (rname==NULL) GError("Error: cannot retrieve target seq name from BAM record!\n");
+		if (lastref.is_empty() || lastref!=rname) {
+			if (!lastref.is_empty()) {
+				digestEndRef(f, fexons, ref, fpos);
+				refs.Add(ref);
+			}
+			if (seenrefs[rname]) GError(ERR_BAM_SORT);
+			seenrefs.Add(rname, new int(1));
+			lastref=rname;
+			prev_pos=0;
+			hashread.Clear();
+			memset(&ref, 0, sizeof(ref));
+			ref.nameofs=fpos;
+			digestWrite(f, rname, strlen(rname)+1, fpos);
+			digestPad(f, fpos);
+			ref.readsofs=fpos;
+		}
+		int readstart=brec.start;
+		if (readstart<prev_pos) GError(ERR_BAM_SORT);
+		prev_pos=readstart;
+		if (ref.numreads==0x7FFFFFFF)
+			GError("Error: too many alignments on %s for the digest!\n", rname);
+		if (brec.exons.Count()>0xFFFF)
+			GError("Error: too many exons for alignment %s!\n", brec.name());
+		GDigestRead dr;
+		memset(&dr, 0, sizeof(dr));
+		brec.getNH_HI_XS(dr.nh, dr.hi, dr.xs);
+		if (dr.nh==0) dr.nh=1;
+		dr.exonidx=ref.numexons;
+		dr.numexons=brec.exons.Count();
+		dr.mate=-1;
+		if (!brec.isPaired() || ((brec.flags()&BAM_FREAD1)!=0) ||
+				((brec.flags()&BAM_R2SINGLE)==BAM_R2SINGLE ) )
+			dr.flags|=DIGEST_FRAG;
+		if (brec.refId()==brec.mate_refId()) {
+			//same mate pairing as processRead(), but across the whole reference
+			//sequence; pairs split by a bundle boundary are dropped at load time
+			int pairstart=brec.mate_start();
+			GStr id(brec.name());
+			id+=':';id+=readstart;id+=':';id+=dr.hi;
+			if (readstart<=pairstart) {
+				if (!hashread[id.chars()])
+					hashread.Add(id.chars(), new int(ref.numreads));
+			}
+			else {
+				GStr pairid(brec.name());
+				pairid+=':';pairid+=pairstart;pairid+=':';pairid+=dr.hi;
+				const int* np=hashread[pairid.chars()];
+				if (np) {
+					dr.mate=*np;
+					hashread.Remove(pairid.chars());
+					hashread.Remove(id.chars());
+				}
+			}
+		}
+		for (int i=0;i<brec.exons.Count();i++) {
+			GDigestExon e;
+			e.start=brec.exons[i].start;
+			e.end=brec.exons[i].end;
+			if (fwrite(&e, sizeof(e), 1, fexons)!=1)
+				GError("Error writing temporary digest exon data!\n");
+		}
+		ref.numexons+=brec.exons.Count();
+		digestWrite(f, &dr, sizeof(dr), fpos);
+		ref.numreads++;
+		numreads++;
+	}
+	bamreader.bclose();
+	if (!lastref.is_empty()) {
+		digestEndRef(f, fexons, ref, fpos);
+		refs.Add(ref);
+	}
+	fclose(fexons);
+	hdr.numrefs=refs.Count();
+	hdr.refsofs=fpos;
+	for (int i=0;i<refs.Count();i++)
+		digestWrite(f, &(refs[i]), sizeof(GDigestRef), fpos);
+	fseek(f, 0, SEEK_SET);
+	if (fwrite(&hdr, sizeof(hdr), 1, f)!=1)
+		GError("Error writing the digest file!\n");
+	fclose(f);
+	if (verbose) {
+		printTime(stderr);
+		GMessage(" %llu read alignments on %d reference sequences written to %s\n",
+				numreads, refs.Count(), fname);
+	}
+}
+
+//------------- digest reading
+
+bool GDigestSource::isDigest(const char* fname) {
+	FILE* f=fopen(fname, "rb");
+	if (f==NULL) return false;
+	char magic[8];
+	bool r=(fread(magic, 1, 8, f)==8 && memcmp(magic, DIGEST_MAGIC, 8)==0);
+	fclose(f);
+	return r;
+}
+
+void GDigestSource::bad_digest(const char* fname) {
+	GError("Error: invalid or truncated digest file %s\n", fname);
+}
+
+GDigestSource::GDigestSource(const char* fname):data(NULL), size(0), refs(NULL),
+		numrefs(0), r(-1), cur(0), last(0), reads(NULL), exons(NULL), bstart(0) {
+#ifndef __WIN32__
+	int fd=open(fname, O_RDONLY);
+	if (fd<0) GError("Error: cannot open digest file %s\n", fname);
+	struct stat st;
+	if (fstat(fd, &st)!=0) GError("Error: cannot access digest file %s\n", fname);
+	size=st.st_size;
+	if (size<sizeof(GDigestHeader)) bad_digest(fname);
+	void* p=mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p==MAP_FAILED) GError("Error: cannot map digest file %s in memory\n", fname);
+	close(fd);
+	data=(char*)p;
+	madvise(data, size, MADV_SEQUENTIAL);
+#else
+	FILE* f=fopen(fname, "rb");
+	if (f==NULL) GError("Error: cannot open digest file %s\n", fname);
+	fseeko(f, 0, SEEK_END);
+	size=ftello(f);
+	fseeko(f, 0, SEEK_SET);
+	if (size<sizeof(GDigestHeader)) bad_digest(fname);
+	GMALLOC(data, size);
+	if (fread(data, 1, size, f)!=size) bad_digest(fname);
+	fclose(f);
+#endif
+	GDigestHeader* hdr=(GDigestHeader*)data;
+	if (memcmp(hdr->magic, DIGEST_MAGIC, 8)!=0)
+		bad_digest(fname);
+	if (hdr->byteorder!=DIGEST_BYTEORDER)
+		GError("Error: digest file %s was written on a system with a different byte order!\n", fname);
+	if (hdr->refsofs+(uint64_t)hdr->numrefs*sizeof(GDigestRef)>size) bad_digest(fname);
+	numrefs=hdr->numrefs;
+	refs=(GDigestRef*)(data+hdr->refsofs);
+	for (int i=0;i<numrefs;i++) {
+		if (refs[i].nameofs>=size ||
+				refs[i].readsofs+(uint64_t)refs[i].numreads*sizeof(GDigestRead)>size ||
+				refs[i].exonsofs+(uint64_t)refs[i].numexons*sizeof(GDigestExon)>size)
+			bad_digest(fname);
+	}
+}
+
+GDigestSource::~GDigestSource() {
+#ifndef __WIN32__
+	if (data) munmap(data, size);
+#else
+	GFREE(data);
+#endif
+}
+
+void GDigestSource::setRef(int i) {
+	r=i;
+	cur=0;
+	if (r<numrefs) {
+		reads=(GDigestRead*)(data+refs[r].readsofs);
+		exons=(GDigestExon*)(data+refs[r].exonsofs);
+	}
+}
+
+bool GDigestSource::next(GBamRecord& rec, const char*& rname, int& nh, int& hi, char& xs) {
+	while (r<numrefs && (r<0 || cur>=refs[r].numreads)) setRef(r+1);
+	if (r>=numrefs) return false;
+	GDigestRead& dr=reads[cur];
+	if (dr.numexons==0 || dr.exonidx+dr.numexons>refs[r].numexons)
+		GError("Error: invalid digest read entry (%s, read %u)!\n", data+refs[r].nameofs, cur);
+	GDigestExon* e=exons+dr.exonidx;
+	rec.exons.setCount(dr.numexons);
+	for (int i=0;i<dr.numexons;i++) {
+		rec.exons[i].start=e[i].start;
+		rec.exons[i].end=e[i].end;
+	}
+	rec.start=e[0].start;
+	rec.end=e[dr.numexons-1].end;
+	rec.set_flags((dr.flags & DIGEST_FRAG) ? 0 : BAM_FPAIRED);
+	//no mate on the same reference, so the read is not paired by name;
+	//the digest mate link is given by mateLink() instead
+	rec.get_b()->core.tid=0;
+	rec.set_mdata(-1, -1);
+	rname=data+refs[r].nameofs;
+	nh=dr.nh;
+	hi=dr.hi;
+	xs=dr.xs;
+	last=cur++;
+	return true;
+}
+
+void GDigestSource::newBundle() {
+	bstart=last;
+}
+
+int GDigestSource::mateLink() {
+	int m=reads[last].mate;
+	if (m<0) return -2;
+	//the first mate must have been loaded in the same bundle
+	return (m>=(int)bstart) ? m-bstart : -1;
+}
@@ -0,0 +1,138 @@
+#ifndef __ALNINPUT_H__
+#define __ALNINPUT_H__
+#include "rlink.h"
+
+// source of read alignments for bundleReads(): a BAM/SAM file,
+// or a read digest file written earlier with --digest
+class GAlnSource {
+ public:
+	virtual ~GAlnSource() { }
+	//load the next mapped alignment into rec, along with the name of its
+	//reference sequence and its NH, HI and XS tag values;
+	//returns false when there are no more alignments
+	virtual bool next(GBamRecord& rec, const char*& rname, int& nh, int& hi, char& xs)=0;
+	//the last alignment returned by next() starts a new bundle
+	virtual void newBundle() { }
+	//for the last alignment returned by next(): bundle index of the first
+	//mate it pairs with, -1 if mates are paired by read name, or -2 if it
+	//might be the first mate of a later alignment
+	virtual int mateLink() { return -1; }
+};
+
+class GBamSource: public GAlnSource {
+	GBamReader& reader;
+ public:
+	GBamSource(GBamReader& bamreader):reader(bamreader) { }
+	bool next(GBamRecord& rec, const char*& rname, int& nh, int& hi, char& xs);
+};
+
+#ifndef NOTHREADS
+#include "GThreads.h"
+
+// decodes the alignments of another source in a separate thread, ahead of
+// the bundle builder; decoded records are passed through a lock-free
+// single-producer single-consumer ring of <depth> records, and a side
+// only blocks (on a condition variable) when the ring is empty or full;
+// the newBundle() and mateLink() calls are not passed on to the source
+class GAlnPrefetch: public GAlnSource {
+	struct AlnSlot {
+		GBamRecord* rec;
+		const char* rname;
+		int nh;
+		int hi;
+		char xs;
+	};
+	GAlnSource& src;
+	AlnSlot* ring;
+	int depth;
+	volatile unsigned int head; //number of records taken by the consumer
+	volatile unsigned int tail; //number of records loaded by the producer
+	volatile bool done; //producer reached the end of input
+	volatile bool stopping;
+	volatile int waiting; //which side is blocked, see waitFor()
+	GMutex mutex;
+	GConditionVar haveAln;
+	GConditionVar haveSlot;
+	GThread thread;
+	bool ready(int side);
+	void waitFor(int side);
+	void wake(int side);
+	static void producer(GThreadData& td);
+ public:
+	GAlnPrefetch(GAlnSource& source, int ringdepth);
+	~GAlnPrefetch();
+	bool next(GBamRecord& rec, const char*& rname, int& nh, int& hi, char& xs);
+};
+#endif
+
+// Read digest: a compact, memory-mappable file with only the alignment data
+// needed for bundle building: start, exon segments, XS strand, NH, HI,
+// fragment counting and mate pairing for each mapped read. Reads are kept in
+// input order, grouped by reference sequence, with an index of the reference
+// sections at the end of the file. Mate pairing is resolved when the digest
+// is written: each second mate stores the index of the read it pairs with,
+// so no read names are kept. Bundles are still built at load time, as their
+// boundaries depend on -g and on the guide transcripts (-G).
+// All values are written in the native byte order.
+
+#define DIGEST_MAGIC "STDIGST1"
+#define DIGEST_BYTEORDER 0x01020304
+
+#define DIGEST_FRAG 0x01 //read counts as a new fragment (see countRead())
+
+struct GDigestHeader {
+	char magic[8];
+	uint32_t byteorder;
+	uint32_t numrefs;
+	uint64_t refsofs; //file offset of the GDigestRef index
+};
+
+struct GDigestRef { //a reference sequence section
+	uint64_t nameofs;  //file offset of the sequence name (0 terminated)
+	uint64_t readsofs; //file offset of the GDigestRead array
+	uint64_t exonsofs; //file offset of the GDigestExon array
+	uint32_t numreads;
+	uint32_t numexons;
+};
+
+struct GDigestRead {
+	uint32_t exonidx; //first exon in the exon array of this section
+	int32_t mate;     //for the second mate of a pair: index of the first mate, otherwise -1
+	int32_t nh;
+	int32_t hi;
+	uint16_t numexons;
+	char xs;          //XS tag strand, or '.'
+	uint8_t flags;
+};
+
+struct GDigestExon {
+	int32_t start; //1-based
+	int32_t end;
+};
+
+//writes the read digest of a BAM/SAM file
+void writeDigest(const char* bamfname, const char* fname);
+
+class GDigestSource: public GAlnSource {
+	char* data; //the whole file, memory-mapped
+	size_t size;
+	GDigestRef* refs;
+	int numrefs;
+	int r;          //current reference section
+	uint32_t cur;   //next read to return
+	uint32_t last;  //last read returned
+	GDigestRead* reads;
+	GDigestExon* exons;
+	uint32_t bstart; //first read of the current bundle
+	void setRef(int i);
+	void bad_digest(const char* fname);
+ public:
+	static bool isDigest(const char* fname);
+	GDigestSource(const char* fname);
+	~GDigestSource();
+	bool next(GBamRecord& rec, const char*& rname, int& nh, int& hi, char& xs);
+	void newBundle();
+	int mateLink();
+};
+
+#endif
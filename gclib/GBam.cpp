@@ -430,6 +430,31 @@ switch (cop) {
      else return '.';
    }
 
+ void GBamRecord::getNH_HI_XS(int& nh, int& hi, char& xs) {
+   nh=0; hi=0; xs='.';
+   bool nh_found=false, hi_found=false, xs_found=false;
+   uint8_t* s=bam1_aux(b);
+   uint8_t* aux_end=b->data+b->data_len;
+   while (s < aux_end) {
+     int x = (int)s[0]<<8 | s[1];
+     s += 2;
+     //only the first occurrence of a tag counts, like bam_aux_get()
+     if (x==('N'<<8|'H') && !nh_found) { nh=bam_aux2i(s); nh_found=true; }
+     else if (x==('H'<<8|'I') && !hi_found) { hi=bam_aux2i(s); hi_found=true; }
+     else if (x==('X'<<8|'S') && !xs_found) {
+       char c=bam_aux2A(s);
+       if (c) xs=c;
+       xs_found=true;
+       }
+     if (nh_found && hi_found && xs_found) break;
+     int type = toupper(*s);
+     ++s;
+     if (type == 'Z' || type == 'H') { while (*s) ++s; ++s; }
+     else if (type == 'B') s += 5 + bam_aux_type2size(*s) * (*(int32_t*)(s+1));
+     else s += bam_aux_type2size(type);
+     }
+   }
+
  char* GBamRecord::sequence() { //user must free this after use
    char *s = (char*)bam1_seq(b);
    char* qseq=NULL;
@@ -467,3 +492,275 @@ switch (cop) {
       }
    return str.s;
    }
+
+//like bam_read1() but the sequence and quality strings are skipped;
+//core.l_qseq is set to 0 so the aux data directly follows the CIGAR
+static int bam_read1_noseq(BGZF* fp, bam1_t* b) {
+  bam1_core_t *c = &b->core;
+  int32_t block_len, ret;
+  uint32_t x[8];
+  if ((ret = bgzf_read(fp, &block_len, 4)) != 4) {
+    if (ret == 0) return -1; // normal end-of-file
+    else return -2; // truncated
+    }
+  if (bgzf_read(fp, x, BAM_CORE_SIZE) != (int)BAM_CORE_SIZE) return -3;
+  c->tid = x[0]; c->pos = x[1];
+  c->bin = x[2]>>16; c->qual = x[2]>>8&0xff; c->l_qname = x[2]&0xff;
+  c->flag = x[3]>>16; c->n_cigar = x[3]&0xffff;
+  c->mtid = x[5]; c->mpos = x[6]; c->isize = x[7];
+  int l_qseq = x[4];
+  int l_head = c->l_qname + c->n_cigar*4;
+  int l_seq = (l_qseq+1)/2 + l_qseq;
+  c->l_qseq = 0;
+  b->data_len = block_len - (int)BAM_CORE_SIZE - l_seq;
+  if (b->data_len < l_head) return -4;
+  if (b->m_data < b->data_len) {
+    b->m_data = b->data_len;
+    kroundup32(b->m_data);
+    b->data = (uint8_t*)realloc(b->data, b->m_data);
+    }
+  b->l_aux = b->data_len - l_head;
+  if (bgzf_read(fp, b->data, l_head) != l_head) return -4;
+  if (bgzf_skip(fp, l_seq) != l_seq) return -4;
+  if (bgzf_read(fp, b->data + l_head, b->l_aux) != b->l_aux) return -4;
+  return 4 + block_len;
+}
+
+bool GBamReader::next(GBamRecord& rec, bool full) {
+  if (bam_file==NULL)
+    GError("Warning: GBamReader::next() called with no open file.\n");
+  if (rec.b==NULL || !rec.novel) { //never write into a borrowed bam1_t
+    rec.b=bam_init1();
+    rec.novel=true;
+    }
+  int r;
+  if (iter) r=bam_iter_read(bam_file->x.bam, iter, rec.b);
+  else if (!full && (bam_file->type & FTYPE_BAM) && !bam_is_be)
+    r=bam_read1_noseq(bam_file->x.bam, rec.b);
+  else r=samread(bam_file, rec.b);
+  if (r<0) return false;
+  rec.bam_header=bam_file->header;
+  rec.exons.setCount(0);
+  rec.setupCoordinates();
+  return true;
+}
+
+//from bam_index.c, not exported in bam.h
+extern "C" {
+ bam_index_t *bam_index_core(bamFile fp);
+ bam_index_t *bam_index_load_local(const char *fn);
+ void bam_index_save(const bam_index_t *idx, FILE *fp);
+}
+
+bam_index_t* GBamReader::loadIndex(const char* fname) {
+  bam_index_t* idx=bam_index_load_local(fname);
+  if (idx!=NULL) return idx;
+  if (bgzf_check_bgzf(fname)!=1) return NULL;
+  bamFile fp=bam_open(fname, "r");
+  if (fp==NULL) return NULL;
+  idx=bam_index_core(fp);
+  bam_close(fp);
+  if (idx==NULL) return NULL;
+  char* fnidx=NULL;
+  GMALLOC(fnidx, strlen(fname)+5);
+  strcpy(fnidx, fname);
+  strcat(fnidx, ".bai");
+  FILE* fidx=fopen(fnidx, "wb");
+  if (fidx!=NULL) {
+    bam_index_save(idx, fidx);
+    fclose(fidx);
+    }
+  GFREE(fnidx);
+  return idx;
+}
+
+//---------- BGZF read-ahead
+#ifndef NOTHREADS
+#include "GThreads.h"
+
+enum { RA_FREE=0, RA_BUSY, RA_READY, RA_EOF, RA_ERROR };
+
+struct GBamRABlock {
+  void* cdata; //compressed block as read from the file
+  int clen;
+  int64_t addr; //file offset of the compressed block
+  void* udata; //inflated data, swapped into the BGZF buffer when handed out
+  int ulen;
+  int state;
+};
+
+struct GBamRAHook: public bgzf_readahead_t {
+  GBamReadAhead* ra;
+};
+
+class GBamReadAhead {
+ public:
+  BGZF* fp;
+  GBamRAHook hook;
+  GBamRABlock* blocks; //ring of blocks in file order
+  int nblocks;
+  int head; //next block to be handed to bgzf_read_block()
+  int tail; //next block to be read from the file
+  int queued; //blocks between head and tail
+  int inflating; //blocks being inflated outside the lock
+  bool eof;
+  bool paused;
+  bool stopping;
+  GMutex mutex;
+  GConditionVar haveBlock; //a block was inflated
+  GConditionVar haveSlot; //a block was handed out (or stop/seek happened)
+  GThread* threads;
+  int nthreads;
+
+  static void worker(GThreadData& td) {
+    GBamReadAhead* ra=(GBamReadAhead*)td.udata;
+    ra->mutex.lock();
+    while (!ra->stopping) {
+      if (ra->paused || ra->eof || ra->queued==ra->nblocks) {
+        ra->haveSlot.wait(ra->mutex);
+        continue;
+        }
+      //claim the next block; file reads are done under the lock so
+      //blocks are always taken in file order
+      GBamRABlock& blk=ra->blocks[ra->tail];
+      ra->tail=(ra->tail+1)%ra->nblocks;
+      ra->queued++;
+      blk.clen=bgzf_read_raw_block(ra->fp, blk.cdata, &blk.addr);
+      if (blk.clen<=0) {
+        blk.state=(blk.clen==0) ? RA_EOF : RA_ERROR;
+        ra->eof=true;
+        ra->haveBlock.notify_all();
+        continue;
+        }
+      blk.state=RA_BUSY;
+      ra->inflating++;
+      ra->mutex.unlock();
+      blk.ulen=bgzf_inflate_raw_block(blk.cdata, blk.clen, blk.udata, ra->fp->uncompressed_block_size);
+      ra->mutex.lock();
+      blk.state=(blk.ulen<0) ? RA_ERROR : RA_READY;
+      ra->inflating--;
+      ra->haveBlock.notify_all();
+      }
+    ra->mutex.unlock();
+  }
+
+  static int next_block(bgzf_readahead_t* h, BGZF* fp) {
+    GBamReadAhead* ra=((GBamRAHook*)h)->ra;
+    GLockGuard<GMutex> lock(ra->mutex);
+    GBamRABlock& blk=ra->blocks[ra->head];
+    while (blk.state==RA_FREE || blk.state==RA_BUSY)
+      ra->haveBlock.wait(ra->mutex);
+    if (blk.state==RA_EOF) { //stays there until a seek
+      fp->block_length=0;
+      ra->hook.next_address=blk.addr;
+      return 0;
+      }
+    if (blk.state==RA_ERROR) {
+      if (fp->error==NULL) fp->error="inflate failed";
+      return -1;
+      }
+    void* p=fp->uncompressed_block;
+    fp->uncompressed_block=blk.udata;
+    blk.udata=p;
+    if (fp->block_length!=0) fp->block_offset=0; //not right after a seek
+    fp->block_address=blk.addr;
+    fp->block_length=blk.ulen;
+    ra->hook.next_address=blk.addr+blk.clen;
+    blk.state=RA_FREE;
+    ra->head=(ra->head+1)%ra->nblocks;
+    ra->queued--;
+    ra->haveSlot.notify_one();
+    return 0;
+  }
+
+  static int file_seek(BGZF* fp, int64_t addr) {
+#ifdef _USE_KNETFILE
+    return knet_seek(fp->x.fpr, addr, SEEK_SET);
+#else
+    return fseeko(fp->file, addr, SEEK_SET);
+#endif
+  }
+
+  static int seek(bgzf_readahead_t* h, BGZF* fp, int64_t block_address) {
+    GBamReadAhead* ra=((GBamRAHook*)h)->ra;
+    GLockGuard<GMutex> lock(ra->mutex);
+    ra->paused=true;
+    while (ra->inflating>0) ra->haveBlock.wait(ra->mutex);
+    for (int i=0;i<ra->nblocks;i++) ra->blocks[i].state=RA_FREE;
+    ra->head=0;
+    ra->tail=0;
+    ra->queued=0;
+    ra->eof=false;
+    ra->paused=false;
+    int r=file_seek(fp, block_address);
+    ra->hook.next_address=block_address;
+    ra->haveSlot.notify_all();
+    return (r==0) ? 0 : -1;
+  }
+
+  GBamReadAhead(BGZF* bgzf, int nthr):fp(bgzf), hook(), blocks(NULL), nblocks(nthr*4),
+      head(0), tail(0), queued(0), inflating(0), eof(false), paused(false),
+      stopping(false), mutex(), haveBlock(), haveSlot(), threads(NULL), nthreads(nthr) {
+    if (nblocks<8) nblocks=8;
+    GCALLOC(blocks, nblocks*sizeof(GBamRABlock));
+    for (int i=0;i<nblocks;i++) {
+      GMALLOC(blocks[i].cdata, fp->compressed_block_size);
+      GMALLOC(blocks[i].udata, fp->uncompressed_block_size);
+      }
+    hook.ra=this;
+    hook.next_block=next_block;
+    hook.seek=seek;
+#ifdef _USE_KNETFILE
+    hook.next_address=knet_tell(fp->x.fpr);
+#else
+    hook.next_address=ftello(fp->file);
+#endif
+    fp->readahead=&hook;
+    threads=new GThread[nthreads];
+    for (int t=0;t<nthreads;t++)
+      threads[t].kickStart(worker, (void*)this);
+  }
+
+  ~GBamReadAhead() {
+    mutex.lock();
+    stopping=true;
+    mutex.unlock();
+    haveSlot.notify_all();
+    for (int t=0;t<nthreads;t++)
+      threads[t].join();
+    delete[] threads;
+    fp->readahead=NULL;
+    for (int i=0;i<nblocks;i++) {
+      GFREE(blocks[i].cdata);
+      GFREE(blocks[i].udata);
+      }
+    GFREE(blocks);
+  }
+};
+
+void GBamReader::setReadAhead(int nthreads) {
+  ra_threads=nthreads;
+  if (readahead!=NULL || nthreads<=0 || bam_file==NULL
+        || (bam_file->type & FTYPE_BAM)==0) return;
+  readahead=new GBamReadAhead(bam_file->x.bam, nthreads);
+}
+
+void GBamReader::stopReadAhead() {
+  if (readahead==NULL) return;
+  //put the file back right after the last block handed out
+  BGZF* fp=bam_file->x.bam;
+  int64_t next=readahead->hook.next_address;
+  delete readahead;
+  readahead=NULL;
+  GBamReadAhead::file_seek(fp, next);
+}
+
+#else
+
+void GBamReader::setReadAhead(int nthreads) {
+  ra_threads=nthreads;
+}
+
+void GBamReader::stopReadAhead() { }
+
+#endif
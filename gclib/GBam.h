@@ -7,6 +7,7 @@
 
 class GBamReader;
 class GBamWriter;
+class GBamReadAhead;
 
 class GBamRecord: public GSeg {
    friend class GBamReader;
@@ -71,6 +72,18 @@ class GBamRecord: public GSeg {
         bam_header=NULL;
         }
 
+     //take over the alignment loaded in r (without copying its bam1_t data);
+     //r gets this record's bam1_t in exchange, to be reused for loading
+     void exchange(GBamRecord& r) {
+        bam1_t* rb=r.b; r.b=b; b=rb;
+        bool rnovel=r.novel; r.novel=novel; novel=rnovel;
+        bam_header_t* rh=r.bam_header; r.bam_header=bam_header; bam_header=rh;
+        start=r.start;
+        end=r.end;
+        exons.setCount(r.exons.Count());
+        for (int i=0;i<r.exons.Count();i++) exons[i]=r.exons[i];
+        }
+
     ~GBamRecord() {
        clear();
        }
@@ -171,6 +184,9 @@ class GBamRecord: public GSeg {
  int tag_int(const char tag[2]); //return numeric value of tag (for numeric types)
  char tag_char(const char tag[2]); //return char value of tag (for type 'A')
  char spliceStrand(); // '+', '-' from the XS tag, or '.' if no XS tag
+ //NH, HI and XS from a single pass over the aux data, with the same
+ //values tag_int("NH"), tag_int("HI") and spliceStrand() would return
+ void getNH_HI_XS(int& nh, int& hi, char& xs);
 
  char* sequence(); //user should free after use
  char* qualities();//user should free after use
@@ -184,6 +200,9 @@ class GBamRecord: public GSeg {
 class GBamReader {
    samfile_t* bam_file;
    char* fname;
+   GBamReadAhead* readahead; //parallel BGZF inflate, if enabled
+   int ra_threads;
+   bam_iter_t iter; //region iterator, if setRegion() was called
    // from bam_import.c:
    struct samtools_tamFile_t {
    	gzFile fp;
@@ -219,18 +238,39 @@ class GBamReader {
       if (bam_file==NULL)
          GError("Error: could not open SAM file %s!\n",filename);
       fname=Gstrdup(filename);
+      if (ra_threads>0) setReadAhead(ra_threads);
       }
-   GBamReader(const char* fn) {
-      bam_file=NULL;
-      fname=NULL;
+   GBamReader(const char* fn):bam_file(NULL), fname(NULL),
+                               readahead(NULL), ra_threads(0), iter(NULL) {
       bopen(fn);
       }
 
+   //load the .bai index for a BAM file; if there is none, the index is
+   //built in memory and saved as <fname>.bai when possible.
+   //Returns NULL if fname is not a BAM file.
+   static bam_index_t* loadIndex(const char* fname);
+   //restrict next() to the alignments on reference tid overlapping the
+   //0-based interval [beg, end), using an index from loadIndex()
+   void setRegion(bam_index_t* idx, int tid, int beg=0, int end=1<<29) {
+      if (bam_file==NULL || (bam_file->type & FTYPE_BAM)==0)
+         GError("Error: GBamReader::setRegion() requires an open BAM file.\n");
+      if (iter) bam_iter_destroy(iter);
+      iter=bam_iter_query(idx, tid, beg, end);
+      }
+
+   //start a pool of nthreads threads inflating upcoming BGZF blocks
+   //in parallel; records are still returned in file order by next().
+   //Only BAM input can use it, for SAM text input this is a no-op.
+   void setReadAhead(int nthreads);
+   void stopReadAhead();
+
    bam_header_t* header() {
       return bam_file? bam_file->header : NULL;
       }
    void bclose() {
       if (bam_file) {
+        stopReadAhead();
+        if (iter) { bam_iter_destroy(iter); iter=NULL; }
         samclose(bam_file);
         bam_file=NULL;
         }
@@ -262,11 +302,17 @@ class GBamReader {
      GFREE(ifname);
      }
 
+   //reusable record interface: reads the next alignment into rec, keeping
+   //its bam1_t and exon buffers; unless full is true, the read sequence and
+   //qualities are skipped for BAM input (rec.sequence() will be empty)
+   bool next(GBamRecord& rec, bool full=false);
+
    GBamRecord* next() {
       if (bam_file==NULL)
         GError("Warning: GBamReader::next() called with no open file.\n");
       bam1_t* b = bam_init1();
-      if (samread(bam_file, b) >= 0) {
+      int r = iter ? bam_iter_read(bam_file->x.bam, iter, b) : samread(bam_file, b);
+      if (r >= 0) {
         GBamRecord* bamrec=new GBamRecord(b, bam_file->header, true);
         return bamrec;
         }
@@ -0,0 +1,311 @@
+#include "GOutBuf.h"
+#include "GVec.hh"
+#include "bgzf.h"
+#include <math.h>
+#ifndef NOTHREADS
+#include "GThreads.h"
+#endif
+
+static const uint64 pow10tab[10]={1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL,
+		100000ULL, 1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL};
+
+//decimal digits of v, written backwards from the end of buf
+static char* fmtDigits(char* end, uint64 v, int mindigits=1) {
+	char* p=end;
+	while (v>0 || mindigits>0) {
+		*--p='0'+(v%10);
+		v/=10;
+		mindigits--;
+	}
+	return p;
+}
+
+int fmtFixed(char* buf, int bufsize, double v, int prec) {
+#ifdef __SIZEOF_INT128__
+	if (prec>=0 && prec<=9 && fabs(v)<1e9) { //false for NaN
+		//v is m/2^s exactly, so v*10^prec can be rounded exactly
+		//(to nearest, ties to even) like glibc's printf does
+		uint64 q=0;
+		if (v!=0) {
+			int k;
+			double fr=frexp(fabs(v), &k); //v=fr*2^k, fr in [0.5, 1)
+			uint64 m=(uint64)ldexp(fr, 53);
+			int s=53-k; //>23 as |v|<2^30
+			if (s<100) { //otherwise m*10^prec<2^83 is below half of 2^s
+				unsigned __int128 n=(unsigned __int128)m*pow10tab[prec];
+				q=(uint64)(n>>s);
+				unsigned __int128 r=n-((unsigned __int128)q<<s);
+				unsigned __int128 half=((unsigned __int128)1)<<(s-1);
+				if (r>half || (r==half && (q&1))) q++;
+			}
+		}
+		char tmp[32];
+		char* end=tmp+32;
+		char* p=end;
+		if (prec>0) {
+			p=fmtDigits(p, q%pow10tab[prec], prec);
+			*--p='.';
+		}
+		p=fmtDigits(p, q/pow10tab[prec]);
+		if (signbit(v)) *--p='-';
+		int n=end-p;
+		if (n<bufsize) memcpy(buf, p, n);
+		return n;
+	}
+#endif
+	return snprintf(buf, bufsize, "%.*f", prec, v);
+}
+
+//---------- BGZF compression
+#define BGZF_BLOCK 0xff00 //uncompressed bytes per block, always fits in a BGZF block
+#define BGZF_CBLOCK 0x10000 //maximum size of a compressed block
+
+enum { BZ_FREE=0, BZ_QUEUED, BZ_BUSY, BZ_DONE };
+
+struct GBgzfBlock {
+	char* udata;
+	int ulen;
+	char* cdata;
+	int clen;
+	int state;
+};
+
+// the blocks are filled in a ring by the writing thread, compressed in
+// parallel by the pool threads and written to the file in order by the
+// thread that compresses the block whose turn came
+class GBgzfWriter {
+ public:
+	FILE* f;
+	int level;
+	GBgzfBlock* blocks;
+	int nblocks;
+	int fill; //block being filled
+	int next; //next block to compress
+	int head; //next block to write to the file
+	int64 addr; //file offset of the next block written
+	GVec<int64> addrs; //file offset of each block written
+#ifndef NOTHREADS
+	GMutex mutex;
+	GConditionVar haveWork; //a block was queued, or stopping
+	GConditionVar haveSlot; //a block was written to the file
+	bool stopping;
+	GThread* threads;
+#endif
+	int nthreads; //0: blocks are compressed by the writing thread
+	bool closed;
+
+	void compress(GBgzfBlock& b) {
+		b.clen=bgzf_deflate_raw_block(b.udata, b.ulen, b.cdata, BGZF_CBLOCK, level);
+		if (b.clen<=0) GError("Error: BGZF compression failed!\n");
+	}
+
+	void writeBlock(GBgzfBlock& b) {
+		if (fwrite(b.cdata, 1, b.clen, f)!=(size_t)b.clen)
+			GError("Error writing output!\n");
+		addrs.Add(addr);
+		addr+=b.clen;
+	}
+
+#ifndef NOTHREADS
+	void writeDone() { //with the mutex locked
+		while (blocks[head].state==BZ_DONE) {
+			writeBlock(blocks[head]);
+			blocks[head].state=BZ_FREE;
+			blocks[head].ulen=0;
+			head=(head+1)%nblocks;
+			haveSlot.notify_all();
+		}
+	}
+
+	static void worker(GThreadData& td) {
+		GBgzfWriter* z=(GBgzfWriter*)td.udata;
+		z->mutex.lock();
+		while (true) {
+			GBgzfBlock& b=z->blocks[z->next];
+			if (b.state!=BZ_QUEUED) {
+				if (z->stopping) break;
+				z->haveWork.wait(z->mutex);
+				continue;
+			}
+			b.state=BZ_BUSY;
+			z->next=(z->next+1)%z->nblocks;
+			z->mutex.unlock();
+			z->compress(b);
+			z->mutex.lock();
+			b.state=BZ_DONE;
+			z->writeDone();
+		}
+		z->mutex.unlock();
+	}
+#endif
+
+	//hand over the filled block and move on to the next one
+	void submit() {
+		GBgzfBlock& b=blocks[fill];
+#ifndef NOTHREADS
+		if (nthreads>0) {
+			GLockGuard<GMutex> lock(mutex);
+			b.state=BZ_QUEUED;
+			haveWork.notify_one();
+			fill=(fill+1)%nblocks;
+			while (blocks[fill].state!=BZ_FREE) haveSlot.wait(mutex);
+			return;
+		}
+#endif
+		compress(b);
+		writeBlock(b);
+		b.ulen=0;
+	}
+
+	void write(const char* data, size_t n) {
+		while (n>0) {
+			GBgzfBlock& b=blocks[fill];
+			int c=GMIN((size_t)(BGZF_BLOCK-b.ulen), n);
+			memcpy(b.udata+b.ulen, data, c);
+			b.ulen+=c;
+			data+=c;
+			n-=c;
+			if (b.ulen==BGZF_BLOCK) submit();
+		}
+	}
+
+	void close() {
+		if (blocks[fill].ulen>0) submit();
+#ifndef NOTHREADS
+		if (nthreads>0) {
+			mutex.lock();
+			while (head!=fill) haveSlot.wait(mutex);
+			stopping=true;
+			mutex.unlock();
+			haveWork.notify_all();
+			for (int t=0;t<nthreads;t++)
+				threads[t].join();
+			delete[] threads;
+			threads=NULL;
+			nthreads=0;
+		}
+#endif
+		submit(); //the empty EOF marker block
+		fflush(f);
+		closed=true;
+	}
+
+	GBgzfWriter(FILE* fout, int nthr, int zlevel):f(fout), level(zlevel), blocks(NULL),
+			nblocks(1), fill(0), next(0), head(0), addr(ftello(fout)), addrs(),
+#ifndef NOTHREADS
+			mutex(), haveWork(), haveSlot(), stopping(false), threads(NULL),
+#endif
+			nthreads(nthr>0 ? nthr : 0), closed(false) {
+#ifdef NOTHREADS
+		nthreads=0; //no compression threads without thread support
+#endif
+		if (nthreads>0) nblocks=nthreads*4;
+		if (addr<0) addr=0; //not seekable (pipe)
+		GCALLOC(blocks, nblocks*sizeof(GBgzfBlock));
+		for (int i=0;i<nblocks;i++) {
+			GMALLOC(blocks[i].udata, BGZF_BLOCK);
+			GMALLOC(blocks[i].cdata, BGZF_CBLOCK);
+		}
+#ifndef NOTHREADS
+		if (nthreads>0) {
+			threads=new GThread[nthreads];
+			for (int t=0;t<nthreads;t++)
+				threads[t].kickStart(worker, (void*)this);
+		}
+#endif
+	}
+
+	~GBgzfWriter() {
+		for (int i=0;i<nblocks;i++) {
+			GFREE(blocks[i].udata);
+			GFREE(blocks[i].cdata);
+		}
+		GFREE(blocks);
+	}
+};
+
+//---------- GOutBuf
+
+GOutBuf::GOutBuf(FILE* fout, int bufcap):f(fout), bgzf(NULL), buf(NULL), cap(bufcap),
+		len(0), flushed(0) {
+	if (cap<64) cap=64;
+	GMALLOC(buf, cap);
+}
+
+GOutBuf::~GOutBuf() {
+	close();
+	delete bgzf;
+	GFREE(buf);
+}
+
+void GOutBuf::setBgzf(int nthreads, int level) {
+	if (f==NULL || bgzf!=NULL || tell()>0) return;
+	bgzf=new GBgzfWriter(f, nthreads, level);
+}
+
+void GOutBuf::grow(int n) {
+	flush();
+	if (len+n<=cap) return;
+	cap=GMAX(cap*2, len+n);
+	GREALLOC(buf, cap);
+}
+
+void GOutBuf::writeOut(const char* data, size_t n) {
+	if (bgzf) bgzf->write(data, n);
+	else if (fwrite(data, 1, n, f)!=n)
+		GError("Error writing output!\n");
+	flushed+=n;
+}
+
+void GOutBuf::flush() {
+	if (f==NULL || len==0) return;
+	writeOut(buf, len);
+	len=0;
+}
+
+void GOutBuf::close() {
+	flush();
+	if (bgzf && !bgzf->closed) bgzf->close();
+}
+
+int64 GOutBuf::voffset(uint64 pos) {
+	if (bgzf==NULL) return pos;
+	int b=pos/BGZF_BLOCK;
+	if (b>=bgzf->addrs.Count()) b=bgzf->addrs.Count()-1;
+	return (bgzf->addrs[b]<<16) | (pos-(uint64)b*BGZF_BLOCK);
+}
+
+char* GOutBuf::detach(size_t& n) {
+	char* r=buf;
+	n=len;
+	buf=NULL;
+	cap=0;
+	len=0;
+	return r;
+}
+
+GOutBuf& GOutBuf::addInt(int64 v) {
+	char tmp[24];
+	char* end=tmp+24;
+	char* p=fmtDigits(end, v<0 ? -(uint64)v : (uint64)v);
+	if (v<0) *--p='-';
+	return add(p, end-p);
+}
+
+GOutBuf& GOutBuf::addUInt(uint64 v) {
+	char tmp[24];
+	char* end=tmp+24;
+	char* p=fmtDigits(end, v);
+	return add(p, end-p);
+}
+
+GOutBuf& GOutBuf::addFloat(double v, int prec) {
+	if (cap-len<32) grow(32);
+	int n=fmtFixed(buf+len, cap-len, v, prec);
+	if (n>=cap-len) { //only for values given to snprintf
+		grow(n+1);
+		n=fmtFixed(buf+len, cap-len, v, prec);
+	}
+	len+=n;
+	return *this;
+}
@@ -0,0 +1,73 @@
+/*
+GOutBuf is a buffered text writer with its own integer and fixed-precision
+   float formatting, meant for large tabular outputs (GTF, ctab); the text
+   is the same as printf's %d, %u and %.<prec>f would produce (C locale).
+   The buffer is written to a FILE when it fills up, or if no FILE is given,
+   it grows as needed and the text can be taken with detach().
+   The FILE output can be BGZF compressed (gzip compatible, in independent
+   blocks of 0xff00 bytes), with the blocks compressed by a pool of threads.
+*/
+
+#ifndef G_OUTBUF_DEFINED
+#define G_OUTBUF_DEFINED
+
+#include "GBase.h"
+
+class GBgzfWriter;
+
+class GOutBuf {
+	FILE* f; //NULL: the text is kept in memory
+	GBgzfWriter* bgzf;
+	char* buf;
+	int cap;
+	int len;
+	uint64 flushed; //bytes written out before buf
+	void grow(int n); //make room for n more bytes
+	void writeOut(const char* data, size_t n);
+ public:
+	GOutBuf(FILE* fout=NULL, int bufcap=65536);
+	~GOutBuf(); //calls close(), the FILE is left open
+	//compress the output with BGZF, using nthreads threads (0: compress in
+	//the writing thread); must be called before anything is written
+	void setBgzf(int nthreads, int level=-1);
+	void flush();
+	//flush, and for BGZF output write the last block and the EOF marker
+	void close();
+	uint64 tell() { return flushed+len; } //uncompressed bytes written so far
+	//BGZF virtual offset (compressed block offset<<16 | offset in block)
+	//of an uncompressed position in the output; only valid after close()
+	int64 voffset(uint64 pos);
+	char* detach(size_t& n); //in-memory text, to be deallocated with GFREE()
+	GOutBuf& add(char c) {
+		if (len==cap) grow(1);
+		buf[len++]=c;
+		return *this;
+	}
+	GOutBuf& add(const char* s, size_t n) {
+		if (len+n>(size_t)cap) {
+			if (f && n>=(size_t)cap) { //large blocks are not copied
+				flush();
+				writeOut(s, n);
+				return *this;
+			}
+			grow(n);
+		}
+		memcpy(buf+len, s, n);
+		len+=n;
+		return *this;
+	}
+	GOutBuf& add(const char* s) { //NULL is written as "(null)", like glibc's printf
+		return s ? add(s, strlen(s)) : add("(null)", 6);
+	}
+	GOutBuf& addInt(int64 v);
+	GOutBuf& addUInt(uint64 v);
+	//v rounded to prec decimals (0..9), like printf's "%.<prec>f"
+	GOutBuf& addFloat(double v, int prec=6);
+};
+
+//formats v as printf("%.<prec>f") would, into buf (at least 32 bytes
+//for values below 1e9, larger values and prec>9 are given to snprintf);
+//returns the length of the text
+int fmtFixed(char* buf, int bufsize, double v, int prec);
+
+#endif
@@ -7,6 +7,7 @@ Sortable collection of pointers to objects
 #define _GVec_HH
 
 #include "GBase.h"
+#include <new>
 
 #define GVEC_INDEX_ERR "GVec error: invalid index: %d\n"
  #if defined(NDEBUG) || defined(NODEBUG) || defined(_NDEBUG) || defined(NO_DEBUG)
@@ -63,6 +64,16 @@ template <class OBJ> int DefLTCompareProc(const pointer p1, const pointer p2) {
    else return ((o2 < o1) ? 1 : 0 );
 }
 
+//storage for the item arrays of a GVec or GPVec, used instead of the heap
+//(e.g. a memory pool that is reclaimed at once); freeItems() gets the size
+//the array was allocated with, and may be given NULL
+class GVecAlloc {
+  public:
+    virtual void* allocItems(size_t size)=0;
+    virtual void freeItems(void* p, size_t size)=0;
+    virtual ~GVecAlloc() { }
+};
+
 //basic template for array of objects;
 //so it doesn't require comparison operators to be defined
 template <class OBJ> class GVec {
@@ -70,9 +81,13 @@ template <class OBJ> class GVec {
     OBJ* fArray;
     int fCount;
     int fCapacity;
+    GVecAlloc* fAlloc; //NULL: the item array is on the heap
+    OBJ* newArray(int cap);
+    void freeArray(OBJ* a, int cap);
     void qSort(int L, int R, GCompareProc* cmpFunc);
   public:
     GVec(int init_capacity=2);
+    explicit GVec(GVecAlloc* alloc, int init_capacity=0); //items are stored by alloc
     GVec(int init_count, const OBJ init_val);
     GVec(int init_count, OBJ* init_val, bool delete_initval=true); //convenience constructor for complex vectors
     GVec(GVec<OBJ>& array); //copy constructor
@@ -146,7 +161,9 @@ template <class OBJ> class GPVec {
     int fCount; //total number of entries in list
     int fCapacity; //current allocated size
     GFreeProc* fFreeProc; //useful for deleting objects
+    GVecAlloc* fAlloc; //NULL: the pointer array is on the heap
     //---
+    void resizeList(int NewCapacity);
     void Expand();
     void Grow();
     void Grow(int idx, OBJ* newitem);
@@ -158,6 +175,7 @@ template <class OBJ> class GPVec {
     virtual ~GPVec();
     GPVec(int init_capacity=2, bool free_elements=true); //also the default constructor
     GPVec(bool free_elements);
+    GPVec(GVecAlloc* alloc, bool free_elements=true); //pointers are stored by alloc
     GPVec(GPVec<OBJ>& list); //copy constructor?
     GPVec(GPVec<OBJ>* list); //kind of a copy constructor
     const GPVec<OBJ>& operator=(GPVec<OBJ>& list);
@@ -207,15 +225,25 @@ template <class OBJ> GVec<OBJ>::GVec(int init_capacity) {
   fCount=0;
   fCapacity=0;
   fArray=NULL;
+  fAlloc=NULL;
   setCapacity(init_capacity);
   //if (set_count) fCount = init_capacity;
 }
 
+template <class OBJ> GVec<OBJ>::GVec(GVecAlloc* alloc, int init_capacity) {
+  fCount=0;
+  fCapacity=0;
+  fArray=NULL;
+  fAlloc=alloc;
+  setCapacity(init_capacity);
+}
+
 
 template <class OBJ> GVec<OBJ>::GVec(int init_count, const OBJ init_val) {
   fCount=0;
   fCapacity=0;
   fArray=NULL;
+  fAlloc=NULL;
   setCapacity(init_count);
   fCount = init_count;
   for (int i=0;i<fCount;i++)
@@ -226,6 +254,7 @@ template <class OBJ> GVec<OBJ>::GVec(int init_count, OBJ* init_val, bool delete_
 	  fCount=0;
 	  fCapacity=0;
 	  fArray=NULL;
+	  fAlloc=NULL;
 	  setCapacity(init_count);
 	  fCount = init_count;
 	  for (int i=0;i<fCount;i++)
@@ -238,6 +267,7 @@ template <class OBJ> GVec<OBJ>::GVec(GVec<OBJ>& array) { //copy constructor
  this->fCount=array.fCount;
  this->fCapacity=array.fCapacity;
  this->fArray=NULL;
+ this->fAlloc=NULL;
  if (this->fCapacity>0) {
    if (IsPrimitiveType<OBJ>::VAL) {
      GMALLOC(fArray, fCapacity*sizeof(OBJ));
@@ -258,12 +288,11 @@ template <class OBJ> const GVec<OBJ>& GVec<OBJ>::operator=(GVec<OBJ>& array) {
  fCapacity=array.fCapacity;
  fCount=array.fCount;
  if (fCapacity>0) {
+   fArray=newArray(fCapacity);
    if (IsPrimitiveType<OBJ>::VAL) {
-     GMALLOC(fArray, fCapacity*sizeof(OBJ));
      memcpy(fArray, array.fArray, fCount*sizeof(OBJ));
      }
    else {
-    fArray=new OBJ[this->fCapacity]; // ]()
     // uses OBJ operator=
     for (int i=0;i<fCount;i++) {
       fArray[i]=array.fArray[i];
@@ -278,6 +307,33 @@ template <class OBJ> GVec<OBJ>::~GVec() {
 }
 
 
+template <class OBJ> OBJ* GVec<OBJ>::newArray(int cap) {
+  OBJ* a=NULL;
+  if (fAlloc) {
+    a=(OBJ*)fAlloc->allocItems(cap*sizeof(OBJ));
+    if (!IsPrimitiveType<OBJ>::VAL)
+      for (int i=0;i<cap;i++) ::new(&a[i]) OBJ();
+  }
+  else if (IsPrimitiveType<OBJ>::VAL) {
+    GMALLOC(a, cap*sizeof(OBJ));
+  }
+  else a=new OBJ[cap];
+  return a;
+}
+
+template <class OBJ> void GVec<OBJ>::freeArray(OBJ* a, int cap) {
+  if (a==NULL) return;
+  if (fAlloc) {
+    if (!IsPrimitiveType<OBJ>::VAL)
+      for (int i=0;i<cap;i++) a[i].~OBJ();
+    fAlloc->freeItems(a, cap*sizeof(OBJ));
+  }
+  else if (IsPrimitiveType<OBJ>::VAL) {
+    GFREE(a);
+  }
+  else delete[] a;
+}
+
 template <class OBJ> void GVec<OBJ>::setCapacity(int NewCapacity) {
   if (NewCapacity < fCount || NewCapacity > MAXLISTSIZE)
     GError(GVEC_CAPACITY_ERR, NewCapacity);
@@ -285,26 +341,19 @@ template <class OBJ> void GVec<OBJ>::setCapacity(int NewCapacity) {
    //if you want to shrink it use Resize() or setCount()
   if (NewCapacity!=fCapacity) {
    if (NewCapacity==0) {
-      if (IsPrimitiveType<OBJ>::VAL) {
-       GFREE(fArray);
-      } else {
-       delete[] fArray;
-       fArray=NULL;
-      }
+      freeArray(fArray, fCapacity);
+      fArray=NULL;
    }
    else {
-      if (IsPrimitiveType<OBJ>::VAL) {
+      if (IsPrimitiveType<OBJ>::VAL && fAlloc==NULL) {
         GREALLOC(fArray, NewCapacity*sizeof(OBJ));
       } else {
         OBJ* oldArray=fArray;
-		//fArray=new OBJ[NewCapacity]();
-		fArray=new OBJ[NewCapacity];
+        fArray=newArray(NewCapacity);
         for (int i=0;i<this->fCount;i++) {
-          fArray[i] = oldArray[i]; 
+          fArray[i] = oldArray[i];
           }// we need operator= here
-        //wouldn't be faster to use memcpy instead?
-        //memcpy(fArray, oldArray, fCount*sizeof(OBJ));
-        if (oldArray) delete[] oldArray;
+        freeArray(oldArray, fCapacity);
       }
    }
   fCapacity=NewCapacity;
@@ -313,13 +362,8 @@ template <class OBJ> void GVec<OBJ>::setCapacity(int NewCapacity) {
 
 template <class OBJ> void GVec<OBJ>::Clear() {
   fCount=0;
-  if (IsPrimitiveType<OBJ>::VAL) {
-    GFREE(fArray);
-  }
-  else {
-    delete[] fArray;
-    fArray=NULL;
-  }
+  freeArray(fArray, fCapacity);
+  fArray=NULL;
   fCapacity=0;
 }
 
@@ -352,9 +396,8 @@ template <class OBJ> void GVec<OBJ>::Grow(int idx, OBJ& item) {
          fArray[idx]=item;
  }
  else { //insert item at idx
-   OBJ* newList;
+   OBJ* newList=newArray(NewCapacity);
    if (IsPrimitiveType<OBJ>::VAL) {
-        GMALLOC(newList, NewCapacity*sizeof(OBJ));
         //copy data before idx
         memcpy(&newList[0],&fArray[0], idx*sizeof(OBJ));
         newList[idx]=item;
@@ -362,10 +405,7 @@ template <class OBJ> void GVec<OBJ>::Grow(int idx, OBJ& item) {
         memmove(&newList[idx+1],&fArray[idx], (fCount-idx)*sizeof(OBJ));
         //..shouldn't do this:
         memset(&newList[fCount+1], 0, (NewCapacity-fCount-1)*sizeof(OBJ));
-        //data copied:
-        GFREE(fArray);
    } else {
-        newList=new OBJ[NewCapacity]; //]()
         // operator= required!
         for (int i=0;i<idx;i++) {
           newList[i]=fArray[i];
@@ -376,8 +416,8 @@ template <class OBJ> void GVec<OBJ>::Grow(int idx, OBJ& item) {
         for (int i=idx+1;i<=fCount;i++) {
           newList[i]=fArray[i-1];
           }
-        delete[] fArray;
    }
+   freeArray(fArray, fCapacity);
    fArray=newList;
    fCapacity=NewCapacity;
  }
@@ -566,6 +606,7 @@ template <class OBJ> GPVec<OBJ>::GPVec(GPVec& list) { //copy constructor
  fCount=list.fCount;
  fCapacity=list.fCapacity;
  fList=NULL;
+ fAlloc=NULL;
  if (fCapacity>0) {
       GMALLOC(fList, fCapacity*sizeof(OBJ*));
       }
@@ -579,6 +620,7 @@ template <class OBJ> GPVec<OBJ>::GPVec(GPVec* plist) { //another copy constructo
  fCount=0;
  fCapacity=plist->fCapacity;
  fList=NULL;
+ fAlloc=NULL;
  if (fCapacity>0) {
      GMALLOC(fList, fCapacity*sizeof(OBJ*));
      }
@@ -595,8 +637,9 @@ template <class OBJ> const GPVec<OBJ>& GPVec<OBJ>::operator=(GPVec& list) {
      //Attention: the object *POINTERS* are copied,
      // but the actual object content is NOT duplicated
      //for (int i=0;i<list.Count();i++) Add(list[i]);
+     resizeList(list.fCount);
+     fCapacity=list.fCount;
      fCount=list.fCount;
-     GMALLOC(fList, fCapacity*sizeof(OBJ*));
      memcpy(fList, list.fList, fCount*sizeof(OBJ*));
      }
  return *this;
@@ -627,6 +670,7 @@ template <class OBJ> GPVec<OBJ>::GPVec(int init_capacity, bool free_elements) {
   fCapacity=0;
   fList=NULL;
   fFreeProc=(free_elements) ? DefaultFreeProc : NULL;
+  fAlloc=NULL;
   if (init_capacity>0)
     setCapacity(init_capacity);
 }
@@ -636,6 +680,32 @@ template <class OBJ> GPVec<OBJ>::GPVec(bool free_elements) {
   fCapacity=0;
   fList=NULL;
   fFreeProc=(free_elements) ? DefaultFreeProc : NULL;
+  fAlloc=NULL;
+}
+
+template <class OBJ> GPVec<OBJ>::GPVec(GVecAlloc* alloc, bool free_elements) {
+  fCount=0;
+  fCapacity=0;
+  fList=NULL;
+  fFreeProc=(free_elements) ? DefaultFreeProc : NULL;
+  fAlloc=alloc;
+}
+
+//reallocate the pointer array for NewCapacity (the old capacity is fCapacity)
+template <class OBJ> void GPVec<OBJ>::resizeList(int NewCapacity) {
+  if (fAlloc==NULL) {
+    if (NewCapacity==0) GFREE(fList);
+    else GREALLOC(fList, NewCapacity*sizeof(OBJ*));
+    return;
+  }
+  OBJ** newList=NULL;
+  if (NewCapacity>0) {
+    newList=(OBJ**)fAlloc->allocItems(NewCapacity*sizeof(OBJ*));
+    int n=GMIN(fCount, NewCapacity);
+    if (n>0) memcpy(newList, fList, n*sizeof(OBJ*));
+  }
+  fAlloc->freeItems(fList, fCapacity*sizeof(OBJ*));
+  fList=newList;
 }
 
 template <class OBJ> GPVec<OBJ>::~GPVec() {
@@ -647,12 +717,7 @@ template <class OBJ> void GPVec<OBJ>::setCapacity(int NewCapacity) {
     GError(GVEC_CAPACITY_ERR, NewCapacity);
     //error: capacity not within range
   if (NewCapacity!=fCapacity) {
-   if (NewCapacity==0) {
-      GFREE(fList);
-      }
-    else {
-      GREALLOC(fList, NewCapacity*sizeof(OBJ*));
-      }
+   resizeList(NewCapacity);
    fCapacity=NewCapacity;
    }
 }
@@ -675,7 +740,7 @@ template <class OBJ> void GPVec<OBJ>::Clear() {
      (*fFreeProc)(fList[i]);
      }
    }
- GFREE(fList);
+ resizeList(0);
  fCount=0;
  fCapacity=0;
 }
@@ -734,12 +799,13 @@ template <class OBJ> void GPVec<OBJ>::Grow(int idx, OBJ* newitem) {
  else  {//add the new item
  */
  if (idx==fCount) {
-    GREALLOC(fList, NewCapacity*sizeof(OBJ*));
+    resizeList(NewCapacity);
     fList[idx]=newitem;
     }
  else {
    OBJ** newList;
-   GMALLOC(newList, NewCapacity*sizeof(OBJ*));
+   if (fAlloc) newList=(OBJ**)fAlloc->allocItems(NewCapacity*sizeof(OBJ*));
+   else GMALLOC(newList, NewCapacity*sizeof(OBJ*));
    //copy data before idx
    memcpy(&newList[0],&fList[0], idx*sizeof(OBJ*));
    newList[idx]=newitem;
@@ -747,7 +813,8 @@ template <class OBJ> void GPVec<OBJ>::Grow(int idx, OBJ* newitem) {
    memmove(&newList[idx+1],&fList[idx], (fCount-idx)*sizeof(OBJ*));
    memset(&newList[fCount+1], 0, (NewCapacity-fCount-1)*sizeof(OBJ*));
    //data copied:
-   GFREE(fList);
+   if (fAlloc) fAlloc->freeItems(fList, fCapacity*sizeof(OBJ*));
+   else GFREE(fList);
    fList=newList;
    }
  fCount++; 
@@ -0,0 +1,168 @@
+#include "gtfindex.h"
+#include "bgzf.h"
+
+static void idxWrite(FILE* f, const void* p, size_t len, uint64_t& fpos) {
+	if (len>0 && fwrite(p, 1, len, f)!=len)
+		GError("Error writing the GTF index file!\n");
+	fpos+=len;
+}
+
+static void idxPad(FILE* f, uint64_t& fpos) { //align to 8 bytes
+	static const char zeros[8]={0,0,0,0,0,0,0,0};
+	idxWrite(f, zeros, (8-fpos%8)%8, fpos);
+}
+
+void GTFIndexWriter::add(const char* refname, int rnlen, int start, int end, int numlines, uint64 pos) {
+	//the output is grouped by reference sequence
+	IdxRef* ref=refs.Count() ? refs.Last() : NULL;
+	if (ref==NULL || ref->namelen!=rnlen || memcmp(ref->name, refname, rnlen)!=0) {
+		ref=new IdxRef(refname, rnlen);
+		refs.Add(ref);
+	}
+	GTFIdxEntry e;
+	e.start=start;
+	e.end=end;
+	e.maxend=end;
+	e.numlines=numlines;
+	e.voffset=pos; //converted in write()
+	ref->entries.Add(e);
+}
+
+static int cmpIdxEntry(const pointer p1, const pointer p2) {
+	GTFIdxEntry* e1=(GTFIdxEntry*)p1;
+	GTFIdxEntry* e2=(GTFIdxEntry*)p2;
+	if (e1->start!=e2->start) return (e1->start<e2->start) ? -1 : 1;
+	if (e1->voffset!=e2->voffset) return (e1->voffset<e2->voffset) ? -1 : 1;
+	return 0;
+}
+
+void GTFIndexWriter::write(const char* fname, GOutBuf& out) {
+	FILE* f=fopen(fname, "wb");
+	if (f==NULL) GError("Error creating GTF index file %s\n", fname);
+	GTFIdxHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, GTFIDX_MAGIC, 8);
+	hdr.byteorder=GTFIDX_BYTEORDER;
+	uint64_t fpos=0;
+	idxWrite(f, &hdr, sizeof(hdr), fpos);
+	GVec<GTFIdxRef> irefs;
+	for (int r=0;r<refs.Count();r++) {
+		IdxRef& ref=*refs[r];
+		GTFIdxRef iref;
+		memset(&iref, 0, sizeof(iref));
+		iref.nameofs=fpos;
+		idxWrite(f, ref.name, ref.namelen, fpos);
+		idxWrite(f, "", 1, fpos);
+		idxPad(f, fpos);
+		GVec<GTFIdxEntry>& entries=ref.entries;
+		for (int i=0;i<entries.Count();i++)
+			entries[i].voffset=out.voffset(entries[i].voffset);
+		entries.Sort(cmpIdxEntry);
+		for (int i=1;i<entries.Count();i++)
+			entries[i].maxend=GMAX(entries[i].end, entries[i-1].maxend);
+		iref.entriesofs=fpos;
+		iref.numentries=entries.Count();
+		if (entries.Count()>0)
+			idxWrite(f, &(entries[0]), entries.Count()*sizeof(GTFIdxEntry), fpos);
+		irefs.Add(iref);
+	}
+	hdr.numrefs=irefs.Count();
+	hdr.refsofs=fpos;
+	for (int i=0;i<irefs.Count();i++)
+		idxWrite(f, &(irefs[i]), sizeof(GTFIdxRef), fpos);
+	fseek(f, 0, SEEK_SET);
+	if (fwrite(&hdr, sizeof(hdr), 1, f)!=1)
+		GError("Error writing the GTF index file!\n");
+	fclose(f);
+}
+
+//------------- index query
+
+static void bad_index(const char* fname) {
+	GError("Error: invalid or truncated GTF index file %s\n", fname);
+}
+
+static int cmpVOffset(const pointer p1, const pointer p2) {
+	int64_t v1=((GTFIdxEntry*)p1)->voffset;
+	int64_t v2=((GTFIdxEntry*)p2)->voffset;
+	return (v1<v2) ? -1 : ((v1>v2) ? 1 : 0);
+}
+
+void queryGTF(const char* gtfname, const char* range, FILE* fout) {
+	//parse chr[:start[-end]]
+	GStr chr(range);
+	int qstart=1;
+	int qend=MAX_INT;
+	int p=chr.rindex(':');
+	if (p>0) {
+		if (sscanf(range+p+1, "%d-%d", &qstart, &qend)<1 || qstart<1 || qend<qstart)
+			GError("Error: invalid query range %s\n", range);
+		chr.cut(p);
+	}
+	//load the whole index
+	GStr idxfname(gtfname);
+	idxfname+=GTFIDX_EXT;
+	FILE* f=fopen(idxfname.chars(), "rb");
+	if (f==NULL) GError("Error: cannot open GTF index file %s\n", idxfname.chars());
+	fseeko(f, 0, SEEK_END);
+	size_t size=ftello(f);
+	fseeko(f, 0, SEEK_SET);
+	if (size<sizeof(GTFIdxHeader)) bad_index(idxfname.chars());
+	char* data=NULL;
+	GMALLOC(data, size);
+	if (fread(data, 1, size, f)!=size) bad_index(idxfname.chars());
+	fclose(f);
+	GTFIdxHeader* hdr=(GTFIdxHeader*)data;
+	if (memcmp(hdr->magic, GTFIDX_MAGIC, 8)!=0) bad_index(idxfname.chars());
+	if (hdr->byteorder!=GTFIDX_BYTEORDER)
+		GError("Error: GTF index file %s was written on a system with a different byte order!\n",
+				idxfname.chars());
+	if (hdr->refsofs+(uint64_t)hdr->numrefs*sizeof(GTFIdxRef)>size) bad_index(idxfname.chars());
+	GTFIdxRef* refs=(GTFIdxRef*)(data+hdr->refsofs);
+	//collect the overlapping transcripts
+	GVec<GTFIdxEntry> found;
+	for (uint32_t r=0;r<hdr->numrefs;r++) {
+		if (refs[r].nameofs>=size ||
+				refs[r].entriesofs+(uint64_t)refs[r].numentries*sizeof(GTFIdxEntry)>size)
+			bad_index(idxfname.chars());
+		if (strcmp(data+refs[r].nameofs, chr.chars())!=0) continue;
+		GTFIdxEntry* entries=(GTFIdxEntry*)(data+refs[r].entriesofs);
+		int n=refs[r].numentries;
+		//entries from lo can end at or after qstart (maxend is not decreasing)
+		int lo=0, hi=n;
+		while (lo<hi) {
+			int m=(lo+hi)/2;
+			if (entries[m].maxend<qstart) lo=m+1;
+			else hi=m;
+		}
+		//entries before last start at or before qend
+		int last=lo;
+		hi=n;
+		while (last<hi) {
+			int m=(last+hi)/2;
+			if (entries[m].start<=qend) last=m+1;
+			else hi=m;
+		}
+		for (int i=lo;i<last;i++)
+			if (entries[i].end>=qstart) found.Add(entries[i]);
+	}
+	GFREE(data);
+	//print them in output order
+	found.Sort(cmpVOffset);
+	BGZF* bgzf=bgzf_open(gtfname, "r");
+	if (bgzf==NULL) GError("Error: cannot open BGZF file %s\n", gtfname);
+	GOutBuf out(fout);
+	for (int i=0;i<found.Count();i++) {
+		if (bgzf_seek(bgzf, found[i].voffset, SEEK_SET)<0)
+			GError("Error: cannot seek in BGZF file %s\n", gtfname);
+		uint32_t lines=0;
+		while (lines<found[i].numlines) {
+			int c=bgzf_getc(bgzf);
+			if (c<0) GError("Error: truncated BGZF file %s\n", gtfname);
+			out.add((char)c);
+			if (c=='\n') lines++;
+		}
+	}
+	out.close();
+	bgzf_close(bgzf);
+}
@@ -0,0 +1,66 @@
+#ifndef __GTFINDEX_H__
+#define __GTFINDEX_H__
+#include "rlink.h"
+
+// Transcript index of a BGZF compressed output GTF (--bgzf), used by --query
+// to print the transcripts overlapping a genomic range without reading the
+// whole file. Like a tabix index it points into the compressed file with
+// BGZF virtual offsets, but its records are whole transcripts (the GTF lines
+// of a transcript and its exons), as the output lines are not sorted by
+// coordinate. For each reference sequence the transcripts are sorted by
+// start coordinate, and each entry also keeps the largest end coordinate of
+// the entries up to it, so both ends of the range of entries that can
+// overlap a query are found by binary search.
+// All values are written in the native byte order.
+
+#define GTFIDX_MAGIC "STGTFIX1"
+#define GTFIDX_BYTEORDER 0x01020304
+#define GTFIDX_EXT ".tix"
+
+struct GTFIdxHeader {
+	char magic[8];
+	uint32_t byteorder;
+	uint32_t numrefs;
+	uint64_t refsofs; //file offset of the GTFIdxRef array
+};
+
+struct GTFIdxRef { //a reference sequence section
+	uint64_t nameofs; //file offset of the sequence name (0 terminated)
+	uint64_t entriesofs; //file offset of the GTFIdxEntry array
+	uint32_t numentries;
+	uint32_t reserved;
+};
+
+struct GTFIdxEntry {
+	int32_t start;
+	int32_t end;
+	int32_t maxend; //largest end of the entries up to this one
+	uint32_t numlines; //GTF lines of the transcript
+	int64_t voffset; //BGZF virtual offset of the transcript line
+};
+
+class GTFIndexWriter {
+	struct IdxRef {
+		char* name;
+		int namelen;
+		GVec<GTFIdxEntry> entries;
+		IdxRef(const char* rname, int rnlen):name(NULL), namelen(rnlen), entries() {
+			GMALLOC(name, rnlen);
+			memcpy(name, rname, rnlen);
+		}
+		~IdxRef() { GFREE(name); }
+	};
+	GPVec<IdxRef> refs;
+ public:
+	GTFIndexWriter():refs(true) { }
+	//a transcript written at uncompressed position pos of the output
+	void add(const char* refname, int rnlen, int start, int end, int numlines, uint64 pos);
+	//write the index, converting the positions with out.voffset()
+	void write(const char* fname, GOutBuf& out);
+};
+
+//print the GTF lines of the transcripts overlapping range (chr[:start-end])
+//from a BGZF compressed output GTF, using its index
+void queryGTF(const char* gtfname, const char* range, FILE* fout);
+
+#endif
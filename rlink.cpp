@@ -14,6 +14,7 @@ extern bool complete;
 //extern bool debugMode;
 //extern bool verbose;
 extern bool eonly;
+extern bool ballgown;
 
 extern int maxReadCov;
 
@@ -49,18 +50,63 @@ void printBitVec(GBitVec& bv) {
    }
 }
 
-CJunction* add_junction(int start, int end, int leftsupport, int rightsupport,
-		GList<CJunction>& junction, char strand, int nh) {
-	int oidx=-1;
-	CJunction *nj=NULL;
-	//CJunction* nj=junction.AddIfNew(new CJunction(start, end, strand), true, &oidx);
-	CJunction jn(start, end, strand);
-	if (junction.Found(&jn, oidx)) {
-		nj=junction.Get(oidx);
+bool CPattern::contains(const CPattern& p) const {
+	if (p.num>num) return false;
+	int pos=0;
+	for (int k=0;k<p.num;k++) {
+		pos=lower(p.bits[k], pos);
+		if (pos==num || bits[pos]!=p.bits[k]) return false;
+		pos++;
 	}
-	else {
+	return true;
+}
+
+bool CPattern::intersects(const CPattern& p) const {
+	int i=0, j=0;
+	while (i<num && j<p.num) {
+		if (bits[i]==p.bits[j]) return true;
+		if (bits[i]<p.bits[j]) i=lower(p.bits[j], i+1);
+		else j=p.lower(bits[i], j+1);
+	}
+	return false;
+}
+
+CPattern& CPattern::operator|=(const CPattern& p) {
+	if (p.num==0 || this==&p) return *this;
+	if (num==0 || p.bits[0]>bits[num-1]) { //append
+		grow(num+p.num);
+		memcpy(bits+num, p.bits, p.num*sizeof(int));
+		num+=p.num;
+		return *this;
+	}
+	if (contains(p)) return *this;
+	int* u=NULL;
+	int ucap=num+p.num;
+	GMALLOC(u, ucap*sizeof(int));
+	int i=0, j=0, n=0;
+	while (i<num && j<p.num) {
+		if (bits[i]<p.bits[j]) u[n++]=bits[i++];
+		else if (bits[i]>p.bits[j]) u[n++]=p.bits[j++];
+		else { u[n++]=bits[i++]; j++; }
+	}
+	while (i<num) u[n++]=bits[i++];
+	while (j<p.num) u[n++]=p.bits[j++];
+	GFREE(bits);
+	bits=u;
+	num=n;
+	cap=ucap;
+	return *this;
+}
+
+//junction is unsorted while the reads are added, jindex is used to find
+//existing junctions (see processBundleReads())
+CJunction* add_junction(int start, int end, int leftsupport, int rightsupport,
+		GList<CJunction>& junction, CJunctionIndex& jindex, char strand, int nh) {
+	CJunction *nj=jindex.get(start, end, strand);
+	if (nj==NULL) {
 		nj=new CJunction(start, end, strand);
 		junction.Add(nj);
+		jindex.add(nj);
 	}
 	//if (nh==0) nh=1;
 	nj->nreads+=float(1)/nh;
@@ -70,90 +116,200 @@ CJunction* add_junction(int start, int end, int leftsupport, int rightsupport,
 	return nj;
 }
 
-void cov_add(GVec<float>& bpcov, int i, int j, float v) {
-	if (j>=bpcov.Count()) bpcov.Resize(j+1, 0);
-	for (int k=i;k<j;k++)
-		bpcov[k]+=v;
-}
-
-
-float getBCov(GVec<float>& bpcov, int p) {
-	//if (p<0) GMessage("Error: invalid bpcov index (%d)!\n", p);
-	if (p>=bpcov.Count()) return 0;
-	else return bpcov[p];
-}
-
-bool maxCovReached(int currentstart, GBamRecord& brec, BundleData& bdata) {
-	for (int i=0;i<brec.exons.Count();i++) {
-		if (getBCov(bdata.bpcov, brec.exons[i].start-currentstart)<=maxReadCov)
+#define COVCHUNK_SIZE (1<<COVCHUNK_BITS)
+#define COVCHUNK_MASK (COVCHUNK_SIZE-1)
+
+void CCovTrack::Clear() {
+	for (int c=0;c<chunks.Count();c++) {
+		GFREE(chunks[c].val);
+		GFREE(chunks[c].cum);
+	}
+	chunks.Clear();
+	len=0;
+	fin=0;
+	cumfin=0;
+}
+
+//storage of the chunk holding position p
+int64_t* CCovTrack::chunk(int p) {
+	int c=p>>COVCHUNK_BITS;
+	if (c>=chunks.Count()) {
+		CovChunk e;
+		memset(&e, 0, sizeof(e));
+		while (chunks.Count()<=c) chunks.Add(e);
+	}
+	CovChunk& ch=chunks[c];
+	if (ch.val==NULL) {
+		GCALLOC(ch.val, COVCHUNK_SIZE*sizeof(int64_t));
+		//the final part of the chunk had a constant value so far
+		int cstart=c<<COVCHUNK_BITS;
+		for (int q=cstart;q<fin && q<cstart+COVCHUNK_SIZE;q++)
+			ch.val[q-cstart]=ch.carry;
+	}
+	return ch.val;
+}
+
+void CCovTrack::add(int i, int j, float v) {
+	if (j>=len) len=j+1;
+	if (i>=j) return;
+	int64_t x=(int64_t)(v*COV_SCALE+0.5);
+	if (cumfin>(i>>COVCHUNK_BITS)) cumfin=i>>COVCHUNK_BITS;
+	if (i<fin) { //the values below fin are final already: update them directly
+		int e = (j<fin) ? j : fin;
+		for (int q=i;q<e;q++)
+			chunk(q)[q & COVCHUNK_MASK]+=x;
+		for (int c=(i>>COVCHUNK_BITS)+1;c<chunks.Count() && (c<<COVCHUNK_BITS)<=e;c++)
+			chunks[c].carry+=x; //value before the chunk start was changed
+		if (j<fin) return;
+		//the difference at fin is unchanged, as both sides were updated,
+		//unless fin==j
+	}
+	else chunk(i)[i & COVCHUNK_MASK]+=x;
+	chunk(j)[j & COVCHUNK_MASK]-=x;
+}
+
+void CCovTrack::freeze(int p) {
+	if (p>len) p=len;
+	if (fin>=p) return;
+	int64_t v = fin ? value(fin-1) : 0;
+	while (fin<p) {
+		int c=fin>>COVCHUNK_BITS;
+		int cstart=c<<COVCHUNK_BITS;
+		CovChunk& ch=chunks[c];
+		if (fin==cstart) ch.carry=v;
+		int e = (p<cstart+COVCHUNK_SIZE) ? p : cstart+COVCHUNK_SIZE;
+		if (ch.val) {
+			for (int q=fin-cstart;q<e-cstart;q++) {
+				v+=ch.val[q];
+				ch.val[q]=v;
+			}
+		}
+		fin=e;
+	}
+}
+
+int64_t CCovTrack::value(int p) {
+	CovChunk& ch=chunks[p>>COVCHUNK_BITS];
+	if (p<fin) return ch.val ? ch.val[p & COVCHUNK_MASK] : ch.carry;
+	//not final yet: add up the differences since fin
+	int64_t v = fin ? value(fin-1) : 0;
+	int q=fin;
+	while (q<=p) {
+		int c=q>>COVCHUNK_BITS;
+		int cend=(c+1)<<COVCHUNK_BITS;
+		if (cend>p+1) cend=p+1;
+		int64_t* d=chunks[c].val;
+		if (d) for (;q<cend;q++) v+=d[q & COVCHUNK_MASK];
+		q=cend;
+	}
+	return v;
+}
+
+double CCovTrack::cumulative(int p) {
+	if (fin<len) freeze(len); //no more updates are expected when sums are needed
+	int c=p>>COVCHUNK_BITS;
+	while (cumfin<=c) {
+		CovChunk& ch=chunks[cumfin];
+		int cstart=cumfin<<COVCHUNK_BITS;
+		double cum=0;
+		if (cumfin) {
+			CovChunk& prev=chunks[cumfin-1];
+			cum = prev.val ? prev.cum[COVCHUNK_SIZE-1] :
+					prev.cumcarry+COVCHUNK_SIZE*(prev.carry/COV_SCALE);
+		}
+		ch.cumcarry=cum;
+		if (ch.val) {
+			if (ch.cum==NULL) GMALLOC(ch.cum, COVCHUNK_SIZE*sizeof(double));
+			int n = (len-cstart<COVCHUNK_SIZE) ? len-cstart : COVCHUNK_SIZE;
+			for (int q=0;q<n;q++) {
+				cum+=ch.val[q]/COV_SCALE;
+				ch.cum[q]=cum;
+			}
+			for (int q=n;q<COVCHUNK_SIZE;q++) ch.cum[q]=cum;
+		}
+		cumfin++;
+	}
+	CovChunk& ch=chunks[c];
+	int o=p & COVCHUNK_MASK;
+	return ch.val ? ch.cum[o] : ch.cumcarry+(o+1)*(ch.carry/COV_SCALE);
+}
+
+bool maxCovReached(int currentstart, CBundleRead& rd, BundleData& bdata) {
+	GSeg* rexons=&(bdata.rexons[rd.exonidx]);
+	for (int i=0;i<rd.numexons;i++) {
+		if (bdata.bpcov.get(rexons[i].start-currentstart)<=maxReadCov)
 			return false;
 	}
 	if (!bdata.covSaturated) {
 		GMessage("Warning: bundle %s:%d-%d(%d) (%djs) reached coverage saturation (%d) starting with read mapped at %d\n",
 				bdata.refseq.chars(), bdata.start, bdata.end, bdata.numreads, bdata.junction.Count(),
-				maxReadCov, brec.start);
+				maxReadCov, rd.start);
 		bdata.covSaturated=true;
 	}
 	return true;
 }
 
-void countRead(BundleData& bdata, GBamRecord& brec, int hi) {
-	static uint32_t BAM_R2SINGLE = BAM_FREAD2 | BAM_FMUNMAP ;
+void countRead(BundleData& bdata, CBundleRead& rd, int hi) {
 	if (hi==0) {
-		for (int i=0;i<brec.exons.Count();i++) {
-				bdata.frag_len+=brec.exons[i].len();
+		GSeg* rexons=&(bdata.rexons[rd.exonidx]);
+		for (int i=0;i<rd.numexons;i++) {
+				bdata.frag_len+=rexons[i].len();
 		}
-		if (!brec.isPaired() || ((brec.flags()&BAM_FREAD1)!=0) ||
-
-				((brec.flags()&BAM_R2SINGLE)==BAM_R2SINGLE ) ) {
+		if (rd.flags & RREAD_FRAG) {
 			bdata.num_fragments++;
 		}
 	}
 }
 
+//alignments with the same strand, NH and exon segments
+bool sameAln(CReadAln& r, char strand, int nh, GSeg* segs, int nsegs) {
+	if (r.strand!=strand || r.nh!=nh || r.segs.Count()!=nsegs) return false;
+	for (int i=0;i<nsegs;i++)
+		if (r.segs[i].start!=segs[i].start || r.segs[i].end!=segs[i].end) return false;
+	return true;
+}
+
 int processRead(int currentstart, int currentend, BundleData& bdata,
-		 GHash<int>& hashread, GBamRecord& brec, char strand, int nh, int hi) {
+		 CMateTable& mates, CBundleRead& rd, char strand, int nh, int hi, int mate) {
 	GList<CReadAln>& readlist = bdata.readlist;
 	GList<CJunction>& junction = bdata.junction;
-	GVec<float>& bpcov = bdata.bpcov;
+	CCovTrack& bpcov = bdata.bpcov;
+	GSeg* rexons=&(bdata.rexons[rd.exonidx]);
 
-	int readstart=brec.start;
-	CReadAln* readaln=NULL;
+	int readstart=rd.start;
 	bool covSaturated=false;
 	if (bdata.end<currentend) {
 		bdata.start=currentstart;
 		bdata.end=currentend;
 	}
+	//reads come sorted by start: the coverage before this one is final
+	bpcov.freeze(readstart-currentstart);
 	//bool first_mapping = (nh==1 || hi==0);
 	if (maxReadCov>0) {
-		covSaturated=maxCovReached(currentstart, brec, bdata);
-	//if (bdata.firstPass==2 && !covSaturated)
-	//single pass only -> unconditional read creation
-	  if (!covSaturated)
-		  readaln=new CReadAln(strand, nh, brec.start, brec.end);
+		covSaturated=maxCovReached(currentstart, rd, bdata);
 	}
 	//if (bdata.firstPass) { //first pass or singlePass use
 		bdata.numreads++;
 		//process cigar string
 		int leftsupport=0;
-		int rightsupport=brec.exons.Last().len();
+		int rightsupport=rexons[rd.numexons-1].len();
 		int support=0;
 		int maxleftsupport=0;
 		int njunc=0;
 		GVec<int> leftsup;
 		GVec<int> rightsup;
 		GPVec<CJunction> newjunction(false);
-		for (int i=0;i<brec.exons.Count();i++) {
+		for (int i=0;i<rd.numexons;i++) {
 			CJunction* nj=NULL;
 			if (i) {
 				//deal with introns
-				GSeg seg(brec.exons[i-1].end, brec.exons[i].start);
-				leftsupport=brec.exons[i-1].len();
+				GSeg seg(rexons[i-1].end, rexons[i].start);
+				leftsupport=rexons[i-1].len();
 				if (leftsupport>maxleftsupport) {
 					maxleftsupport=leftsupport;
 				}
 				leftsup.Add(maxleftsupport);//on the left, always add current max support (?)
-				support=brec.exons[i].len();
+				support=rexons[i].len();
 				rightsup.Add(support);     //..but on the right, real support value is added
 
 				/* previously:
@@ -163,15 +319,11 @@ int processRead(int currentstart, int currentend, BundleData& bdata,
 					nj=add_junction(seg.start, seg.end, maxleftsupport, support, junction, strand, nh);
 				*/
 				int maxrightsupport = support > rightsupport ? support : rightsupport;
-				nj=add_junction(seg.start, seg.end, maxleftsupport, maxrightsupport, junction, strand, nh);
+				nj=add_junction(seg.start, seg.end, maxleftsupport, maxrightsupport, junction, bdata.jindex, strand, nh);
 				newjunction.Add(nj);
 			}
-			cov_add(bpcov, brec.exons[i].start-currentstart,
-					brec.exons[i].end-currentstart, float(1)/nh);
-			if (readaln) {
-				if (nj) readaln->juncs.Add(nj);
-				readaln->segs.Add(brec.exons[i]);
-			}
+			bpcov.add(rexons[i].start-currentstart,
+					rexons[i].end-currentstart, float(1)/nh);
 		}
 		njunc=newjunction.Count();
 		//--
@@ -186,51 +338,72 @@ int processRead(int currentstart, int currentend, BundleData& bdata,
 				}
 			}
 		}
-	  if((int)brec.end>currentend) {
+	  if(rd.end>currentend) {
 	  	//return currentend;
-	  	currentend=brec.end;
+	  	currentend=rd.end;
 	  	bdata.end=currentend;
 	  }
 		//if (bdata.firstPass == 1 || covSaturated) {
 	  if (covSaturated) {
-		  return(currentend); //for 1st-pass only, exit here
+		  return -1; //for 1st-pass only, exit here
 		}
 	//} //<-- for single-pass or first pass
 	//--
 	//--> 2nd pass or single-pass run (firstPass==0 or firstPass==2)
-		GStr readname(brec.name());
-		if (readaln==NULL) {
-			//2nd pass
-			//TODO: we should try to see if we can collapse this read first
-			readaln=new CReadAln(strand, nh, brec.start, brec.end);
-		}
-		int n=readlist.Add(readaln);
-		if (brec.refId()==brec.mate_refId()) {
+		int n=readlist.Count(); //readlist index of the new alignment
+		int np=-1; //readlist index of the first mate
+		bool single=true; //no later read can be paired with this one
+		if (rd.flags & RREAD_SAMEREF) {
 			//only consider mate pairing data if mates are on the same chromosome/contig
 			//TODO: this should be reconsidered if we decide to care about FUSION transcripts!
-			GStr readname(brec.name());
-			int pairstart=brec.mate_start();
-			GStr id(readname); // init id with readname
-			id+=':';id+=readstart;id+=':';id+=hi;
+			const char* readname=&(bdata.rnames[rd.nameidx]);
+			uint64_t nhash=CMateTable::nameHash(readname);
+			int pairstart=rd.mate_start;
 			if (readstart<=pairstart) {
 				//only add the first mate in a pair
-				  if (!hashread[id.chars()])
-				  	hashread.Add(id.chars(), new int(n));
+				if (mates.get(nhash, readname, readstart, hi)<0) {
+					mates.add(nhash, readname, readstart, hi, n);
+					single=false;
+				}
 			}
 			if (readstart>pairstart) {
 				//must have seen its pair earlier
-			GStr pairid(readname);
-			pairid+=':';pairid+=pairstart;pairid+=':';pairid+=hi;
-			const int* np=hashread[pairid.chars()];
-			if (np) {
-				readlist[n]->pair_idx=*np;
-				readlist[*np]->pair_idx=n;
-						//we can now discard this pair info
-						hashread.Remove(pairid.chars());
-						hashread.Remove(id.chars()); //just in case it exists
-					}
+				np=mates.get(nhash, readname, pairstart, hi);
+				if (np>=0) {
+					//we can now discard this pair info
+					mates.remove(nhash, readname, pairstart, hi);
+					mates.remove(nhash, readname, readstart, hi); //just in case it exists
+				}
 			}
 		} //<-- if mate is mapped on the same chromosome
+		else if (mate>=0) np=mate;
+		else if (mate<-1) single=false;
+		//collapse the read into the alignment added just before it if that is
+		//an identical single read, so build_graphs() can add the weights of
+		//the copies in the same order as for separate alignments;
+		//mates are not collapsed: add_read_to_group() may split each pair
+		//differently, depending on the groups its mates reach
+		if (np<0 && single) {
+			if (bdata.lastsingle==n-1 && n>0 && readlist[n-1]->pair_idx<0 &&
+					sameAln(*readlist[n-1], strand, nh, rexons, rd.numexons)) {
+				readlist[n-1]->read_count++;
+				return n-1;
+			}
+			bdata.lastsingle=n;
+		}
+		else bdata.lastsingle=-1;
+		CReadAln* readaln=new CReadAln(strand, nh, rd.start, rd.end);
+		readaln->segs.setCapacity(rd.numexons);
+		if (rd.numexons>1) readaln->juncs.setCapacity(rd.numexons-1);
+		for (int i=0;i<rd.numexons;i++) {
+			if (i) readaln->juncs.Add(newjunction[i-1]);
+			readaln->segs.Add(rexons[i]);
+		}
+		readlist.Add(readaln);
+		if (np>=0) {
+			readlist[n]->pair_idx=np;
+			readlist[np]->pair_idx=n;
+		}
 		//int end=brec.end;
 	/*
 	if (bdata.firstPass==0) {//2nd pass only
@@ -246,10 +419,236 @@ int processRead(int currentstart, int currentend, BundleData& bdata,
 		}
 	}
 	*/
-	return currentend; //currentend already set earlier
+	return n;
 	//}
 }
 
+#define ARENA_HDR 8 //allocation header: the arena the object came from, or NULL
+#define ARENA_BLOCK 0x40000
+
+#ifndef NOTHREADS
+static thread_local CBundleArena* curArena=NULL;
+#else
+static CBundleArena* curArena=NULL;
+#endif
+
+CBundleArena::CBundleArena():blocks(), sizes(), curblock(-1), pos(0)
+#ifndef NOTHREADS
+		, shared(false), mutex()
+#endif
+{
+	memset(freelist, 0, sizeof(freelist));
+}
+
+CBundleArena::~CBundleArena() {
+	for (int i=0;i<blocks.Count();i++) GFREE(blocks[i]);
+}
+
+void CBundleArena::reset() {
+	curblock = blocks.Count() ? 0 : -1;
+	pos=0;
+	memset(freelist, 0, sizeof(freelist));
+}
+
+void* CBundleArena::alloc(size_t size) {
+	size=(size+7) & ~(size_t)7;
+	while (curblock>=0 && pos+size>sizes[curblock]) {
+		if (curblock+1==blocks.Count()) { curblock=-1; break; }
+		curblock++;
+		pos=0;
+	}
+	if (curblock<0) { //a new block, at least as large as the previous one
+		size_t bsize = sizes.Count() ? sizes.Last() : ARENA_BLOCK;
+		while (bsize<size) bsize*=2;
+		char* b=NULL;
+		GMALLOC(b, bsize);
+		blocks.Add(b);
+		sizes.Add(bsize);
+		curblock=blocks.Count()-1;
+		pos=0;
+	}
+	void* p=blocks[curblock]+pos;
+	pos+=size;
+	return p;
+}
+
+//size class of an item array: its size rounded up to 2^(class+4)
+static int arenaClass(size_t size) {
+	int c=0;
+	while (((size_t)16<<c)<size) c++;
+	return c;
+}
+
+void* CBundleArena::allocItems(size_t size) {
+	int c=arenaClass(size);
+	if (c>=ARENA_CLASSES) GError("Error: item array of %lu bytes is too large!\n", (unsigned long)size);
+	lock();
+	void* p=freelist[c];
+	if (p) freelist[c]=*(void**)p;
+	else p=alloc((size_t)16<<c);
+	unlock();
+	return p;
+}
+
+void CBundleArena::freeItems(void* p, size_t size) {
+	if (p==NULL) return;
+	int c=arenaClass(size);
+	lock();
+	*(void**)p=freelist[c];
+	freelist[c]=p;
+	unlock();
+}
+
+void CBundleArena::setCurrent(CBundleArena* arena) {
+	curArena=arena;
+}
+
+CBundleArena* CBundleArena::current() {
+	return curArena;
+}
+
+void* CBundleArena::allocate(size_t size) {
+	char* p=NULL;
+	if (curArena) {
+		curArena->lock();
+		p=(char*)curArena->alloc(size+ARENA_HDR);
+		curArena->unlock();
+	}
+	else GMALLOC(p, size+ARENA_HDR);
+	*(CBundleArena**)p=curArena;
+	return p+ARENA_HDR;
+}
+
+void CBundleArena::release(void* p) {
+	if (p==NULL) return;
+	char* b=(char*)p-ARENA_HDR;
+	if (*(CBundleArena**)b==NULL) GFREE(b);
+}
+
+void BundleData::addRead(GBamRecord& brec, char xs, int nh, int hi, int cend, int mate) {
+	static uint32_t BAM_R2SINGLE = BAM_FREAD2 | BAM_FMUNMAP ;
+	CBundleRead rd;
+	rd.start=brec.start;
+	rd.end=brec.end;
+	rd.exonidx=rexons.Count();
+	rd.numexons=brec.exons.Count();
+	for (int i=0;i<brec.exons.Count();i++)
+		rexons.Add(brec.exons[i]);
+	rd.flags=0;
+	if (!brec.isPaired() || ((brec.flags()&BAM_FREAD1)!=0) ||
+			((brec.flags()&BAM_R2SINGLE)==BAM_R2SINGLE ) )
+		rd.flags|=RREAD_FRAG;
+	rd.nameidx=-1;
+	rd.mate_start=0;
+	if (brec.refId()==brec.mate_refId()) { //the read name is only needed for mate pairing
+		rd.flags|=RREAD_SAMEREF;
+		const char* rname=brec.name();
+		int len=strlen(rname)+1;
+		rd.nameidx=rnames.Count();
+		rnames.setCount(rd.nameidx+len);
+		memcpy(&(rnames[rd.nameidx]), rname, len);
+		rd.mate_start=brec.mate_start();
+	}
+	rd.mate=mate;
+	rd.nh=nh;
+	rd.hi=hi;
+	rd.xs=xs;
+	rd.cend=cend;
+	rd.rcguides=rcguides.Count();
+	rreads.Add(rd);
+}
+
+//rough per-item costs of processing a bundle, for footprint()
+#define FOOTPRINT_READ (sizeof(CReadAln)+ARENA_HDR+128) //with its exons, junctions and pairs
+#define FOOTPRINT_JUNC (sizeof(CJunction)+ARENA_HDR+32)
+#define FOOTPRINT_BP 24 //coverage track and graph nodes per covered base
+
+size_t BundleData::footprint() {
+	size_t numjuncs=rexons.Count()-rreads.Count(); //junction hits, an upper bound
+	size_t len=(end>=start) ? end-start+1 : 0;
+	size_t mem=rreads.Capacity()*sizeof(CBundleRead)+rexons.Capacity()*sizeof(GSeg)+rnames.Capacity();
+	mem+=rreads.Count()*FOOTPRINT_READ+numjuncs*FOOTPRINT_JUNC+len*FOOTPRINT_BP;
+	return mem;
+}
+
+//collapse the first mates left unpaired after processRead() into an identical
+//unpaired alignment just before them, then remove the alignments freed by
+//collapsing from the readlist
+void collapseReads(BundleData& bdata) {
+	GList<CReadAln>& readlist=bdata.readlist;
+	int last=-1; //previous alignment, if unpaired
+	for (int n=0;n<readlist.Count();n++) {
+		CReadAln* r=readlist[n];
+		if (r->pair_idx>=0) {
+			last=-1;
+			continue;
+		}
+		if (last>=0 && sameAln(*readlist[last], r->strand, r->nh, &(r->segs[0]), r->segs.Count())) {
+			readlist[last]->read_count+=r->read_count;
+			readlist.freeItem(n);
+		}
+		else last=n;
+	}
+	GVec<int> newidx(readlist.Count());
+	int count=0;
+	for (int n=0;n<readlist.Count();n++) {
+		int idx=-1;
+		if (readlist[n]!=NULL) {
+			readlist.Put(count, readlist[n]);
+			idx=count++;
+		}
+		newidx.Add(idx);
+	}
+	if (count==readlist.Count()) return;
+	readlist.setCount(count);
+	for (int n=0;n<count;n++) {
+		if (readlist[n]->pair_idx>=0)
+			readlist[n]->pair_idx=newidx[readlist[n]->pair_idx];
+	}
+}
+
+void processBundleReads(BundleData& bdata) {
+	bdata.mates.reset();
+	bdata.lastsingle=-1;
+	//junctions are found through bdata.jindex and only sorted at the end
+	bdata.jindex.reset();
+	bdata.junction.setSorted(false);
+	GVec<int> ridx(bdata.rreads.Count()); //readlist index for each loaded read, or -1
+	int currentstart=bdata.start;
+	int bundle_end=bdata.end;
+	//processRead() grows the bundle end back as the reads are added
+	bdata.end=0;
+	int nrc=0; //Ballgown reference transcripts stored so far
+	for (int r=0;r<bdata.rreads.Count();r++) {
+		CBundleRead& rd=bdata.rreads[r];
+		//the read counting span must be the same as it was when this read was loaded
+		while (nrc<rd.rcguides) bdata.rc_store_t(bdata.rcguides[nrc++]);
+		char strand=0;
+		if (rd.xs=='+') strand=1;
+		else if (rd.xs=='-') strand=-1;
+		bool ref_overlap=false;
+		if (ballgown && bdata.rc_data) ref_overlap=bdata.rc_count_hit(rd, rd.xs, rd.nh);
+		countRead(bdata, rd, rd.hi);
+		int n=-1;
+		if (!ballgown || ref_overlap) {
+			//mate link from the read digest, if any
+			int mate = (rd.mate>=0) ? ridx[rd.mate] : rd.mate;
+			n=processRead(currentstart, rd.cend, bdata, bdata.mates, rd, strand, rd.nh, rd.hi, mate);
+		}
+		ridx.Add(n);
+	}
+	while (nrc<bdata.rcguides.Count()) bdata.rc_store_t(bdata.rcguides[nrc++]);
+	collapseReads(bdata);
+	bdata.bpcov.freeze(bdata.bpcov.Count());
+	bdata.junction.setSorted(true);
+	bdata.start=currentstart;
+	bdata.end=bundle_end;
+	//the loaded read data is no longer needed
+	bdata.rreads.Clear();
+	bdata.rexons.Clear();
+	bdata.rnames.Clear();
+}
+
 int get_min_start(CGroup **currgroup) {
 	int nextgr=0;
 
@@ -489,6 +888,7 @@ int add_read_to_group(int n,GList<CReadAln>& readlist,int color,GPVec<CGroup>& g
 
 	int sno=readlist[n]->strand+1; // 0: negative strand; 1: zero strand; 2: positive strand
 	int readcol=color;
+	GVec<CGroup*> covgroup; // group reached by each segment, needed only for a collapsed read
 
 	// check if I've seen read's pair and if yes get its readcol; at the least get read's pair strand if available
 	int np=readlist[n]->pair_idx; // pair read number
@@ -534,7 +934,7 @@ int add_read_to_group(int n,GList<CReadAln>& readlist,int color,GPVec<CGroup>& g
 		}
 	} // if(np>-1 && readlist[np]->nh) : read pair exists and it wasn't deleted
 	else {
-		fragno++;
+		fragno+=(uint)readlist[n]->read_count;
 		eqcol.Add(color);
 		color++;
 	}
@@ -641,6 +1041,7 @@ int add_read_to_group(int n,GList<CReadAln>& readlist,int color,GPVec<CGroup>& g
 		    		lastpushedgroup=thisgroup->grid;
 		    	}
 		    	thisgroup->cov_sum+=(float)(readlist[n]->segs[i].end-readlist[n]->segs[i].start+1)/readlist[n]->nh;
+		    	if(readlist[n]->read_count>1) covgroup.cAdd(thisgroup);
 		    } // end if(thisgroup && readlist[n]->segs[i].end >= thisgroup->start)
 		    else { // read is at the end of groups, or read is not overlapping other groups -> $lastgroup should be not null here
 
@@ -666,6 +1067,7 @@ int add_read_to_group(int n,GList<CReadAln>& readlist,int color,GPVec<CGroup>& g
 		    	}
 		    	CGroup *newgroup=new CGroup(readlist[n]->segs[i].start,readlist[n]->segs[i].end,readcol,ngroup,(float)(readlist[n]->segs[i].end-readlist[n]->segs[i].start+1)/readlist[n]->nh,nread,multi);
 		    	group.Add(newgroup);
+		    	if(readlist[n]->read_count>1) covgroup.cAdd(newgroup);
 		    	merge.Add(ngroup);
 		    	lastgroup->next_gr=newgroup;
 		    	newgroup->next_gr=thisgroup;
@@ -703,6 +1105,7 @@ int add_read_to_group(int n,GList<CReadAln>& readlist,int color,GPVec<CGroup>& g
 			nread=0;
 			multi=0;
 			group.Add(newgroup);
+			if(readlist[n]->read_count>1) covgroup.cAdd(newgroup);
 			merge.Add(ngroup);
 			if(lastgroup!=NULL) {
 				lastgroup->next_gr=newgroup;
@@ -716,6 +1119,18 @@ int add_read_to_group(int n,GList<CReadAln>& readlist,int color,GPVec<CGroup>& g
 
 	}
 
+	// the other copies of a collapsed read reach the same groups as the first one:
+	// add them one at a time, in the order separate reads would be added
+	for(int c=1;c<readlist[n]->read_count;c++)
+		for(int i=0;i<covgroup.Count();i++) {
+			fraglen+=readlist[n]->segs[i].len();
+			if(!i) {
+				covgroup[i]->nread+=(float)1/readlist[n]->nh;
+				if(readlist[n]->nh>1) covgroup[i]->multi+=(float)1/readlist[n]->nh;
+			}
+			covgroup[i]->cov_sum+=(float)(readlist[n]->segs[i].end-readlist[n]->segs[i].start+1)/readlist[n]->nh;
+		}
+
 	allcurrgroup[sno]=currgroup;
 
 	if(startgroup[sno]==NULL) startgroup[sno]=currgroup;
@@ -753,7 +1168,7 @@ float compute_chi(GArray<float>& winleft, GArray<float>& winright, float sumleft
 	return(chi);
 }
 
-void find_trims(int refstart,uint start,uint end,GVec<float>& bpcov,uint& sourcestart,float& maxsourceabundance,uint& sinkend,
+void find_trims(int refstart,uint start,uint end,CCovTrack& bpcov,uint& sourcestart,float& maxsourceabundance,uint& sinkend,
 		float& maxsinkabundance){
 
 	if(end-start<2*CHI_WIN-1) return;
@@ -772,14 +1187,13 @@ void find_trims(int refstart,uint start,uint end,GVec<float>& bpcov,uint& source
 
 	for(uint i=start;i<=end;i++) {
 
-		if(i-start<2*CHI_WIN-1)  { // I have to compute the sumleft and sumright first
+		float icov=bpcov[i-refstart];
+		if(i-start<2*CHI_WIN-1)  { // I have to fill the windows first
 			if(i-start<CHI_WIN) {
-				sumleft+=bpcov[i-refstart];
-				winleft.Add(bpcov[i-refstart]);
+				winleft.Add(icov);
 			}
 			else {
-				sumright+=bpcov[i-refstart];
-				winright.Add(bpcov[i-refstart]);
+				winright.Add(icov);
 				if(i-start==2*CHI_WIN-2) {
 					winleft.setSorted(true);
 					winright.setSorted(true);
@@ -788,8 +1202,10 @@ void find_trims(int refstart,uint start,uint end,GVec<float>& bpcov,uint& source
 	    }
 	    else { // I can do the actual sumleft, sumright comparision
 
-	    	sumright+=bpcov[i-refstart];
-			winright.Add(bpcov[i-refstart]);
+			winright.Add(icov);
+			// window sums: O(1) range queries on the coverage track
+			sumleft=bpcov.sum(i-refstart-2*CHI_WIN+1, i-refstart-CHI_WIN);
+			sumright=bpcov.sum(i-refstart-CHI_WIN+1, i-refstart);
 
 			float chi=0;
 			if(sumleft!=sumright) chi=compute_chi(winleft,winright,sumleft,sumright);
@@ -815,13 +1231,12 @@ void find_trims(int refstart,uint start,uint end,GVec<float>& bpcov,uint& source
 				}
 	    	}
 
-	    	sumleft-=bpcov[i-refstart-2*CHI_WIN+1];
-	    	int idx=winleft.IndexOf(bpcov[i-refstart-2*CHI_WIN+1]);
+	    	float outcov=bpcov[i-refstart-2*CHI_WIN+1]; // leaves the left window
+	    	float midcov=bpcov[i-refstart-CHI_WIN+1]; // moves from the right window to the left one
+	    	int idx=winleft.IndexOf(outcov);
 	    	winleft.Delete(idx);
-	    	sumleft+=bpcov[i-refstart-CHI_WIN+1];
-	    	winleft.Add(bpcov[i-refstart-CHI_WIN+1]);
-	    	sumright-=bpcov[i-refstart-CHI_WIN+1];
-	    	idx=winright.IndexOf(bpcov[i-refstart-CHI_WIN+1]);
+	    	winleft.Add(midcov);
+	    	idx=winright.IndexOf(midcov);
 	    	winright.Delete(idx);
 	    }
 	}
@@ -874,7 +1289,7 @@ CGraphnode *add_trim_to_graph(int s, int g,uint lastpos,CTrimPoint& mytrim,CGrap
 	return(graphnode);
 }
 
-CGraphnode *trimnode(int s, int g, int refstart,uint newend, CGraphnode *graphnode,CGraphnode *source, CGraphnode *sink, GVec<float>& bpcov,
+CGraphnode *trimnode(int s, int g, int refstart,uint newend, CGraphnode *graphnode,CGraphnode *source, CGraphnode *sink, CCovTrack& bpcov,
 		GVec<float>& futuretr, int& graphno,CBundlenode *bundlenode,GVec<CGraphinfo> **bundle2graph,GPVec<CGraphnode> **no2gnode) {
 
 	uint sourcestart=0;
@@ -966,27 +1381,28 @@ inline int edge(int min, int max, int gno) {
 	return((gno-1)*(min+1)-min*(min-1)/2+max-min); // this includes source to node edges
 }
 
-GBitVec traverse_dfs(int s,int g,CGraphnode *node,CGraphnode *sink,GBitVec parents,int gno, GVec<bool>& visit,
+CPattern traverse_dfs(int s,int g,CGraphnode *node,CGraphnode *sink,CPattern parents,int gno, GVec<bool>& visit,
 		GPVec<CGraphnode> **no2gnode,GPVec<CTransfrag> **transfrag){
 
 	if(visit[node->nodeid]) {
 		node->parentpat = node->parentpat | parents;
-		for(int n=0;n<gno;n++) {
-			if(parents[n]) // add node's children to all parents of node
-				no2gnode[s][g][n]->childpat = no2gnode[s][g][n]->childpat | node->childpat;
-			else if(node->childpat[n])
+		for(int k=0;k<parents.count() && parents.bit(k)<gno;k++) { // add node's children to all parents of node
+			int n=parents.bit(k);
+			no2gnode[s][g][n]->childpat = no2gnode[s][g][n]->childpat | node->childpat;
+		}
+		for(int k=0;k<node->childpat.count() && node->childpat.bit(k)<gno;k++) {
+			int n=node->childpat.bit(k);
+			if(!parents[n])
 				no2gnode[s][g][n]->parentpat = no2gnode[s][g][n]->parentpat | node->parentpat;
 		}
 	}
 	else {
-		node->childpat.resize(1+gno*(gno+1)/2);
-		node->parentpat.resize(1+gno*(gno+1)/2);
 		node->parentpat = node->parentpat | parents;
 		visit[node->nodeid]=true;
 		parents[node->nodeid]=1; // add the node to the parents
 
 		if(node->parent.Count()==1 && !node->parent[0]) { // node has source only as parent -> add transfrag from source to node
-			GBitVec trpat(1+gno*(gno+1)/2);
+			CPattern trpat;
 			trpat[0]=1;
 			trpat[node->nodeid]=1;
 			trpat[edge(0,node->nodeid,gno)]=1;
@@ -1009,7 +1425,7 @@ GBitVec traverse_dfs(int s,int g,CGraphnode *node,CGraphnode *sink,GBitVec paren
 			node->child.Add(sink->nodeid);  // add sink to the node's children
 			sink->parent.Add(node->nodeid); // add node to sink's parents
 			// create the transfrag that ends the node
-			GBitVec trpat(1+gno*(gno+1)/2);
+			CPattern trpat;
 			trpat[node->nodeid]=1;
 			trpat[gno-1]=1;
 			trpat[edge(node->nodeid,gno-1,gno)]=1;
@@ -1029,7 +1445,7 @@ GBitVec traverse_dfs(int s,int g,CGraphnode *node,CGraphnode *sink,GBitVec paren
 	    }
 
 	    for(int i=0; i< n; i++) { // for all children
-	    	GBitVec childparents=parents;
+	    	CPattern childparents=parents;
 	    	int min=node->nodeid; // nodeid is always smaller than child node ?
 	    	int max=node->child[i];
 	    	if(min>max) {
@@ -1043,14 +1459,14 @@ GBitVec traverse_dfs(int s,int g,CGraphnode *node,CGraphnode *sink,GBitVec paren
 	    }
 	} // end else from if(visit[node->nodeid])
 
-	GBitVec children = node->childpat;
+	CPattern children = node->childpat;
 	children[node->nodeid]=1;
 
 	return(children);
 }
 
 int create_graph(int refstart,int s,int g,CBundle *bundle,GPVec<CBundlenode>& bnode, GList<CJunction>& junction,GList<CJunction>& ejunction,GVec<CGraphinfo> **bundle2graph,
-		GPVec<CGraphnode> **no2gnode,GPVec<CTransfrag> **transfrag,GVec<float>& bpcov){
+		GPVec<CGraphnode> **no2gnode,GPVec<CTransfrag> **transfrag,CCovTrack& bpcov){
 
 	CGraphnode* source=new CGraphnode(0,0,0);
 	no2gnode[s][g].Add(source);
@@ -1212,7 +1628,7 @@ int create_graph(int refstart,int s,int g,CBundle *bundle,GPVec<CBundlenode>& bn
 		// add links between node and sink
 		int n1=int(futuretr[i]);
 		int n2=int(futuretr[i+1]);
-		GBitVec trpat(1+(graphno+1)*graphno/2);
+		CPattern trpat;
 		trpat[n1]=1;
 		GVec<int> nodes;
 		if(n2<0) {
@@ -1244,7 +1660,7 @@ int create_graph(int refstart,int s,int g,CBundle *bundle,GPVec<CBundlenode>& bn
 	// finished reading bundle -> now create the parents' and children's patterns
 	GVec<bool> visit;
 	visit.Resize(graphno,false);
-	GBitVec parents(1+(graphno+1)*graphno/2);
+	CPattern parents;
 
 	//fprintf(stderr,"traverse graph now ....\n");
 	traverse_dfs(s,g,source,sink,parents,graphno,visit,no2gnode,transfrag);
@@ -1460,7 +1876,7 @@ int create_graph(int s,int g,CBundle *bundle,GPVec<CBundlenode>& bnode, GList<CJ
 }
 */
 
-void get_read_pattern(GBitVec& pattern0,GBitVec& pattern1,int *rgno, GVec<int> *rnode,GList<CReadAln>& readlist,int n,
+void get_read_pattern(CPattern& pattern0,CPattern& pattern1,int *rgno, GVec<int> *rnode,GList<CReadAln>& readlist,int n,
 		GVec<int> *readgroup,GVec<int>& merge,GVec<int> *group2bundle,GVec<CGraphinfo> **bundle2graph,GVec<int> *graphno,GPVec<CGraphnode> **no2gnode) {
 
 	int lastgnode[2]={-1,-1}; // lastgnode[0] is for - strand; [1] is for + strand -> I need these in order to add the edges to the read pattern; check this: if it's not correct than storage was wrong!
@@ -1468,6 +1884,8 @@ void get_read_pattern(GBitVec& pattern0,GBitVec& pattern1,int *rgno, GVec<int> *
 
 	int k[2]={0,0}; // need to keep track of coordinates already added to coverages of graphnodes
     bool valid[2]={true,true};
+    GVec<CGraphnode*> covnode; // coverage added to graphnodes, needed only for a collapsed read
+    GVec<int> covbp;
 
     for(int i=0;i<readgroup[n].Count();i++)
     	if(valid[0] || valid[1]) { // there are still stranded bundles associated with the read
@@ -1490,6 +1908,7 @@ void get_read_pattern(GBitVec& pattern0,GBitVec& pattern1,int *rgno, GVec<int> *
     							if(bp) {
     								intersect=true;
     								node->cov+=float(bp)/readlist[n]->nh;
+    								if(readlist[n]->read_count>1) { covnode.cAdd(node); covbp.cAdd(bp); }
     								if(readlist[n]->segs[k[s]].end<=node->end) k[s]++;
     								else break;
 				  				}
@@ -1515,11 +1934,9 @@ void get_read_pattern(GBitVec& pattern0,GBitVec& pattern1,int *rgno, GVec<int> *
     							}
     							lastgnode[s]=gnode;
     							if(s) {
-    								pattern1.resize(1+(graphno[s][ngraph]+1)*graphno[s][ngraph]/2);
     								pattern1[gnode]=1; // here I could remember kids as well to speed things up
     							}
     							else {
-    								pattern0.resize(1+(graphno[s][ngraph]+1)*graphno[s][ngraph]/2);
     								pattern0[gnode]=1; // here I could remember kids as well to speed things up
     							}
     						} // end if(intersect
@@ -1533,101 +1950,143 @@ void get_read_pattern(GBitVec& pattern0,GBitVec& pattern1,int *rgno, GVec<int> *
     			} // endif(valid[s])
     	} // end if(valid[0] || valid[2])
 
-}
-
-void free_treepat(CTreePat *t){
-	if(t) {
-		for(int i=0;i<t->childno;i++) free_treepat(t->nextpat[i]);
-		GFREE(t->nextpat);
-		delete t;
-	}
-}
-
-CTreePat *construct_treepat(int gno, GPVec<CTransfrag>& transfrag) {
-
-	// create root CTreePat first
-	CTreePat *root=new CTreePat(0,gno-1); // if links from source to nodes are desired this should be changed
-
-	// now construct all child CTreePat's
-	for(int t=0;t<transfrag.Count();t++)
-		if(transfrag[t]->nodes[0]){ // don't include transfrags from source -> not needed
-			CTreePat *tree=root;
-			int m=0; // previous node in pattern that was set in pattern
-			for(int n=1;n<gno;n++){
-				if(transfrag[t]->pattern[n]) {
-					CTreePat *child;
-					if(m) { // there is a node m that was seen before
-						if(transfrag[t]->pattern[edge(m,n,gno)]) // there is an edge between m and n
-							child=tree->settree(gno-1-m+n-m-1,n,2*(gno-n-1));
-						else child=tree->settree(n-m-1,n,2*(gno-n-1));
-					}
-					else // this is the root tree
-						child=tree->settree(n-1,n,2*(gno-n-1));
-					tree=child;
-					m=n;
-				}
-			}
-			tree->tr=transfrag[t];
+    // add the coverage of the other copies of a collapsed read, one copy at a time
+    for(int c=1;c<readlist[n]->read_count;c++)
+    	for(int i=0;i<covnode.Count();i++)
+    		covnode[i]->cov+=float(covbp[i])/readlist[n]->nh;
+
+}
+
+CTrfIndex::CTrfIndex(int _gno):gno(_gno),entries(NULL),num(0),cap(0),keys(NULL),keynum(0),keycap(0),
+		buckets(NULL),nbuckets(64),last(-1) {
+	buckets=(int *)CBundleArena::allocate(nbuckets*sizeof(int));
+	for(int i=0;i<nbuckets;i++) buckets[i]=-1;
+}
+
+CTrfIndex::~CTrfIndex() {
+	CBundleArena::release(entries);
+	CBundleArena::release(keys);
+	CBundleArena::release(buckets);
+}
+
+void *CTrfIndex::grow(void *p,int count,int newcount,int size) {
+	void *np=CBundleArena::allocate(newcount*size);
+	if(count) memcpy(np,p,count*size);
+	CBundleArena::release(p); // the arena keeps the old array until the bundle is done
+	return(np);
+}
+
+void CTrfIndex::rehash() {
+	CBundleArena::release(buckets);
+	nbuckets*=2;
+	buckets=(int *)CBundleArena::allocate(nbuckets*sizeof(int));
+	for(int i=0;i<nbuckets;i++) buckets[i]=-1;
+	for(int e=0;e<num;e++) {
+		int b=entries[e].hash&(nbuckets-1);
+		entries[e].next=buckets[b];
+		buckets[b]=e;
+	}
+}
+
+// returns the entry of the path, or -1; doesn't allocate anything, so it can be
+// used after the index was handed to another thread
+int CTrfIndex::lookup(GVec<int>& node,CPattern& pattern,uint& hash) {
+	int len=node.Count();
+	hash=2166136261u;
+	for(int n=0;n<len;n++) {
+		int k=2*node[n];
+		if(n && pattern[edge(node[n-1],node[n],gno)]) k++; // there is an edge between node[n-1] and node[n]
+		hash=(hash^(uint)k)*16777619u;
+	}
+	hash^=hash>>15;
+	int e=last;
+	if(e<0 || entries[e].hash!=hash) e=buckets[hash&(nbuckets-1)];
+	for(;e>=0;e=entries[e].next)
+		if(entries[e].hash==hash && entries[e].len==len) {
+			int *key=keys+entries[e].key;
+			int n=0;
+			while(n<len && (key[n]>>1)==node[n] &&
+					(key[n]&1)==(n && pattern[edge(node[n-1],node[n],gno)])) n++;
+			if(n==len) {
+				last=e;
+				return(e);
+			}
+		}
+	return(-1);
+}
+
+CTransfrag *CTrfIndex::find(GVec<int>& node,CPattern& pattern) { // doesn't work for patterns including source node
+	uint hash;
+	int e=lookup(node,pattern,hash);
+	return(e<0 ? NULL : entries[e].tr);
+}
+
+void CTrfIndex::set(GVec<int>& node,CPattern& pattern,CTransfrag *t) {
+	uint hash;
+	int e=lookup(node,pattern,hash);
+	if(e<0) {
+		int len=node.Count();
+		if(num==cap) {
+			int newcap=cap ? 2*cap : 64;
+			entries=(Entry *)grow(entries,num,newcap,sizeof(Entry));
+			cap=newcap;
+		}
+		if(keynum+len>keycap) {
+			int newcap=GMAX(2*keycap,keynum+len+256);
+			keys=(int *)grow(keys,keynum,newcap,sizeof(int));
+			keycap=newcap;
+		}
+		e=num++;
+		entries[e].key=keynum;
+		entries[e].len=len;
+		entries[e].hash=hash;
+		for(int n=0;n<len;n++)
+			keys[keynum+n]=2*node[n]+(n && pattern[edge(node[n-1],node[n],gno)]);
+		keynum+=len;
+		if(num>nbuckets) rehash();
+		else {
+			int b=hash&(nbuckets-1);
+			entries[e].next=buckets[b];
+			buckets[b]=e;
 		}
-
-	return(root);
-}
-
-void print_pattern(CTreePat *tree,GStr& pattern,int gno) {
-	if(!tree) return;
-	pattern+=tree->nodeno;
-	if(tree->tr) {
-		fprintf(stderr,"pat: %s %f\n",pattern.chars(),tree->tr->abundance);
+		last=e;
 	}
-	for(int i=0;i<tree->childno;i++)
-		if(tree->nextpat[i]) {
-			GStr tmppat(pattern.chars());
-			if(i<gno-1-tree->nodeno) tmppat+=".";
-			else tmppat+="-";
-			print_pattern(tree->nextpat[i],tmppat,gno);
-		}
+	entries[e].tr=t;
 }
 
-CTransfrag *findtrf_in_treepat(int gno,GVec<int>& node,GBitVec& pattern,CTreePat *tr2no) { // doesn't work for patterns including source node
-
-	if(!tr2no) return(NULL);
+void CTrfIndex::reset(GVec<int>& node,CPattern& pattern) {
+	uint hash;
+	int e=lookup(node,pattern,hash);
+	if(e>=0) entries[e].tr=NULL;
+}
 
-	CTreePat *tree=tr2no;
-	for(int n=0;n<node.Count();n++) {
-		if(n) { // not the first node in pattern
-			if(pattern[edge(node[n-1],node[n],gno)]) // there is an edge between node[n-1] and node[n]
-				tree=tree->nextpat[gno-1-node[n-1]+node[n]-node[n-1]-1];
-			else tree=tree->nextpat[node[n]-node[n-1]-1];
+void CTrfIndex::print() {
+	for(int e=0;e<num;e++)
+		if(entries[e].tr) {
+			fprintf(stderr,"pat:");
+			for(int n=0;n<entries[e].len;n++) {
+				int k=keys[entries[e].key+n];
+				if(n) fprintf(stderr,"%c",(k&1) ? '-' : '.');
+				fprintf(stderr,"%d",k>>1);
+			}
+			fprintf(stderr," %f\n",entries[e].tr->abundance);
 		}
-		else tree=tree->nextpat[node[n]-1];
-		if(!tree) return(NULL);
-	}
-
-	return(tree->tr);
 }
 
-bool istrf_in_treepat(int gno,GVec<int>& node,GBitVec& pattern,CTreePat *tr2no) {
-
-	if(!tr2no) return(false);
+CTrfIndex *construct_trfindex(int gno, GPVec<CTransfrag>& transfrag) {
 
-	CTreePat *tree=tr2no;
-	for(int n=0;n<node.Count();n++) {
-		if(n) { // not the first node in pattern
-			if(pattern[edge(node[n-1],node[n],gno)]) // there is an edge between node[n-1] and node[n]
-				tree=tree->nextpat[gno-1-node[n-1]+node[n]-node[n-1]-1];
-			else tree=tree->nextpat[node[n]-node[n-1]-1];
-		}
-		else tree=tree->nextpat[node[n]-1];
-		if(!tree) return(false);
-	}
+	CTrfIndex *index=new CTrfIndex(gno);
+	for(int t=0;t<transfrag.Count();t++)
+		if(transfrag[t]->nodes[0]) // don't include transfrags from source -> not needed
+			index->set(transfrag[t]->nodes,transfrag[t]->pattern,transfrag[t]);
 
-	return(true);
+	return(index);
 }
 
-void update_abundance(int s,int g,int gno,GBitVec& pattern,float abundance,GVec<int>& node,GPVec<CTransfrag> **transfrag,
-		CTreePat ***tr2no){
+void update_abundance(int s,int g,CPattern& pattern,float abundance,GVec<int>& node,GPVec<CTransfrag> **transfrag,
+		CTrfIndex ***tr2no,int count=1){
 
-	CTransfrag *t=findtrf_in_treepat(gno,node,pattern,tr2no[s][g]);
+	CTransfrag *t=tr2no[s][g]->find(node,pattern);
 	if(!t) { // t is NULL
 		t=new CTransfrag(node,pattern,0);
 		/*
@@ -1640,33 +2099,23 @@ void update_abundance(int s,int g,int gno,GBitVec& pattern,float abundance,GVec<
 		transfrag[s][g].Add(t);
 
 		// node.Sort() : nodes should be sorted; if they are not then I should update to sort here
-		CTreePat *tree=tr2no[s][g];
-		for(int n=0;n<node.Count();n++) {
-			CTreePat *child;
-			if(n) { // not the first node in pattern
-				if(pattern[edge(node[n-1],node[n],gno)]) // there is an edge between node[n-1] and node[n]
-					child=tree->settree(gno-1-node[n-1]+node[n]-node[n-1]-1,node[n],2*(gno-node[n]-1));
-				else child=tree->settree(node[n]-node[n-1]-1,node[n],2*(gno-node[n]-1));
-			}
-			else child=tree->settree(node[n]-1,node[n],2*(gno-node[n]-1));
-			tree=child;
-		}
-		tree->tr=t;
+		tr2no[s][g]->set(node,pattern,t);
 	}
-	t->abundance+=abundance;
+	for(int c=0;c<count;c++) // once for each copy of a collapsed read
+		t->abundance+=abundance;
 
 }
 
 void get_fragment_pattern(GList<CReadAln>& readlist,int n, int np,GVec<int> *readgroup,GVec<int>& merge,
 		GVec<int> *group2bundle,GVec<CGraphinfo> **bundle2graph,GVec<int> *graphno,GPVec<CGraphnode> **no2gnode,
-		GPVec<CTransfrag> **transfrag,CTreePat ***tr2no) {
+		GPVec<CTransfrag> **transfrag,CTrfIndex ***tr2no) {
 
-	GBitVec rpat[2];
+	CPattern rpat[2];
 	int rgno[2]={-1,-1};
 	GVec<int> rnode[2];
 	if(readlist[n]->nh) get_read_pattern(rpat[0],rpat[1],rgno,rnode,readlist,n,readgroup,merge,group2bundle,bundle2graph,graphno,no2gnode);
 
-	GBitVec ppat[2];
+	CPattern ppat[2];
 	int pgno[2]={-1,-1};
 	GVec<int> pnode[2];
 	// get pair pattern if pair exists and it hasn't been deleted
@@ -1682,58 +2131,41 @@ void get_fragment_pattern(GList<CReadAln>& readlist,int n, int np,GVec<int> *rea
 				if(rgno[s]==pgno[s]) { // read and pair belong to the same graph
 					// check if there is a conflict of patterns
 					CGraphnode *gnode=no2gnode[s][rgno[s]][pnode[s][0]];
-					GBitVec conflictpattn=gnode->parentpat;
+					CPattern conflictpattn=gnode->parentpat;
 					conflictpattn[pnode[s][0]]=1;
 
-					if((conflictpattn & rpat[s])==rpat[s]) { // there isn't a conflict -> pair parents should contain read pattern
+					if(conflictpattn.contains(rpat[s])) { // there isn't a conflict -> pair parents should contain read pattern
 						conflict=false;
 						int i=0;
 						if(pnode[s][0]==rnode[s].Last()) // read and pair share a node
 							i++;
 						while(i<pnode[s].Count()) { rnode[s].Add(pnode[s][i]);i++;}
 						rpat[s]=rpat[s]|ppat[s];
-						update_abundance(s,rgno[s],graphno[s][rgno[s]],rpat[s],float(1)/readlist[n]->nh,rnode[s],transfrag,tr2no);
+						update_abundance(s,rgno[s],rpat[s],float(1)/readlist[n]->nh,rnode[s],transfrag,tr2no);
 					}
 				}
 				if(conflict) { // update both patterns separately
-					update_abundance(s,rgno[s],graphno[s][rgno[s]],rpat[s],float(1)/readlist[n]->nh,rnode[s],transfrag,tr2no);
-					update_abundance(s,pgno[s],graphno[s][pgno[s]],ppat[s],float(1)/readlist[np]->nh,pnode[s],transfrag,tr2no);
+					update_abundance(s,rgno[s],rpat[s],float(1)/readlist[n]->nh,rnode[s],transfrag,tr2no);
+					update_abundance(s,pgno[s],ppat[s],float(1)/readlist[np]->nh,pnode[s],transfrag,tr2no);
 				}
 			}
 			else { // pair has no valid pattern
-				update_abundance(s,rgno[s],graphno[s][rgno[s]],rpat[s],float(1)/readlist[n]->nh,rnode[s],transfrag,tr2no);
+				update_abundance(s,rgno[s],rpat[s],float(1)/readlist[n]->nh,rnode[s],transfrag,tr2no,readlist[n]->read_count);
 			}
 		}
 		else // read has no valid pattern but pair might
 			if(pgno[s]>-1) {
-				update_abundance(s,pgno[s],graphno[s][pgno[s]],ppat[s],float(1)/readlist[np]->nh,pnode[s],transfrag,tr2no);
+				update_abundance(s,pgno[s],ppat[s],float(1)/readlist[np]->nh,pnode[s],transfrag,tr2no);
 			}
 	}
 
 }
 
-void settrf_in_treepat(CTransfrag *t,int gno,GVec<int>& node,GBitVec& pattern,CTreePat *tr2no) {
-
-	if(!tr2no) return;
-
-	CTreePat *tree=tr2no;
-	for(int n=0;n<node.Count();n++) {
-		if(n) { // not the first node in pattern
-			if(pattern[edge(node[n-1],node[n],gno)]) // there is an edge between node[n-1] and node[n]
-				tree=tree->nextpat[gno-1-node[n-1]+node[n]-node[n-1]-1];
-			else tree=tree->nextpat[node[n]-node[n-1]-1];
-		}
-		else tree=tree->nextpat[node[n]-1];
-		if(!tree) return;
-	}
-	tree->tr=t;
-}
-
-void eliminate_transfrags_under_thr(int gno,GPVec<CTransfrag>& transfrag, CTreePat *tr2no,float threshold) {
+void eliminate_transfrags_under_thr(int gno,GPVec<CTransfrag>& transfrag, CTrfIndex *tr2no,float threshold) {
 
 	for(int t=transfrag.Count()-1;t>=0;t--)
 		if(transfrag[t]->abundance<threshold && transfrag[t]->nodes[0] && transfrag[t]->nodes.Last()<gno-1) { // need to delete transfrag that doesn't come from source or ends at sink
-			settrf_in_treepat(NULL,gno,transfrag[t]->nodes,transfrag[t]->pattern,tr2no); // this should be eliminated if I want to store transcripts from 0 node
+			if(tr2no) tr2no->reset(transfrag[t]->nodes,transfrag[t]->pattern); // this should be eliminated if I want to store transcripts from 0 node
 			transfrag.Exchange(t,transfrag.Count()-1);
 			transfrag.Delete(transfrag.Count()-1);
 		}
@@ -1742,7 +2174,7 @@ void eliminate_transfrags_under_thr(int gno,GPVec<CTransfrag>& transfrag, CTreeP
 		threshold++;
 		for(int t=transfrag.Count()-1;t>=0;t--)
 			if(transfrag[t]->abundance<threshold && transfrag[t]->nodes[0] && transfrag[t]->nodes.Last()<gno-1) { // need to delete transfrag that doesn't come from source
-				settrf_in_treepat(NULL,gno,transfrag[t]->nodes,transfrag[t]->pattern,tr2no); // this should be eliminated if I want to store transcripts from 0 node
+				if(tr2no) tr2no->reset(transfrag[t]->nodes,transfrag[t]->pattern); // this should be eliminated if I want to store transcripts from 0 node
 				transfrag.Exchange(t,transfrag.Count()-1);
 				transfrag.Delete(transfrag.Count()-1);
 			}
@@ -1750,7 +2182,7 @@ void eliminate_transfrags_under_thr(int gno,GPVec<CTransfrag>& transfrag, CTreeP
 
 }
 
-bool conflict(int &i,int node,GVec<int>& trnode,int n,GPVec<CGraphnode>& no2gnode,GBitVec& trpat,int gno) {
+bool conflict(int &i,int node,GVec<int>& trnode,int n,GPVec<CGraphnode>& no2gnode,CPattern& trpat,int gno) {
 
   while(i<n && node>trnode[i]) i++;
 
@@ -1830,8 +2262,8 @@ void assign_incomplete_trf_to_nodes(int t,int n1, int n2,GPVec<CGraphnode>& no2g
 
 }
 
-void process_transfrags(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& transfrag,CTreePat *tr2no,
-		GVec<bool>& compatible) {
+void process_transfrags(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& transfrag,CTrfIndex *tr2no,
+		CCompatTable& compatible) {
 
 	/*
 	{ // DEBUG ONLY
@@ -1896,7 +2328,7 @@ void process_transfrags(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& t
 			if(nchild==1) { // if an only child I don't need to solve the linear system of equations
 				int c=no2gnode[i]->child[0];
 				if(!f[i][c] && n[i][c]) { // one child that has no out links but there are transcripts going through it
-					GBitVec trpat(1+(gno+1)*gno/2);
+					CPattern trpat;
 					trpat[i]=1;
 					trpat[c]=1;
 					trpat[edge(i,c,gno)]=1;
@@ -1946,7 +2378,7 @@ void process_transfrags(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& t
 						if(k!=minj) xk=n[i][no2gnode[i]->child[k]]*(f[i][no2gnode[i]->child[minj]]+xj)/n[i][no2gnode[i]->child[minj]]-f[i][no2gnode[i]->child[k]];
 						else xk=xj;
 						if(xk) {
-							GBitVec trpat(1+(gno+1)*gno/2);
+							CPattern trpat;
 							trpat[i]=1;
 							trpat[no2gnode[i]->child[k]]=1;
 							trpat[edge(i,no2gnode[i]->child[k],gno)]=1;
@@ -1974,7 +2406,9 @@ void process_transfrags(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& t
 	}
 	*/
 
-	// create compatibilities
+	// compatibilities are checked when they are needed
+	compatible.init(gno,no2gnode,transfrag);
+
 	for(int t1=0;t1<transfrag.Count();t1++) { // transfrags are processed in increasing order -> important for the later considerations
 
 		// update nodes
@@ -2007,43 +2441,6 @@ void process_transfrags(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& t
 		else { // this transcript is included completely in node
 			no2gnode[transfrag[t1]->nodes[0]]->frag+=transfrag[t1]->abundance;
 		}
-
-		// add t1 to t1 compatibility
-		bool comp=true;
-		compatible.Add(comp);
-		for(int t2=t1+1;t2<transfrag.Count();t2++) {
-			// here check compatibility between t1 and t2;
-			int n2=transfrag[t2]->nodes.Count();
-			int i1=0;
-			int i2=0;
-			comp=true;
-			while(i1<n1 && i2<n2) {
-				if(transfrag[t1]->nodes[i1]==transfrag[t2]->nodes[i2]) {
-					if(i1==n1-1 || i2==n2-1) { // one transcript finishes -> no need to check anymore
-						i1=n1;i2=n2;
-					}
-					else { // advance the smallest one
-						if(transfrag[t1]->nodes[i1+1]<transfrag[t2]->nodes[i2+1]) i1++;
-						else i2++;
-					}
-				}
-				else if(transfrag[t1]->nodes[i1]<transfrag[t2]->nodes[i2]) {
-					i1++;
-					if(conflict(i1,transfrag[t2]->nodes[i2],transfrag[t1]->nodes,n1,no2gnode,transfrag[t1]->pattern,gno)) {
-						comp=false;
-						break;
-					}
-				}
-				else {
-					i2++;
-					if(conflict(i2,transfrag[t1]->nodes[i1],transfrag[t2]->nodes,n2,no2gnode,transfrag[t2]->pattern,gno)) {
-						comp=false;
-						break;
-					}
-				}
-			}
-			compatible.Add(comp);
-		} // end for(int t2=t1+1;t2<transfrag.Count();t2++)
 	} // end for(int t1=0;t1<transfrag.Count();t1++)
 
 	// set source-to-child transfrag abundances: optional in order not to keep these abundances too low:
@@ -2067,13 +2464,61 @@ void process_transfrags(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& t
 
 }
 
-inline int comptbl_pos(int t1,int t2,int n){
-	return(t2+t1*(2*n-t1-1)/2);
+void CCompatTable::init(int _gno,GPVec<CGraphnode>& _no2gnode,GPVec<CTransfrag>& _transfrag) {
+	clear();
+	gno=_gno;
+	no2gnode=&_no2gnode;
+	transfrag=&_transfrag;
+	n=_transfrag.Count();
+	if(n) GCALLOC(rows,n*sizeof(uint64_t*));
 }
 
-bool is_compatible(int t1,int t2, int n,GVec<bool>& compatible) {
-	if(t1<t2) return(compatible[comptbl_pos(t1,t2,n)]);
-	else return(compatible[comptbl_pos(t2,t1,n)]);
+void CCompatTable::clear() {
+	if(rows) {
+		for(int t=0;t<n;t++) GFREE(rows[t]);
+		GFREE(rows);
+	}
+	n=0;
+}
+
+bool CCompatTable::check(int t1,int t2) {
+	GVec<int>& nodes1=(*transfrag)[t1]->nodes;
+	GVec<int>& nodes2=(*transfrag)[t2]->nodes;
+	int n1=nodes1.Count();
+	int n2=nodes2.Count();
+	int i1=0;
+	int i2=0;
+	while(i1<n1 && i2<n2) {
+		if(nodes1[i1]==nodes2[i2]) {
+			if(i1==n1-1 || i2==n2-1) { // one transcript finishes -> no need to check anymore
+				i1=n1;i2=n2;
+			}
+			else { // advance the smallest one
+				if(nodes1[i1+1]<nodes2[i2+1]) i1++;
+				else i2++;
+			}
+		}
+		else if(nodes1[i1]<nodes2[i2]) {
+			i1++;
+			if(conflict(i1,nodes2[i2],nodes1,n1,*no2gnode,(*transfrag)[t1]->pattern,gno)) return(false);
+		}
+		else {
+			i2++;
+			if(conflict(i2,nodes1[i1],nodes2,n2,*no2gnode,(*transfrag)[t2]->pattern,gno)) return(false);
+		}
+	}
+	return(true);
+}
+
+void CCompatTable::fill(int t1,int b) {
+	int nchecks=checkwords(t1);
+	if(!rows[t1]) GCALLOC(rows[t1],(nchecks+((n-1)>>6)-(t1>>6)+1)*sizeof(uint64_t));
+	uint64_t* r=rows[t1];
+	int first=((t1>>6)+b)<<6; // first transfrag of the block
+	int last=GMIN(first+64,n);
+	for(int t2=GMAX(first,t1+1);t2<last;t2++)
+		if(check(t1,t2)) r[nchecks+b]|=(uint64_t)1<<(t2&63);
+	r[b>>6]|=(uint64_t)1<<(b&63);
 }
 
 /*
@@ -2127,8 +2572,78 @@ GVec<int> *max_compon_size(int trnumber,float &maxsize,GVec<CTrInfo>& set,GVec<b
 }
 */
 
-GVec<int> *max_compon_size_with_penalty(int trnumber,float &maxsize,GVec<CTrInfo>& set,GVec<bool>& compatible,
-		GBitVec& mark,GBitVec& removable, GHash<CComponent>& computed) {
+void CComponentCache::unlink(int e) {
+	int *p=&buckets[entries[e].h1&(nbuckets-1)];
+	while(*p!=e) p=&entries[*p].next;
+	*p=entries[e].next;
+}
+
+void CComponentCache::rehash(int newnbuckets) {
+	GFREE(buckets);
+	nbuckets=newnbuckets;
+	GMALLOC(buckets,nbuckets*sizeof(int));
+	for(int i=0;i<nbuckets;i++) buckets[i]=-1;
+	for(int e=0;e<num;e++) {
+		int b=entries[e].h1&(nbuckets-1);
+		entries[e].next=buckets[b];
+		buckets[b]=e;
+	}
+}
+
+CComponent *CComponentCache::find(uint64_t h1,uint64_t h2,GVec<CTrInfo>& set) {
+	if(!num) return(NULL);
+	for(int e=buckets[h1&(nbuckets-1)];e>=0;e=entries[e].next)
+		if(entries[e].h1==h1 && entries[e].h2==h2 && entries[e].len==set.Count()) {
+			int i=0;
+			while(i<set.Count() && entries[e].key[i]==keyval(set[i])) i++;
+			if(i==set.Count()) return(entries[e].comp);
+		}
+	return(NULL);
+}
+
+void CComponentCache::add(uint64_t h1,uint64_t h2,GVec<CTrInfo>& set,CComponent *comp) {
+	int e;
+	if(num==MAX_COMPCACHE) { // replace the oldest entry
+		e=oldest;
+		oldest=(oldest+1)%MAX_COMPCACHE;
+		unlink(e);
+		delete entries[e].comp;
+		GFREE(entries[e].key);
+	}
+	else {
+		if(num==cap) {
+			cap=GMIN(cap ? 2*cap : 256,MAX_COMPCACHE);
+			GREALLOC(entries,cap*sizeof(Entry));
+		}
+		e=num++;
+	}
+	Entry& en=entries[e];
+	en.h1=h1;
+	en.h2=h2;
+	en.len=set.Count();
+	GMALLOC(en.key,en.len*sizeof(int));
+	for(int i=0;i<en.len;i++) en.key[i]=keyval(set[i]);
+	en.comp=comp;
+	if(num>nbuckets) rehash(nbuckets ? 2*nbuckets : 256);
+	else {
+		int b=h1&(nbuckets-1);
+		en.next=buckets[b];
+		buckets[b]=e;
+	}
+}
+
+void CComponentCache::Clear() {
+	for(int e=0;e<num;e++) {
+		delete entries[e].comp;
+		GFREE(entries[e].key);
+	}
+	num=0;
+	oldest=0;
+	for(int i=0;i<nbuckets;i++) buckets[i]=-1;
+}
+
+GVec<int> *max_compon_size_with_penalty(int trnumber,float &maxsize,GVec<CTrInfo>& set,CCompatTable& compatible,
+		GBitVec& mark,GBitVec& removable, CComponentCache& computed) {
 
 	// this max_compon presumes the set is always sorted according to the set.trno
 
@@ -2139,13 +2654,12 @@ GVec<int> *max_compon_size_with_penalty(int trnumber,float &maxsize,GVec<CTrInfo
 		float size=set[i].abundance-penalty;
 		float maxagreesize=0;
 		GVec<CTrInfo> agreeset;
-		GStr s;
+		uint64_t h1=0xcbf29ce484222325ULL; // hash of agreeset
+		uint64_t h2=0;
 		for(int j=i+1;j<set.Count();j++) {
-			if(compatible[comptbl_pos(set[i].trno,set[j].trno,trnumber)]) { // make sure that the transcripts in set are sorted to speed up things
+			if(compatible(set[i].trno,set[j].trno)) { // make sure that the transcripts in set are sorted to speed up things
 				agreeset.Add(set[j]);
-				s+=set[j].trno;
-				if(set[j].abundance) s+=' '; else s+='.';
-				if(set[j].penalty) s+=' ';else s+='.';
+				CComponentCache::hash(h1,h2,CComponentCache::keyval(set[j]));
 				maxagreesize+=set[j].abundance;
 			}
 			else if(mark[set[j].trno]) { // set[j] is a special interest transfrag that I prefer keeping
@@ -2162,12 +2676,12 @@ GVec<int> *max_compon_size_with_penalty(int trnumber,float &maxsize,GVec<CTrInfo
 		GVec<int> *agreeresult=NULL;
 
 		if(size>MIN_VAL && agreeset.Count() && (size+maxagreesize>maxsize)) {
-			CComponent *agreecomp=computed[s.chars()];
+			CComponent *agreecomp=computed.find(h1,h2,agreeset);
 			if(!agreecomp) {
 				float agreesize=MIN_VAL;
 				agreeresult=max_compon_size_with_penalty(trnumber,agreesize,agreeset,compatible,mark,removable,computed);
 				agreecomp=new CComponent(agreesize,agreeresult);
-				computed.Add(s.chars(),agreecomp);
+				computed.add(h1,h2,agreeset,agreecomp);
 			}
 			else agreeresult=agreecomp->set;
 			size+=agreecomp->size;
@@ -2195,7 +2709,7 @@ GVec<int> *max_compon_size_with_penalty(int trnumber,float &maxsize,GVec<CTrInfo
 	return(result);
 }
 
-bool onpath(GBitVec& trpattern,GVec<int>& trnode,GBitVec& pathpattern,int mini,int maxi,GPVec<CGraphnode>& no2gnode,int gno) {
+bool onpath(CPattern& trpattern,GVec<int>& trnode,CPattern& pathpattern,int mini,int maxi,GPVec<CGraphnode>& no2gnode,int gno) {
 
 	if(trnode[0]<mini) // mini can be reached through transcript
 	    if(!no2gnode[mini]->parentpat[trnode[0]])	return false;
@@ -2299,7 +2813,7 @@ bool can_be_removed_back_all(float abundance,int lasttrnode,GVec<int>& path,GVec
 }
 */
 
-bool can_be_removed_back(float abundance,GBitVec& pattern,float& penalty,int lasttrnode,GVec<int>& path,GVec<float>& pathincov,GVec<float>& pathoutcov) {  // this assumes the incomplete transcripts only add to the nodes they pass through
+bool can_be_removed_back(float abundance,CPattern& pattern,float& penalty,int lasttrnode,GVec<int>& path,GVec<float>& pathincov,GVec<float>& pathoutcov) {  // this assumes the incomplete transcripts only add to the nodes they pass through
 
 	if(pattern[path.Last()] && pathoutcov.Last()-abundance<epsilon) { // transcript leaving the last added node to path is the only one
 		penalty=abundance;
@@ -2329,7 +2843,7 @@ bool can_be_removed_back(float abundance,GBitVec& pattern,float& penalty,int las
   return(true);
 }
 
-bool can_be_removed_fwd(float abundance,GBitVec& pattern, float& penalty, int firstnode,GVec<int>& path,GVec<float>& pathincov,
+bool can_be_removed_fwd(float abundance,CPattern& pattern, float& penalty, int firstnode,GVec<int>& path,GVec<float>& pathincov,
 		GVec<float>& pathoutcov) { // incomplete transcripts are all considered to go through their nodes
 
 	//fprintf(stderr,"can be removed abundance=%f\n",abundance);
@@ -2387,7 +2901,7 @@ bool can_be_removed_fwd_all(float abundance,int firstnode,GVec<int>& path,GVec<f
 }
 */
 
-bool fwd_to_sink_fast(int i,GVec<int>& path,GBitVec& pathpat,GPVec<CTransfrag>& transfrag,GPVec<CGraphnode>& no2gnode,
+bool fwd_to_sink_fast(int i,GVec<int>& path,CPattern& pathpat,GPVec<CTransfrag>& transfrag,GPVec<CGraphnode>& no2gnode,
 		GVec<float>& nodecov,int gno){
 
 	// find all parents -> if parent is source then go back
@@ -2499,7 +3013,7 @@ bool fwd_to_sink_fast(int i,GVec<int>& path,GBitVec& pathpat,GPVec<CTransfrag>&
 	return fwd_to_sink_fast(maxc,path,pathpat,transfrag,no2gnode,nodecov,gno);
 }
 
-bool back_to_source_fast(int i,GVec<int>& path,GBitVec& pathpat,GPVec<CTransfrag>& transfrag,GPVec<CGraphnode>& no2gnode,
+bool back_to_source_fast(int i,GVec<int>& path,CPattern& pathpat,GPVec<CTransfrag>& transfrag,GPVec<CGraphnode>& no2gnode,
 		GVec<float>& nodecov,int gno){
 
 	// find all parents -> if parent is source then go back
@@ -2617,9 +3131,9 @@ bool back_to_source_fast(int i,GVec<int>& path,GBitVec& pathpat,GPVec<CTransfrag
 	return back_to_source_fast(maxp,path,pathpat,transfrag,no2gnode,nodecov,gno);
 }
 
-bool back_to_source_path(int i,GVec<int>& path,GBitVec& pathpat,GVec<float>& pathincov, GVec<float>& pathoutcov,
-		GBitVec& istranscript,GBitVec& removable,GPVec<CTransfrag>& transfrag,GHash<CComponent>& computed,
-		GVec<bool>& compatible,GPVec<CGraphnode>& no2gnode,GVec<float>& nodecov,int gno){
+bool back_to_source_path(int i,GVec<int>& path,CPattern& pathpat,GVec<float>& pathincov, GVec<float>& pathoutcov,
+		GBitVec& istranscript,GBitVec& removable,GPVec<CTransfrag>& transfrag,CComponentCache& computed,
+		CCompatTable& compatible,GPVec<CGraphnode>& no2gnode,GVec<float>& nodecov,int gno){
 
 	// find all parents -> if parent is source then go back
 	CGraphnode *inode=no2gnode[i];
@@ -2870,9 +3384,9 @@ bool back_to_source_path(int i,GVec<int>& path,GBitVec& pathpat,GVec<float>& pat
 	return back_to_source_path(maxp,path,pathpat,pathincov,pathoutcov,istranscript,removable,transfrag,computed,compatible,no2gnode,nodecov,gno);
 }
 
-bool fwd_to_sink_path(int i,GVec<int>& path,GBitVec& pathpat,GVec<float>& pathincov, GVec<float>& pathoutcov,
-		GBitVec& istranscript,GBitVec& removable,GPVec<CTransfrag>& transfrag,GHash<CComponent>& computed,
-		GVec<bool>& compatible,GPVec<CGraphnode>& no2gnode,GVec<float>& nodecov,int gno){
+bool fwd_to_sink_path(int i,GVec<int>& path,CPattern& pathpat,GVec<float>& pathincov, GVec<float>& pathoutcov,
+		GBitVec& istranscript,GBitVec& removable,GPVec<CTransfrag>& transfrag,CComponentCache& computed,
+		CCompatTable& compatible,GPVec<CGraphnode>& no2gnode,GVec<float>& nodecov,int gno){
 
 	// find all parents -> if parent is source then go back
 	CGraphnode *inode=no2gnode[i];
@@ -3271,66 +3785,112 @@ void compute_capacity_back(int firstn, CTransfrag *t,float val,GVec<float>& capa
 }
 
 
-bool bfs(int n,GVec<float> *capacity,GVec<float> *flow,GVec<int> *link,GVec<int>& pred) {
-	GVec<int> color;
-	color.Resize(n+2,0);
+void CFlowNet::init(int nodes) {
+	if(nodes>cap) {
+		delete [] edges;
+		delete [] link;
+		edges=new GVec<CFlowEdge>[nodes];
+		link=new GVec<int>[nodes];
+		cap=nodes;
+	}
+	for(int i=0;i<nodes;i++) { // empty the edge lists but keep their memory
+		edges[i].setCount(0);
+		link[i].setCount(0);
+	}
+	n=nodes;
+	color.setCount(0);
+	color.Resize(n,0);
+	pred.setCount(0);
+	pred.Resize(n,-1);
+}
+
+int CFlowNet::findpos(int u,int v) {
+	GVec<CFlowEdge>& e=edges[u];
+	int lo=0;
+	int hi=e.Count();
+	while(lo<hi) {
+		int mid=(lo+hi)/2;
+		if(e[mid].node<v) lo=mid+1;
+		else hi=mid;
+	}
+	if(lo<e.Count() && e[lo].node==v) return(lo);
+	return(-1-lo);
+}
+
+CFlowEdge& CFlowNet::edge(int u,int v) {
+	int p=findpos(u,v);
+	if(p<0) {
+		p=-1-p;
+		CFlowEdge e;
+		e.node=v;
+		e.capacity=0;
+		e.flow=0;
+		e.rate=1;
+		edges[u].Insert(p,e);
+	}
+	return(edges[u][p]);
+}
+
+bool CFlowNet::bfs(int sink) {
+	for(int i=0;i<n;i++) color[i]=0;
+	queue.Resize(0);
 	int head=0;
-	int tail=0;
-	GVec<int> q;
 
 	// enque 0 (source)
-	q.cAdd(0);
-	tail++;
+	queue.cAdd(0);
 	color[0]=1;
 	pred[0]=-1;
-	while(head!=tail) {
+	while(head<queue.Count()) {
 		// deque
-		int u=q[head];
+		int u=queue[head];
 		head++;
 		color[u]=2;
-		//for(int v=0;v<link[u].Count();v++)
-		for(int v=link[u].Count()-1;v>=0;v--) // do this so longer transcripts would have higher priority (be considered first)
-			if(!color[link[u][v]] && capacity[u][link[u][v]]-flow[u][link[u][v]]>epsilon) {
-				// enque v
-				q.Add(link[u][v]);
-				tail++;
-				color[link[u][v]]=1;
-				pred[link[u][v]]=u;
+		for(int k=link[u].Count()-1;k>=0;k--) { // do this so longer transcripts would have higher priority (be considered first)
+			int v=link[u][k];
+			if(!color[v]) {
+				CFlowEdge *e=find(u,v);
+				if(e->capacity-e->flow>epsilon) {
+					// enque v
+					queue.Add(v);
+					color[v]=1;
+					pred[v]=u;
+				}
 			}
+		}
 	}
 
-	return(color[n-1]==2);
+	return(color[sink]==2);
 }
 
-
-bool weight_bfs(int n,GVec<float> *capacity,GVec<float> *flow,GVec<int> *link,GVec<int>& pred) {
-	GVec<int> color;
-	color.Resize(n,0);
+bool CFlowNet::weight_bfs(int sink) {
+	for(int i=0;i<n;i++) color[i]=0;
+	queue.Resize(0);
 	int head=0;
-	int tail=0;
-	GVec<int> q;
 
 	// enque 0 (source)
-	q.cAdd(0);
-	tail++;
+	queue.cAdd(0);
 	color[0]=1;
 	pred[0]=-1;
-	while(head!=tail) {
+	while(head<queue.Count()) {
 		// deque
-		int u=q[head];
+		int u=queue[head];
 		head++;
 		color[u]=2;
-		for(int v=0;v<link[u].Count();v++)
-			if(!color[link[u][v]] && capacity[u][link[u][v]]-flow[u][link[u][v]]>epsilon && (link[u][v]<u || capacity[u][u]-flow[u][u]>epsilon)) {
-				// enque v
-				q.Add(link[u][v]);
-				tail++;
-				color[link[u][v]]=1;
-				pred[link[u][v]]=u;
+		for(int k=0;k<link[u].Count();k++) {
+			int v=link[u][k];
+			if(!color[v]) {
+				CFlowEdge *e=find(u,v);
+				if(e->capacity-e->flow>epsilon && (v<u || capacity(u,u)-flow(u,u)>epsilon)) {
+					// enque v
+					queue.Add(v);
+					color[v]=1;
+					pred[v]=u;
+				}
 			}
+		}
 	}
 
-	return(color[n-1]==2);
+	return(color[sink]==2);
 }
 
 /*
@@ -3535,31 +4095,34 @@ float max_flow_partial(int lastn,int gno,GVec<int>& path,GBitVec& istranscript,G
 }
 */
 
-void get_rate(int n1, int n2,GVec<CNetEdge>& edg,GVec<float> *capacity,GVec<float> *rate,float noderate) {
+void get_rate(int n1, int n2,GVec<CNetEdge>& edg,CFlowNet& net,float noderate) {
 	int k=0;
 	int n=edg.Count();
-	float abundance=capacity[n1][n2];
-	capacity[n1][n2]=0;
-	rate[n1][n2]=0;
+	CFlowEdge& e=net.edge(n1,n2);
+	float abundance=e.capacity;
+	e.capacity=0;
+	e.rate=0;
 	while(abundance && k<n) {
 		int n3=edg[k].link;
-		if(rate[n3][n1]) {
-			float available=capacity[n3][n1]*noderate/rate[n3][n1];
+		float rate31=net.rate(n3,n1);
+		if(rate31) {
+			float capacity31=net.capacity(n3,n1);
+			float available=capacity31*noderate/rate31;
 			if(available<abundance) {
-				capacity[n1][n2]+=capacity[n3][n1];
+				e.capacity+=capacity31;
 				abundance-=available;
-				rate[n1][n2]+=available;
+				e.rate+=available;
 			}
 			else {
-				capacity[n1][n2]+=abundance*rate[n3][n1]/noderate;
-				rate[n1][n2]+=abundance;
+				e.capacity+=abundance*rate31/noderate;
+				e.rate+=abundance;
 				abundance=0;
 			}
 		}
 		else break;
 		k++;
 	}
-	if(rate[n1][n2]) rate[n1][n2]=capacity[n1][n2]/rate[n1][n2];
+	if(e.rate) e.rate=e.capacity/e.rate;
 }
 
 /*
@@ -3851,15 +4414,12 @@ float max_flow_partial_back(int firstn,GVec<int>& path,GBitVec& istranscript,GPV
 
 
 float max_flow(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag>& transfrag,GPVec<CGraphnode>& no2gnode,
-		GVec<float>& nodecapacity,GBitVec& pathpat,float& fragno) {
+		GVec<float>& nodecapacity,CPattern& pathpat,CFlowNet& net,float& fragno) {
 
 	float flux=0;
 	int n=path.Count();
-	GVec<float> *capacity=new GVec<float>[n]; // capacity of edges in network
-	GVec<float> *flow=new GVec<float>[n]; // flow in network
-	GVec<int> *link=new GVec<int>[n]; // for each node remembers it's neighbours
-	GVec<int> pred; // this stores the augmenting path
-	pred.Resize(n,-1);
+	net.init(n); // flow network of the path
+	GVec<int>& pred=net.pred; // this stores the augmenting path
 	GVec<int> node2path;
 	node2path.Resize(gno,-1);
 
@@ -3880,8 +4440,6 @@ float max_flow(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag>&
 	for(int i=0;i<n;i++) {
 		node2path[path[i]]=i;
 		nodecapacity.cAdd(0.0);
-		capacity[i].Resize(n,0);
-		flow[i].Resize(n,0);
 	}
 
 	// establish capacities in the network
@@ -3889,7 +4447,7 @@ float max_flow(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag>&
 		int nt=no2gnode[path[i]]->trf.Count();
 		for(int j=0;j<nt;j++) {
 			int t=no2gnode[path[i]]->trf[j];
-			if(transfrag[t]->abundance && (istranscript[t] || ((pathpat & transfrag[t]->pattern)==transfrag[t]->pattern))) {
+			if(transfrag[t]->abundance && (istranscript[t] || pathpat.contains(transfrag[t]->pattern))) {
 				istranscript[t]=1;
 				if(transfrag[t]->nodes[0]==path[i]) { // transfrag starts at this node
 					int n1=i;
@@ -3897,28 +4455,26 @@ float max_flow(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag>&
 					if(!no2gnode[path[i]]->rate) n1=0;
 					if(!no2gnode[transfrag[t]->nodes.Last()]->rate) n2=n-1;
 					//fprintf(stderr,"t=%d n1=%d n2=%d ",t,n1,n2);
-					if(!capacity[n1][n2]) { // haven't seen this link before
-						link[n1].Add(n2);
-						link[n2].Add(n1);
-					}
-					capacity[n1][n2]+=transfrag[t]->abundance;
-					//fprintf(stderr,"capacity[%d][%d]=%f after adding transfrag[%d]->abundance=%f\n",n1,n2,capacity[n1][n2],t,transfrag[t]->abundance);
+					if(!net.capacity(n1,n2)) // haven't seen this link before
+						net.addlink(n1,n2);
+					net.edge(n1,n2).capacity+=transfrag[t]->abundance;
 				}
 			}
 		}
 	}
 
-	for(int i=0;i<n;i++) link[i].Sort();
+	for(int i=0;i<n;i++) net.links(i).Sort();
 
 	GVec<float> rate;
 	rate.Resize(n,1);
 
-	while(bfs(n,capacity,flow,link,pred)) {
+	while(net.bfs(n-1)) {
 		int r=0;
 		float increment=FLT_MAX;
 		rate[r++]=1;
 		for(int u=n-1;pred[u]>=0;u=pred[u]) {
-			float adjflux=(capacity[pred[u]][u]-flow[pred[u]][u])*rate[r-1];
+			CFlowEdge *e=net.find(pred[u],u);
+			float adjflux=(e->capacity-e->flow)*rate[r-1];
 			increment = increment < adjflux ? increment : adjflux; // minimum flux increment on the path
 			if(pred[pred[u]]>=0) {
 				if(pred[u]<u) {
@@ -3934,8 +4490,8 @@ float max_flow(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag>&
 		}
 		r=0;
 		for(int u=n-1;pred[u]>=0;u=pred[u]) {
-			flow[pred[u]][u]+=increment/rate[r];
-			flow[u][pred[u]]-=increment/rate[r];
+			net.find(pred[u],u)->flow+=increment/rate[r];
+			net.find(u,pred[u])->flow-=increment/rate[r];
 			r++;
 		}
 		flux+=increment;
@@ -3945,7 +4501,7 @@ float max_flow(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag>&
 	{ // DEBUG ONLY
 		fprintf(stderr,"Flow:");
 		for(int n1=0;n1<n;n1++)
-			for(int n2=n1+1;n2<n;n2++) if(flow[n1][n2]) fprintf(stderr," [%d][%d]=%f",n1,n2,flow[n1][n2]);
+			for(int n2=n1+1;n2<n;n2++) if(net.flow(n1,n2)) fprintf(stderr," [%d][%d]=%f",n1,n2,net.flow(n1,n2));
 		fprintf(stderr,"\n");
 	}
 	*/
@@ -3963,16 +4519,17 @@ float max_flow(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag>&
 					int n2=node2path[transfrag[t]->nodes.Last()];
 					if(!no2gnode[path[i]]->rate) n1=0;
 					if(!no2gnode[transfrag[t]->nodes.Last()]->rate) n2=n-1;
-					if(flow[n1][n2]>0) {
-						if(flow[n1][n2]<transfrag[t]->abundance) {
-							if(!i) sumout+=flow[n1][n2];
-							update_capacity(0,transfrag[t],flow[n1][n2],nodecapacity,node2path);
-							if(path[i] && transfrag[t]->nodes.Last()!=gno-1) fragno+=flow[n1][n2];
-							flow[n1][n2]=0;
+					CFlowEdge& e=net.edge(n1,n2);
+					if(e.flow>0) {
+						if(e.flow<transfrag[t]->abundance) {
+							if(!i) sumout+=e.flow;
+							update_capacity(0,transfrag[t],e.flow,nodecapacity,node2path);
+							if(path[i] && transfrag[t]->nodes.Last()!=gno-1) fragno+=e.flow;
+							e.flow=0;
 						}
 						else {
 							if(!i) sumout+=transfrag[t]->abundance;
-							flow[n1][n2]-=transfrag[t]->abundance;
+							e.flow-=transfrag[t]->abundance;
 							if(path[i] && transfrag[t]->nodes.Last()!=gno-1) fragno+=transfrag[t]->abundance;
 							update_capacity(0,transfrag[t],transfrag[t]->abundance,nodecapacity,node2path);
 						}
@@ -3989,17 +4546,11 @@ float max_flow(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag>&
 		}
 	}
 
-	// clean up
-	delete [] capacity;
-	delete [] flow;
-	delete [] link;
-
 	return(flux);
 }
 
 float guide_max_flow(bool adjust,int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag>& transfrag,GPVec<CGraphnode>& no2gnode,
-		GVec<float>& nodecapacity,GBitVec& pathpat,GVec<float> *capacity,GVec<float> *flow,GVec<int> *link,GVec<int>& node2path,
-		float& fragno) {
+		GVec<float>& nodecapacity,CPattern& pathpat,CFlowNet& net,GVec<int>& node2path,float& fragno) {
 
 	float flux=0;
 	int n=path.Count();
@@ -4008,31 +4559,31 @@ float guide_max_flow(bool adjust,int gno,GVec<int>& path,GBitVec& istranscript,G
 	{ // DEBUG ONLY
 		fprintf(stderr,"Flow & Capacity:");
 		for(int n1=0;n1<n;n1++)
-			for(int n2=0;n2<link[n1].Count();n2++)
-				if(link[n1][n2]>n1) fprintf(stderr," flow[%d][%d]=%g capacity[%d][%d]=%g",n1,link[n1][n2],flow[n1][link[n1][n2]],n1,link[n1][n2],capacity[n1][link[n1][n2]]);
+			for(int n2=0;n2<net.links(n1).Count();n2++)
+				if(net.links(n1)[n2]>n1) fprintf(stderr," flow[%d][%d]=%g capacity[%d][%d]=%g",n1,net.links(n1)[n2],net.flow(n1,net.links(n1)[n2]),n1,net.links(n1)[n2],net.capacity(n1,net.links(n1)[n2]));
 		fprintf(stderr,"\n");
 	}
 	*/
 
 	for(int i=0;i<n;i++) {
 		nodecapacity.cAdd(0.0);
-		if(adjust) for(int j=0;j<link[i].Count();j++) flow[i][link[i][j]]=0;
+		if(adjust) for(int j=0;j<net.links(i).Count();j++) net.find(i,net.links(i)[j])->flow=0;
 	}
 
 
 	if(adjust) { // recompute the flow
-		GVec<int> pred; // this stores the augmenting path
-		pred.Resize(n,-1);
+		GVec<int>& pred=net.pred; // this stores the augmenting path
 
 		GVec<float> rate;
 		rate.Resize(n,1);
 
-		while(bfs(n,capacity,flow,link,pred)) {
+		while(net.bfs(n-1)) {
 			int r=0;
 			float increment=FLT_MAX;
 			rate[r++]=1;
 			for(int u=n-1;pred[u]>=0;u=pred[u]) {
-				float adjflux=(capacity[pred[u]][u]-flow[pred[u]][u])*rate[r-1];
+				CFlowEdge *e=net.find(pred[u],u);
+				float adjflux=(e->capacity-e->flow)*rate[r-1];
 				increment = increment < adjflux ? increment : adjflux; // minimum flux increment on the path
 				if(pred[pred[u]]>=0) {
 					if(pred[u]<u) {
@@ -4048,8 +4599,8 @@ float guide_max_flow(bool adjust,int gno,GVec<int>& path,GBitVec& istranscript,G
 			}
 			r=0;
 			for(int u=n-1;pred[u]>=0;u=pred[u]) {
-				flow[pred[u]][u]+=increment/rate[r];
-				flow[u][pred[u]]-=increment/rate[r];
+				net.find(pred[u],u)->flow+=increment/rate[r];
+				net.find(u,pred[u])->flow-=increment/rate[r];
 				r++;
 			}
 			flux+=increment;
@@ -4059,8 +4610,8 @@ float guide_max_flow(bool adjust,int gno,GVec<int>& path,GBitVec& istranscript,G
 		{ // DEBUG ONLY
 			fprintf(stderr,"Flow:");
 			for(int n1=0;n1<n;n1++)
-				for(int n2=0;n2<link[n1].Count();n2++)
-					if(link[n1][n2]>n1 && flow[n1][link[n1][n2]]>0) fprintf(stderr," flow[%d][%d]=%f",n1,link[n1][n2],flow[n1][link[n1][n2]]);
+				for(int n2=0;n2<net.links(n1).Count();n2++)
+					if(net.links(n1)[n2]>n1 && net.flow(n1,net.links(n1)[n2])>0) fprintf(stderr," flow[%d][%d]=%f",n1,net.links(n1)[n2],net.flow(n1,net.links(n1)[n2]));
 			fprintf(stderr,"\n");
 		}
 		*/
@@ -4070,8 +4621,11 @@ float guide_max_flow(bool adjust,int gno,GVec<int>& path,GBitVec& istranscript,G
 
 	// store flow in capacities so that I don't have to modify flow
 	for(int n1=0;n1<n;n1++)
-		for(int n2=0;n2<link[n1].Count();n2++)
-			if(link[n1][n2]>n1) capacity[n1][link[n1][n2]]=flow[n1][link[n1][n2]];
+		for(int n2=0;n2<net.links(n1).Count();n2++)
+			if(net.links(n1)[n2]>n1) {
+				CFlowEdge *e=net.find(n1,net.links(n1)[n2]);
+				e->capacity=e->flow;
+			}
 
 
 	// adjust transfrag abundances
@@ -4081,23 +4635,24 @@ float guide_max_flow(bool adjust,int gno,GVec<int>& path,GBitVec& istranscript,G
 		int pos=-1;
 		for(int j=0;j<nt;j++) {
 			int t=no2gnode[path[i]]->trf[j];
-			if(transfrag[t]->abundance && (istranscript[t] || ((pathpat & transfrag[t]->pattern)==transfrag[t]->pattern))) {
+			if(transfrag[t]->abundance && (istranscript[t] || pathpat.contains(transfrag[t]->pattern))) {
 				istranscript[t]=1;
 				if(transfrag[t]->nodes[0]==path[i]) { // transfrag starts at this node
 					int n1=i;
 					int n2=node2path[transfrag[t]->nodes.Last()];
 					if(!no2gnode[path[i]]->rate) n1=0;
 					if(!no2gnode[transfrag[t]->nodes.Last()]->rate) n2=n-1;
-					if(capacity[n1][n2]>0) {
-						if(capacity[n1][n2]<transfrag[t]->abundance) {
-							if(!i) sumout+=capacity[n1][n2];
-							update_capacity(0,transfrag[t],capacity[n1][n2],nodecapacity,node2path);
-							if(path[i] && transfrag[t]->nodes.Last()!=gno-1) fragno+=capacity[n1][n2];
-							capacity[n1][n2]=0;
+					CFlowEdge& e=net.edge(n1,n2);
+					if(e.capacity>0) {
+						if(e.capacity<transfrag[t]->abundance) {
+							if(!i) sumout+=e.capacity;
+							update_capacity(0,transfrag[t],e.capacity,nodecapacity,node2path);
+							if(path[i] && transfrag[t]->nodes.Last()!=gno-1) fragno+=e.capacity;
+							e.capacity=0;
 						}
 						else {
 							if(!i) sumout+=transfrag[t]->abundance;
-							capacity[n1][n2]-=transfrag[t]->abundance;
+							e.capacity-=transfrag[t]->abundance;
 							if(path[i] && transfrag[t]->nodes.Last()!=gno-1) fragno+=transfrag[t]->abundance;
 							update_capacity(0,transfrag[t],transfrag[t]->abundance,nodecapacity,node2path);
 						}
@@ -4121,12 +4676,12 @@ float guide_max_flow(bool adjust,int gno,GVec<int>& path,GBitVec& istranscript,G
 
 
 float guideflow(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag>& transfrag,GPVec<CGraphnode>& no2gnode,
-		GBitVec& pathpat,GVec<float> *capacity,GVec<float> *flow,GVec<int> *link,GVec<int>& node2path) {
+		CPattern& pathpat,CFlowNet& net,GVec<int>& node2path) {
 
 	float flux=0;
 	int n=path.Count();
-	GVec<int> pred; // this stores the augmenting path
-	pred.Resize(n,-1);
+	net.init(n);
+	GVec<int>& pred=net.pred; // this stores the augmenting path
 	node2path.Resize(gno,-1);
 
 	//fprintf(stderr,"path: ");
@@ -4134,8 +4689,6 @@ float guideflow(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag>&
 	for(int i=0;i<n;i++) {
 		//fprintf(stderr,"%d ",path[i]);
 		node2path[path[i]]=i;
-		capacity[i].Resize(n,0);
-		flow[i].Resize(n,0);
 	}
 
 	//fprintf(stderr,"n=%d ",n);
@@ -4145,7 +4698,7 @@ float guideflow(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag>&
 		int nt=no2gnode[path[i]]->trf.Count();
 		for(int j=0;j<nt;j++) {
 			int t=no2gnode[path[i]]->trf[j];
-			if(transfrag[t]->abundance && (istranscript[t] || ((pathpat & transfrag[t]->pattern)==transfrag[t]->pattern))) {
+			if(transfrag[t]->abundance && (istranscript[t] || pathpat.contains(transfrag[t]->pattern))) {
 				istranscript[t]=1;
 				if(transfrag[t]->nodes[0]==path[i]) { // transfrag starts at this node
 
@@ -4155,29 +4708,27 @@ float guideflow(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag>&
 					int n2=node2path[transfrag[t]->nodes.Last()];
 					if(!no2gnode[path[i]]->rate) n1=0;
 					if(!no2gnode[transfrag[t]->nodes.Last()]->rate) n2=n-1;
-					if(!capacity[n1][n2]) { // haven't seen this link before
-						link[n1].Add(n2);
-						link[n2].Add(n1);
-					}
-					capacity[n1][n2]+=transfrag[t]->abundance;
-					//fprintf(stderr,"capacity[%d][%d]=%f after adding transfrag[%d]->abundance=%f\n",n1,n2,capacity[n1][n2],t,transfrag[t]->abundance);
+					if(!net.capacity(n1,n2)) // haven't seen this link before
+						net.addlink(n1,n2);
+					net.edge(n1,n2).capacity+=transfrag[t]->abundance;
 				}
 			}
 		}
 	}
 
-	for(int i=0;i<n;i++) link[i].Sort();
+	for(int i=0;i<n;i++) net.links(i).Sort();
 
 
 	GVec<float> rate;
 	rate.Resize(n,1);
 
-	while(bfs(n,capacity,flow,link,pred)) {
+	while(net.bfs(n-1)) {
 		int r=0;
 		float increment=FLT_MAX;
 		rate[r++]=1;
 		for(int u=n-1;pred[u]>=0;u=pred[u]) {
-			float adjflux=(capacity[pred[u]][u]-flow[pred[u]][u])*rate[r-1];
+			CFlowEdge *e=net.find(pred[u],u);
+			float adjflux=(e->capacity-e->flow)*rate[r-1];
 			increment = increment < adjflux ? increment : adjflux;
 			if(pred[pred[u]]>=0) {
 				if(pred[u]<u) {
@@ -4193,8 +4744,8 @@ float guideflow(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag>&
 		}
 		r=0;
 		for(int u=n-1;pred[u]>=0;u=pred[u]) {
-			flow[pred[u]][u]+=increment/rate[r];
-			flow[u][pred[u]]-=increment/rate[r];
+			net.find(pred[u],u)->flow+=increment/rate[r];
+			net.find(u,pred[u])->flow-=increment/rate[r];
 			r++;
 		}
 		flux+=increment;
@@ -4204,7 +4755,7 @@ float guideflow(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag>&
 	{ // DEBUG ONLY
 		fprintf(stderr,"Flow:");
 		for(int n1=0;n1<n;n1++)
-			for(int n2=n1+1;n2<n;n2++) if(flow[n1][n2]) fprintf(stderr," [%d][%d]=%f",n1,n2,flow[n1][n2]);
+			for(int n2=n1+1;n2<n;n2++) if(net.flow(n1,n2)) fprintf(stderr," [%d][%d]=%f",n1,n2,net.flow(n1,n2));
 		fprintf(stderr,"\n");
 	}
 	*/
@@ -4214,18 +4765,15 @@ float guideflow(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag>&
 
 
 float max_flow_EM(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag>& transfrag,GPVec<CGraphnode>& no2gnode,
-		GVec<float>& nodecapacity,GBitVec& pathpat,float &fragno) {
+		GVec<float>& nodecapacity,CPattern& pathpat,CFlowNet& net,float &fragno) {
 
 
 
 	float flux=0;
 	int n=path.Count();
 	int m=n+2;
-	GVec<float> *capacity=new GVec<float>[m]; // capacity of edges in network
-	GVec<float> *flow=new GVec<float>[m]; // flow in network
-	GVec<int> *link=new GVec<int>[m]; // for each node remembers it's neighbours
-	GVec<int> pred; // this stores the augmenting path
-	pred.Resize(m,-1);
+	net.init(m); // flow network of the path
+	GVec<int>& pred=net.pred; // this stores the augmenting path
 	GVec<int> node2path;
 	node2path.Resize(gno,-1);
 
@@ -4246,11 +4794,9 @@ float max_flow_EM(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag
 	GVec<float> through; // these are the capacity of the "trough" transfrags through each node in the path
 	through.Resize(n,0);
 
-	for(int i=0;i<m;i++) {
-		if(i<n) node2path[path[i]]=i;
-		if(i<n) nodecapacity.cAdd(0.0);
-		capacity[i].Resize(m,0);
-		flow[i].Resize(m,0);
+	for(int i=0;i<n;i++) {
+		node2path[path[i]]=i;
+		nodecapacity.cAdd(0.0);
 	}
 
 	// establish capacities in the network
@@ -4258,16 +4804,14 @@ float max_flow_EM(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag
 		int nt=no2gnode[path[i]]->trf.Count();
 		for(int j=0;j<nt;j++) {
 			int t=no2gnode[path[i]]->trf[j];
-			if(transfrag[t]->abundance && (istranscript[t] || ((pathpat & transfrag[t]->pattern)==transfrag[t]->pattern))) {
+			if(transfrag[t]->abundance && (istranscript[t] || pathpat.contains(transfrag[t]->pattern))) {
 				istranscript[t]=1;
 				if(transfrag[t]->nodes[0]==path[i]) { // transfrag starts at this node
 					int n1=i;
 					int n2=node2path[transfrag[t]->nodes.Last()];
-					if(!capacity[n1][n2]) { // haven't seen this link before
-						link[n1].Add(n2);
-						link[n2].Add(n1);
-					}
-					capacity[n1][n2]+=transfrag[t]->abundance;
+					if(!net.capacity(n1,n2)) // haven't seen this link before
+						net.addlink(n1,n2);
+					net.edge(n1,n2).capacity+=transfrag[t]->abundance;
 				}
 				else if(transfrag[t]->nodes[0]<path[i] && transfrag[t]->nodes.Last()>path[i] && transfrag[t]->pattern[path[i]]) { // through transfrag
 					through[i]+=transfrag[t]->abundance;
@@ -4277,35 +4821,27 @@ float max_flow_EM(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag
 
 		if(i && i<n-1 && through[i]) { // not source or sink and I have transfrags going through the node
 			// 0 -> n : source links to fake node n
-			link[n].Add(i);
-			link[i].Add(n);
+			net.addlink(n,i);
 
 			// n+1 -> sink : fake node n+1 links to sink
 			int n1=n+1;
-			link[n1].Add(i);
-			link[i].Add(n1);
+			net.addlink(n1,i);
 
-			capacity[n][i]+=through[i];
-			capacity[i][n1]+=through[i];
+			net.edge(n,i).capacity+=through[i];
+			net.edge(i,n1).capacity+=through[i];
 
 			int sink=n-1;
-			if(!capacity[n1][sink]) {
-				link[n1].Add(sink);
-				link[sink].Add(n1);
-			}
-			capacity[n1][sink]+=through[i];
+			if(!net.capacity(n1,sink)) net.addlink(n1,sink);
+			net.edge(n1,sink).capacity+=through[i];
 
-			if(!capacity[0][n]) {
-				link[0].Add(n);
-				link[n].cAdd(0);
-			}
-			capacity[0][n]+=through[i];
-			capacity[0][0]+=through[i];
+			if(!net.capacity(0,n)) net.addlink(0,n);
+			net.edge(0,n).capacity+=through[i];
+			net.edge(0,0).capacity+=through[i];
 		}
 
 	}
 
-	for(int i=0;i<n;i++) link[i].Sort();
+	for(int i=0;i<n;i++) net.links(i).Sort();
 
 	bool doEM=true;
 	int iterations=0;
@@ -4316,12 +4852,13 @@ float max_flow_EM(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag
 
 	while(doEM && iterations<10) {
 		flux=0;
-		while(bfs(n,capacity,flow,link,pred)) {
+		while(net.bfs(n-1)) {
 			int r=0;
 			float increment=FLT_MAX;
 			rate[r++]=1;
 			for(int u=n-1;pred[u]>=0;u=pred[u]) {
-				float adjflux=(capacity[pred[u]][u]-flow[pred[u]][u])*rate[r-1];
+				CFlowEdge *e=net.find(pred[u],u);
+				float adjflux=(e->capacity-e->flow)*rate[r-1];
 				increment = increment < adjflux ? increment : adjflux;
 				if(pred[pred[u]]>=0) {
 					if(pred[u]>=n) rate[r]=rate[r-1];
@@ -4339,8 +4876,8 @@ float max_flow_EM(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag
 			}
 			r=0;
 			for(int u=n-1;pred[u]>=0;u=pred[u]) {
-				flow[pred[u]][u]+=increment/rate[r];
-				flow[u][pred[u]]-=increment/rate[r];
+				net.find(pred[u],u)->flow+=increment/rate[r];
+				net.find(u,pred[u])->flow-=increment/rate[r];
 				r++;
 			}
 			flux+=increment;
@@ -4351,7 +4888,7 @@ float max_flow_EM(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag
 			printTime(stderr);
 			fprintf(stderr,"Flow:");
 			for(int n1=0;n1<n;n1++)
-				for(int n2=n1+1;n2<n;n2++) if(flow[n1][n2]) fprintf(stderr," [%d][%d]=%f",n1,n2,flow[n1][n2]);
+				for(int n2=n1+1;n2<n;n2++) if(net.flow(n1,n2)) fprintf(stderr," [%d][%d]=%f",n1,n2,net.flow(n1,n2));
 			fprintf(stderr,"\n");
 		}
 		*/
@@ -4368,14 +4905,15 @@ float max_flow_EM(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag
 					if(transfrag[t]->nodes[0]==path[i]) { // transfrag starts at this node
 						int n1=i;
 						int n2=node2path[transfrag[t]->nodes.Last()];
-						if(flow[n1][n2]>0) {
-							if(flow[n1][n2]<transfrag[t]->abundance) {
+						CFlowEdge& e=net.edge(n1,n2);
+						if(e.flow>0) {
+							if(e.flow<transfrag[t]->abundance) {
 								GStr tid(t);
-								tabund.Add(tid.chars(),new float(flow[n1][n2]));
-								flow[n1][n2]=0;
+								tabund.Add(tid.chars(),new float(e.flow));
+								e.flow=0;
 							}
 							else {
-								flow[n1][n2]-=transfrag[t]->abundance;
+								e.flow-=transfrag[t]->abundance;
 								GStr tid(t);
 								tabund.Add(tid.chars(),new float(transfrag[t]->abundance));
 							}
@@ -4389,21 +4927,20 @@ float max_flow_EM(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag
 				}
 			}
 			// now check if I should continue the EM algorithm
-			if(flow[n][i]-through[i]>epsilon) {
+			if(net.flow(n,i)-through[i]>epsilon) {
 				doEM=true;
-				capacity[n][i]=through[i];
+				net.edge(n,i).capacity=through[i];
 			}
-			if(flow[i][n+1]-through[i]>epsilon) {
+			if(net.flow(i,n+1)-through[i]>epsilon) {
 				doEM=true;
-				capacity[i][n+1]=through[i];
+				net.edge(i,n+1).capacity=through[i];
 			}
 
 		}
 
 
-		if(doEM)  // reset flow to 0
-			for(int i=0;i<m;i++) flow[i].Resize(m,0);
-
+		// the next iteration starts from the flow found in this one (the flow
+		// matrix rows were resized to the same length here, which kept their values)
 		iterations++;
 
 	}
@@ -4424,11 +4961,6 @@ float max_flow_EM(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag
 		}
 	}
 
-	// clean up
-	delete [] capacity;
-	delete [] flow;
-	delete [] link;
-
 	return(flux);
 }
 
@@ -4436,7 +4968,7 @@ float max_flow_EM(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag
 
 
 float weight_max_flow(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag>& transfrag,GPVec<CGraphnode>& no2gnode,
-		GVec<float>& nodecapacity,GBitVec& pathpat,float& fragno) {
+		GVec<float>& nodecapacity,CPattern& pathpat,CFlowNet& net,float& fragno) {
 
 	int n=path.Count();
 
@@ -4452,21 +4984,14 @@ float weight_max_flow(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTrans
 	*/
 
 	float flux=0;
-	GVec<float> *capacity=new GVec<float>[n]; // capacity of edges in network
-	GVec<float> *flow=new GVec<float>[n]; // flow in network
-	GVec<float> *rate=new GVec<float>[n]; // edge rates
-	GVec<int> *link=new GVec<int>[n]; // for each node remembers it's neighbours
-	GVec<int> pred; // this stores the augmenting path
-	pred.Resize(n,-1);
+	net.init(n); // flow network of the path, with edge rates
+	GVec<int>& pred=net.pred; // this stores the augmenting path
 	GVec<int> node2path;
 	node2path.Resize(gno,-1);
 
 	for(int i=0;i<n;i++) {
 		node2path[path[i]]=i;
 		nodecapacity.cAdd(0.0);
-		capacity[i].Resize(n,0);
-		flow[i].Resize(n,0);
-		rate[i].Resize(n,1);
 	}
 
 	// establish capacities in the network
@@ -4474,19 +4999,17 @@ float weight_max_flow(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTrans
 		int nt=no2gnode[path[i]]->trf.Count();
 		for(int j=0;j<nt;j++) {
 			int t=no2gnode[path[i]]->trf[j];
-			if(transfrag[t]->abundance && (istranscript[t] || ((pathpat & transfrag[t]->pattern)==transfrag[t]->pattern))) {
+			if(transfrag[t]->abundance && (istranscript[t] || pathpat.contains(transfrag[t]->pattern))) {
 				istranscript[t]=1;
 				if(transfrag[t]->nodes[0]==path[i]) { // transfrag starts at this node
 					int n1=i;
 					int n2=node2path[transfrag[t]->nodes.Last()];
 					if(!no2gnode[path[i]]->rate) n1=0;
 					if(!no2gnode[transfrag[t]->nodes.Last()]->rate) n2=n-1;
-					if(!capacity[n1][n2]) { // haven't seen this link before
-						link[n1].Add(n2);
-						link[n2].Add(n1);
-					}
-					capacity[n1][n2]+=transfrag[t]->abundance;
-					capacity[n1][n1]+=transfrag[t]->abundance;
+					if(!net.capacity(n1,n2)) // haven't seen this link before
+						net.addlink(n1,n2);
+					net.edge(n1,n2).capacity+=transfrag[t]->abundance;
+					net.edge(n1,n1).capacity+=transfrag[t]->abundance;
 				}
 			}
 		}
@@ -4497,8 +5020,8 @@ float weight_max_flow(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTrans
 		printTime(stderr);
 		fprintf(stderr,"Abundances:");
 		for(int n1=0;n1<n;n1++) {
-			for(int n2=n1+1;n2<n;n2++) if(capacity[n1][n2]) {
-				fprintf(stderr," [%d][%d]=%f",n1,n2,capacity[n1][n2]);
+			for(int n2=n1+1;n2<n;n2++) if(net.capacity(n1,n2)) {
+				fprintf(stderr," [%d][%d]=%f",n1,n2,net.capacity(n1,n2));
 			}
 			fprintf(stderr," tr=");
 			for(int j=0;j<no2gnode[path[n1]]->trf.Count();j++) {
@@ -4513,14 +5036,15 @@ float weight_max_flow(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTrans
 	// Now compute the rates and capacities
 	for(int n1=1;n1<n;n1++) {
 		GVec<CNetEdge> sortedg;
-		for(int n2=0;n2<link[n1].Count();n2++) if(capacity[link[n1][n2]][n1]) { // incoming edge
-				CNetEdge e(link[n1][n2],rate[link[n1][n2]][n1]);
+		GVec<int>& link=net.links(n1);
+		for(int n2=0;n2<link.Count();n2++) if(net.capacity(link[n2],n1)) { // incoming edge
+				CNetEdge e(link[n2],net.rate(link[n2],n1));
 				sortedg.Add(e);
 		}
 		sortedg.Sort(edgeCmp); // largest rate comes first
-		get_rate(n1,n1,sortedg,capacity,rate,no2gnode[path[n1]]->rate);
-		for(int n2=0;n2<link[n1].Count();n2++) if(capacity[n1][link[n1][n2]]) // outgoing edge
-			get_rate(n1,link[n1][n2],sortedg,capacity,rate,no2gnode[path[n1]]->rate);
+		get_rate(n1,n1,sortedg,net,no2gnode[path[n1]]->rate);
+		for(int n2=0;n2<link.Count();n2++) if(net.capacity(n1,link[n2])) // outgoing edge
+			get_rate(n1,link[n2],sortedg,net,no2gnode[path[n1]]->rate);
 	}
 
 	/*
@@ -4529,29 +5053,30 @@ float weight_max_flow(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTrans
 		fprintf(stderr,"Capacities:");
 		for(int n1=0;n1<n;n1++) {
 			fprintf(stderr," rate[%d]=%f",path[n1],no2gnode[path[n1]]->rate);
-			for(int n2=n1;n2<n;n2++) if(capacity[n1][n2]) {
-				fprintf(stderr," [%d][%d]=%f(%f)",n1,n2,capacity[n1][n2],rate[n1][n2]);
+			for(int n2=n1;n2<n;n2++) if(net.capacity(n1,n2)) {
+				fprintf(stderr," [%d][%d]=%f(%f)",n1,n2,net.capacity(n1,n2),net.rate(n1,n2));
 			}
 		}
 		fprintf(stderr,"\n");
 	}
 	*/
 
-	while(weight_bfs(n,capacity,flow,link,pred)) {
+	while(net.weight_bfs(n-1)) {
 		float increment=FLT_MAX;
 		for(int u=n-1;pred[u]>=0;u=pred[u]) {
-			float adjflux=capacity[pred[u]][u]-flow[pred[u]][u];
+			CFlowEdge *e=net.find(pred[u],u);
+			float adjflux=e->capacity-e->flow;
 			increment = increment < adjflux ? increment : adjflux;
 			if(pred[u]<u) {
-				adjflux=capacity[pred[u]][pred[u]]-flow[pred[u]][pred[u]];
+				adjflux=net.capacity(pred[u],pred[u])-net.flow(pred[u],pred[u]);
 				increment = increment < adjflux ? increment : adjflux; // don't allow to go over the node capacity
 			}
 		}
 		for(int u=n-1;pred[u]>=0;u=pred[u]) {
-			flow[pred[u]][u]+=increment;
-			flow[u][pred[u]]-=increment;
-			if(pred[u]<u) flow[pred[u]][pred[u]]+=increment;
-			else flow[u][u]-=increment;
+			net.find(pred[u],u)->flow+=increment;
+			net.find(u,pred[u])->flow-=increment;
+			if(pred[u]<u) net.edge(pred[u],pred[u]).flow+=increment;
+			else net.edge(u,u).flow-=increment;
 		}
 		flux+=increment;
 	}
@@ -4561,7 +5086,7 @@ float weight_max_flow(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTrans
 		printTime(stderr);
 		fprintf(stderr,"Flow:");
 		for(int n1=0;n1<n;n1++)
-			for(int n2=n1+1;n2<n;n2++) if(flow[n1][n2]) fprintf(stderr," [%d][%d]=%f(%f)",n1,n2,flow[n1][n2],flow[n1][n2]/rate[n1][n2]);
+			for(int n2=n1+1;n2<n;n2++) if(net.flow(n1,n2)) fprintf(stderr," [%d][%d]=%f(%f)",n1,n2,net.flow(n1,n2),net.flow(n1,n2)/net.rate(n1,n2));
 		fprintf(stderr,"\n");
 	}
 	*/
@@ -4579,18 +5104,19 @@ float weight_max_flow(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTrans
 					int n2=node2path[transfrag[t]->nodes.Last()];
 					if(!no2gnode[path[i]]->rate) n1=0;
 					if(!no2gnode[transfrag[t]->nodes.Last()]->rate) n2=n-1;
-					if(flow[n1][n2]>0) {
-						float flown1n2=flow[n1][n2]/rate[n1][n2];
+					CFlowEdge& e=net.edge(n1,n2);
+					if(e.flow>0) {
+						float flown1n2=e.flow/e.rate;
 						if(flown1n2<transfrag[t]->abundance) {
 							if(!i) sumout+=flown1n2;
 							update_capacity(0,transfrag[t],flown1n2,nodecapacity,node2path);
 							if(path[i] && transfrag[t]->nodes.Last()!=gno-1)
 								fragno+=flown1n2;
-							flow[n1][n2]=0;
+							e.flow=0;
 						}
 						else {
 							if(!i) sumout+=transfrag[t]->abundance;
-							flow[n1][n2]-=transfrag[t]->abundance*rate[n1][n2];
+							e.flow-=transfrag[t]->abundance*e.rate;
 							if(path[i] && transfrag[t]->nodes.Last()!=gno-1)
 								fragno+=transfrag[t]->abundance;
 							update_capacity(0,transfrag[t],transfrag[t]->abundance,nodecapacity,node2path);
@@ -4608,12 +5134,6 @@ float weight_max_flow(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTrans
 		}
 	}
 
-	// clean up
-	delete [] capacity;
-	delete [] flow;
-	delete [] link;
-	delete [] rate;
-
 	return(flux);
 }
 
@@ -5046,10 +5566,10 @@ float update_flux(int gno,GVec<int>& path,GBitVec& istranscript,GPVec<CTransfrag
 */
 
 //float store_transcript(GList<CPrediction>& pred,GVec<int>& path,GVec<float>& nodeflux,GVec<float>& nodecov,
-//		GPVec<CGraphnode>& no2gnode,int& geneno,bool& first,int strand,int gno,bool& included,GBitVec& prevpath,float fragno,char* id=NULL) {
+//		GPVec<CGraphnode>& no2gnode,int& geneno,bool& first,int strand,int gno,bool& included,CPattern& prevpath,float fragno,char* id=NULL) {
 float store_transcript(GList<CPrediction>& pred,GVec<int>& path,GVec<float>& nodeflux,GVec<float>& nodecov,
 		GPVec<CGraphnode>& no2gnode,int& geneno,bool& first,int strand,int gno,bool& included,
-		GBitVec& prevpath,float fragno, //char* id=NULL) {
+		CPattern& prevpath,float fragno, //char* id=NULL) {
 		   GffObj* t=NULL) {
 	float cov=0;
 	int len=0;
@@ -5999,8 +6519,8 @@ void parse_trf_weight_max_flow(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransf
 
 
 void parse_trf(int maxi,int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& transfrag,
-		GVec<bool>& compatible,	int& geneno,bool first,int strand,GList<CPrediction>& pred,GVec<float>& nodecov,
-		GBitVec& istranscript,GBitVec& removable,GBitVec& usednode,float maxcov,GBitVec& prevpath,bool fast) {
+		CCompatTable& compatible,	int& geneno,bool first,int strand,GList<CPrediction>& pred,GVec<float>& nodecov,
+		GBitVec& istranscript,GBitVec& removable,CPattern& usednode,float maxcov,CPattern& prevpath,CFlowNet& net,bool fast) {
 
 	 GVec<int> path;
 	 GVec<float> pathincov;
@@ -6008,10 +6528,10 @@ void parse_trf(int maxi,int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& t
 	 path.Add(maxi);
 	 pathincov.cAdd(0.0);
 	 pathoutcov.cAdd(0.0);
-	 GBitVec pathpat(1+gno*(gno+1)/2);
+	 CPattern pathpat;
 	 pathpat[maxi]=1;
 	 istranscript.reset();
-	 GHash<CComponent> computed;
+	 CComponentCache computed;
 
 	 float flux=0;
 	 float fragno=0;
@@ -6044,11 +6564,11 @@ void parse_trf(int maxi,int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& t
 	 			 //flux=update_flux(gno,path,istranscript,transfrag,removable,no2gnode,nodeflux,pathpat);
 
 
-	 			 if(EM) flux=max_flow_EM(gno,path,istranscript,transfrag,no2gnode,nodeflux,pathpat,fragno);
+	 			 if(EM) flux=max_flow_EM(gno,path,istranscript,transfrag,no2gnode,nodeflux,pathpat,net,fragno);
 	 			 else if(weight)
 	 				 	 //flux=weight_max_flow_EM(gno,path,istranscript,transfrag,no2gnode,nodeflux,pathpat);
-	 				 	 flux=weight_max_flow(gno,path,istranscript,transfrag,no2gnode,nodeflux,pathpat,fragno);
-	 			 else flux=max_flow(gno,path,istranscript,transfrag,no2gnode,nodeflux,pathpat,fragno);
+	 				 	 flux=weight_max_flow(gno,path,istranscript,transfrag,no2gnode,nodeflux,pathpat,net,fragno);
+	 			 else flux=max_flow(gno,path,istranscript,transfrag,no2gnode,nodeflux,pathpat,net,fragno);
 
 	 			 /*
 	 			 { // DEBUG ONLY
@@ -6133,7 +6653,7 @@ void parse_trf(int maxi,int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& t
 		 path.Clear();
 		 nodeflux.Clear();
 		 computed.Clear();
-		 parse_trf(maxi,gno,no2gnode,transfrag,compatible,geneno,first,strand,pred,nodecov,istranscript,removable,usednode,maxcov,prevpath,fast);
+		 parse_trf(maxi,gno,no2gnode,transfrag,compatible,geneno,first,strand,pred,nodecov,istranscript,removable,usednode,maxcov,prevpath,net,fast);
 	 }
 
 }
@@ -6156,7 +6676,7 @@ CTransfrag *find_guide_pat(GffObj *guide,GPVec<CGraphnode>& no2gnode,int gno) {
 	}
 
 	if(i<gno-1) { // found start node
-		GBitVec guidepat(1+gno*(gno+1)/2);
+		CPattern guidepat;
 		GVec<int> nodes;
 		guidepat[i]=1;
 		nodes.Add(i);
@@ -6429,7 +6949,7 @@ void process_refguides(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& tr
 	for(int t=0;t<transfrag.Count();t++) {
 		//if(transfrag[t]->nodes.Count()> 1)
 		for(int g=0;g<guidetrf.Count();g++) {
-			if(((transfrag[t]->pattern) & guidetrf[g].trf->pattern) == transfrag[t]->pattern) {
+			if(guidetrf[g].trf->pattern.contains(transfrag[t]->pattern)) {
 				guidetrf[g].trf->abundance+=transfrag[t]->abundance;
 			}
 		}
@@ -6457,7 +6977,7 @@ void process_refguides(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& tr
 		while(p<g) {
 			//CTransfrag guideg=guidetrf[g];
 			//CTransfrag guidep=guidetrf[p];
-			if((guidetrf[g].trf->pattern & guidetrf[p].trf->pattern)==guidetrf[g].trf->pattern) {
+			if(guidetrf[p].trf->pattern.contains(guidetrf[g].trf->pattern)) {
 				guidetrf[g].trf->real=false;  // this marks a guide that is included in another one
 				if(!complete) { // if guides are incomplete exclude the ones that are included into the more complete ones
 					GFREE(guidetrf[g].trf);
@@ -6547,7 +7067,7 @@ void process_refguides(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& tr
 				GVec<int> nodes;
 				nodes.cAdd(0);
 				nodes.Add(maxnode);
-				GBitVec trpat(1+(gno+1)*gno/2);
+				CPattern trpat;
 				trpat[0]=1;
 				trpat[maxnode]=1;
 				trpat[edge(0,maxnode,gno)]=1;
@@ -6630,7 +7150,7 @@ void process_refguides(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& tr
 				GVec<int> nodes;
 				nodes.Add(maxnode);
 				nodes.Add(sink);
-				GBitVec trpat(1+(gno+1)*gno/2);
+				CPattern trpat;
 				trpat[maxnode]=1;
 				trpat[sink]=1;
 				trpat[edge(maxnode,sink,gno)]=1;
@@ -6651,10 +7171,11 @@ void process_refguides(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& tr
 }
 
 int guides_flow(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& transfrag,GVec<CGuide>& guidetrf,int& geneno,
-		int s,GList<CPrediction>& pred,GVec<float>& nodecov,GBitVec& istranscript,GBitVec& pathpat) {
+		int s,GList<CPrediction>& pred,GVec<float>& nodecov,GBitVec& istranscript,CPattern& pathpat) {
 
 	int maxi=1;
 	bool cov=false; // tells me if max node coverage was determined
+	CFlowNet net; // flow network, reused for each guide
 
 	GVec<int> lastg; // keeps guides that are included in other ones for last
 	bool included=true;
@@ -6681,9 +7202,9 @@ int guides_flow(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& transfrag
 
 		//fprintf(stderr,"guide=%d ",g);
 
-		if(EM) flux= max_flow_EM(gno,guidetrf[g].trf->nodes,istranscript,transfrag,no2gnode,nodeflux,guidetrf[g].trf->pattern,fragno);
-		else if(weight) flux= weight_max_flow(gno,guidetrf[g].trf->nodes,istranscript,transfrag,no2gnode,nodeflux,guidetrf[g].trf->pattern,fragno);
-		else flux= max_flow(gno,guidetrf[g].trf->nodes,istranscript,transfrag,no2gnode,nodeflux,guidetrf[g].trf->pattern,fragno);
+		if(EM) flux= max_flow_EM(gno,guidetrf[g].trf->nodes,istranscript,transfrag,no2gnode,nodeflux,guidetrf[g].trf->pattern,net,fragno);
+		else if(weight) flux= weight_max_flow(gno,guidetrf[g].trf->nodes,istranscript,transfrag,no2gnode,nodeflux,guidetrf[g].trf->pattern,net,fragno);
+		else flux= max_flow(gno,guidetrf[g].trf->nodes,istranscript,transfrag,no2gnode,nodeflux,guidetrf[g].trf->pattern,net,fragno);
 
 		istranscript.reset();
 
@@ -6741,10 +7262,10 @@ int guides_flow(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& transfrag
 	return(maxi);
 }
 
-bool is_reference_transcript(GVec<CGuide>& guidetrf,GBitVec& pattern) {
+bool is_reference_transcript(GVec<CGuide>& guidetrf,CPattern& pattern) {
 	int g=0;
 	while(g<guidetrf.Count()){
-		if((guidetrf[g].trf->pattern & pattern)==pattern) return true;
+		if(guidetrf[g].trf->pattern.contains(pattern)) return true;
 		g++;
 	}
 	return false;
@@ -6763,7 +7284,7 @@ bool sharedlink(int gno,int g1,int g2,GVec<CGuide>& guidetrf,int i, int j) { //
 }
 
 int guides_maxflow(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& transfrag,GVec<CGuide>& guidetrf,int& geneno,
-		int s,GList<CPrediction>& pred,GVec<float>& nodecov,GBitVec& istranscript,GBitVec& pathpat,bool &first) {
+		int s,GList<CPrediction>& pred,GVec<float>& nodecov,GBitVec& istranscript,CPattern& pathpat,CFlowNet& pathnet,bool &first) {
 
 
 	int maxi=1;
@@ -6773,7 +7294,7 @@ int guides_maxflow(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& transf
 	if(ng==1) { // if only one guide I do not need to do the 2 pass
 		GVec<float> nodeflux;
 		float fragno=0;
-		float flux= max_flow(gno,guidetrf[0].trf->nodes,istranscript,transfrag,no2gnode,nodeflux,guidetrf[0].trf->pattern,fragno);
+		float flux= max_flow(gno,guidetrf[0].trf->nodes,istranscript,transfrag,no2gnode,nodeflux,guidetrf[0].trf->pattern,pathnet,fragno);
 		istranscript.reset();
 
 		/*
@@ -6815,21 +7336,14 @@ int guides_maxflow(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& transf
 	bool cov=false; // tells me if max node coverage was determined
 
 	GVec<float> flux;
-	GVec<float> **capacity=new GVec<float>*[ng];
-	GVec<float> **flow=new GVec<float>*[ng];
-	GVec<int> **link=new GVec<int>*[ng];
+	CFlowNet *net=new CFlowNet[ng]; // flow network of each guide
 	GVec<int> *node2path=new GVec<int>[ng];
 
 	// calculate maximum flow for each guide
 	for(int g=0;g<ng;g++) {
-		int n=guidetrf[g].trf->nodes.Count();
-		capacity[g]=new GVec<float>[n];
-		flow[g]=new GVec<float>[n];
-		link[g]=new GVec<int>[n];
-
 		//fprintf(stderr,"guide=%s ",guidetrf[g].t->getID());
 
-		float initflux=guideflow(gno,guidetrf[g].trf->nodes,istranscript,transfrag,no2gnode,guidetrf[g].trf->pattern,capacity[g],flow[g],link[g],node2path[g]);
+		float initflux=guideflow(gno,guidetrf[g].trf->nodes,istranscript,transfrag,no2gnode,guidetrf[g].trf->pattern,net[g],node2path[g]);
 		flux.Add(initflux);
 		istranscript.reset();
 
@@ -6848,35 +7362,37 @@ int guides_maxflow(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& transf
 			bool adjust=false;
 			for(int i=0;i<guidetrf[g].trf->nodes.Count();i++) { // for all nodes in guide g, recompute the capacities allowed
 				int n1=guidetrf[g].trf->nodes[i];
-				//fprintf(stderr,"n1=%d count=%d\n",n1,link[g][i].Count());
-				for(int j=0;j<link[g][i].Count();j++) {
-					int n2=guidetrf[g].trf->nodes[link[g][i][j]];
-					//fprintf(stderr,"  path %d-%d capacity=%g\n",n1,n2,capacity[g][i][link[g][i][j]]);
-					if(capacity[g][i][link[g][i][j]]) { // decrease capacity if there is any left already
+				GVec<int>& link=net[g].links(i);
+				//fprintf(stderr,"n1=%d count=%d\n",n1,link.Count());
+				for(int j=0;j<link.Count();j++) {
+					int n2=guidetrf[g].trf->nodes[link[j]];
+					CFlowEdge *e=net[g].find(i,link[j]);
+					//fprintf(stderr,"  path %d-%d capacity=%g\n",n1,n2,e->capacity);
+					if(e->capacity) { // decrease capacity if there is any left already
 						float usedflow=0;
 						float varflow=0;
 						for(int r=0;r<ng;r++) {
-							if(r==g || sharedlink(gno,g,r,guidetrf,i,link[g][i][j])){ // the two guides share the path between n1 and n2
+							if(r==g || sharedlink(gno,g,r,guidetrf,i,link[j])){ // the two guides share the path between n1 and n2
 
-								//fprintf(stderr,"Guides %d and %d share the path between %d and %d with flows %g and %g\n",g,r,n1,n2,flow[g][i][link[g][i][j]],flow[r][node2path[r][n1]][node2path[r][n2]]);
+								//fprintf(stderr,"Guides %d and %d share the path between %d and %d with flows %g and %g\n",g,r,n1,n2,e->flow,net[r].flow(node2path[r][n1],node2path[r][n2]));
 
 								if(r>g) { // this is fixed flow
-									usedflow+=flow[r][node2path[r][n1]][node2path[r][n2]];
+									usedflow+=net[r].flow(node2path[r][n1],node2path[r][n2]);
 								}
 								else { // this is variable flow
-									varflow+=flow[r][node2path[r][n1]][node2path[r][n2]];
+									varflow+=net[r].flow(node2path[r][n1],node2path[r][n2]);
 								}
 							}
 						}
-						if(varflow+usedflow>capacity[g][i][link[g][i][j]]) { // I need to adjust the flow
-							if(varflow) capacity[g][i][link[g][i][j]]=flow[g][i][link[g][i][j]]*(capacity[g][i][link[g][i][j]]-usedflow)/varflow;
-							else capacity[g][i][link[g][i][j]]=0; // this should never be the case
+						if(varflow+usedflow>e->capacity) { // I need to adjust the flow
+							if(varflow) e->capacity=e->flow*(e->capacity-usedflow)/varflow;
+							else e->capacity=0; // this should never be the case
 							adjust=true;
 						}
 						else {
-							capacity[g][i][link[g][i][j]]=flow[g][i][link[g][i][j]]+capacity[g][i][link[g][i][j]]-usedflow-varflow; // this is how much I allow the flow to increase
+							e->capacity=e->flow+e->capacity-usedflow-varflow; // this is how much I allow the flow to increase
 						}
-						//fprintf(stderr,"new capacity[%d][%d]=%g\n",i,link[g][i][j],capacity[g][i][link[g][i][j]]);
+						//fprintf(stderr,"new capacity[%d][%d]=%g\n",i,link[j],e->capacity);
 					}
 				}
 			}
@@ -6885,7 +7401,7 @@ int guides_maxflow(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& transf
 			// is true, otherwise there is no need to, but I still need to update the abundances
 			GVec<float> nodeflux;
 			float fragno=0;
-			float newflux=guide_max_flow(adjust,gno,guidetrf[g].trf->nodes,istranscript,transfrag,no2gnode,nodeflux,guidetrf[g].trf->pattern,capacity[g],flow[g],link[g],node2path[g],fragno);
+			float newflux=guide_max_flow(adjust,gno,guidetrf[g].trf->nodes,istranscript,transfrag,no2gnode,nodeflux,guidetrf[g].trf->pattern,net[g],node2path[g],fragno);
 			if(!newflux) newflux=flux[g];
 			istranscript.reset();
 
@@ -6920,14 +7436,7 @@ int guides_maxflow(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& transf
 
 	// clean up memory
 
-	for(int g=0;g<ng;g++) {
-		delete [] capacity[g];
-		delete [] flow[g];
-		delete [] link[g];
-	}
-	delete [] capacity;
-	delete [] flow;
-	delete [] link;
+	delete [] net;
 	delete [] node2path;
 
 	if(!cov) for(int i=2;i<gno-1;i++)
@@ -6936,7 +7445,7 @@ int guides_maxflow(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& transf
 	return(maxi);
 }
 
-int find_transcripts(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& transfrag,GVec<bool>& compatible,
+int find_transcripts(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& transfrag,CCompatTable& compatible,
 		int geneno,int strand,GVec<CGuide>& guidetrf,GList<CPrediction>& pred,bool fast) {
 
 	// process in and out coverages for each node
@@ -6994,7 +7503,8 @@ int find_transcripts(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& tran
 	} // end for i
 
 	GBitVec istranscript(transfrag.Count());
-	GBitVec pathpat(1+gno*(gno+1)/2);
+	CPattern pathpat;
+	CFlowNet net; // flow network, set up again for each path of the graph
 
 	// process guides first
 	//fprintf(stderr,"guidetrf.count=%d\n",guidetrf.Count());
@@ -7004,7 +7514,7 @@ int find_transcripts(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& tran
 
 	//fprintf(stderr,"guide count=%d\n",guidetrf.Count());
 
-	if(guidetrf.Count()) maxi=guides_maxflow(gno,no2gnode,transfrag,guidetrf,geneno,strand,pred,nodecov,istranscript,pathpat,first);
+	if(guidetrf.Count()) maxi=guides_maxflow(gno,no2gnode,transfrag,guidetrf,geneno,strand,pred,nodecov,istranscript,pathpat,net,first);
 
 
 	if(nodecov[maxi]>=readthr) {
@@ -7016,8 +7526,8 @@ int find_transcripts(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& tran
 			// 1:
 			// parse_trf_weight_max_flow(gno,no2gnode,transfrag,geneno,strand,pred,nodecov,pathpat);
 			// 2:
-			GBitVec usednode(1+gno*(gno+1)/2);
-			parse_trf(maxi,gno,no2gnode,transfrag,compatible,geneno,first,strand,pred,nodecov,istranscript,removable,usednode,0,pathpat,fast);
+			CPattern usednode;
+			parse_trf(maxi,gno,no2gnode,transfrag,compatible,geneno,first,strand,pred,nodecov,istranscript,removable,usednode,0,pathpat,net,fast);
 
 		}
 	}
@@ -7025,7 +7535,7 @@ int find_transcripts(int gno,GPVec<CGraphnode>& no2gnode,GPVec<CTransfrag>& tran
 	return(geneno);
 }
 
-void get_trims(GVec<CTrimPoint>& trims,CBundlenode *currbnode,int refstart,GVec<float>& bpcov) {
+void get_trims(GVec<CTrimPoint>& trims,CBundlenode *currbnode,int refstart,CCovTrack& bpcov) {
 
 	uint sourcestart;
 	uint sinkend;
@@ -7076,7 +7586,8 @@ void exon_covered(int ex,GffObj *guide,int &b,GPVec<CBundle>& bundle,GPVec<CBund
 	}
 }
 
-void get_partial_covered(GffObj *guide,GPVec<CBundle>& bundle,GPVec<CBundlenode>& bnode,GList<CJunction>& junction) {
+void get_partial_covered(GffObj *guide,GPVec<CBundle>& bundle,GPVec<CBundlenode>& bnode,GList<CJunction>& junction,
+		GPVec<CTCov>& covguides) {
 
 	int ntr=0;
 
@@ -7104,13 +7615,7 @@ void get_partial_covered(GffObj *guide,GPVec<CBundle>& bundle,GPVec<CBundlenode>
 				while(nj<njunctions && junction[nj]->start<guide->exons[lex]->end) nj++;
 				if(nj==njunctions || junction[nj]->start>guide->exons[lex]->end) { // junction starting at lex is not covered
 					if(trlen>mintranscriptlen || (lex==fex && maxlen>mintranscriptlen)) {
-						bool partial=true;
-						if(lex-fex+1==guide->exons.Count()) partial=false;
-						for(int i=fex;i<=lex;i++)
-							if(partial) fprintf(c_out,"%s\tpartial\texon\t%u\t%u\t.\t%c\t.\ttranscript_id \"%s_part%d\";\n",guide->getGSeqName(),
-									guide->exons[i]->start,guide->exons[i]->end,guide->strand,guide->getID(),ntr);
-							else fprintf(c_out,"%s\tcomplete\texon\t%u\t%u\t.\t%c\t.\ttranscript_id \"%s\";\n",guide->getGSeqName(),
-									guide->exons[i]->start,guide->exons[i]->end,guide->strand,guide->getID());
+						covguides.Add(new CTCov(guide,fex,lex,ntr));
 						ntr++;
 					}
 					fex=lex+1;
@@ -7136,11 +7641,7 @@ void get_partial_covered(GffObj *guide,GPVec<CBundle>& bundle,GPVec<CBundlenode>
 							bool partial=true;
 							if(lex-fex+1==guide->exons.Count()) partial=false;
 							if(trlen>mintranscriptlen) {
-								for(int i=fex;i<=lex;i++)
-									if(partial) fprintf(c_out,"%s\tpartial\texon\t%u\t%u\t.\t%c\t.\ttranscript_id \"%s_part%d\";\n",guide->getGSeqName(),
-											guide->exons[i]->start,guide->exons[i]->end,guide->strand,guide->getID(),ntr);
-									else fprintf(c_out,"%s\tcomplete\texon\t%u\t%u\t.\t%c\t.\ttranscript_id \"%s\";\n",guide->getGSeqName(),
-											guide->exons[i]->start,guide->exons[i]->end,guide->strand,guide->getID());
+								covguides.Add(new CTCov(guide,fex,lex,ntr));
 								ntr++;
 							}
 							if(!rightlen || !partial) fex=lex+1;
@@ -7150,13 +7651,7 @@ void get_partial_covered(GffObj *guide,GPVec<CBundle>& bundle,GPVec<CBundlenode>
 					}
 					else { // couldn't find junction to the right
 						if(trlen>mintranscriptlen || (lex==fex && maxlen>mintranscriptlen)) {
-							bool partial=true;
-							if(lex-fex+1==guide->exons.Count()) partial=false;
-							for(int i=fex;i<=lex;i++)
-								if(partial) fprintf(c_out,"%s\tpartial\texon\t%u\t%u\t.\t%c\t.\ttranscript_id \"%s_part%d\";\n",guide->getGSeqName(),
-										guide->exons[i]->start,guide->exons[i]->end,guide->strand,guide->getID(),ntr);
-								else fprintf(c_out,"%s\tcomplete\texon\t%u\t%u\t.\t%c\t.\ttranscript_id \"%s\";\n",guide->getGSeqName(),
-										guide->exons[i]->start,guide->exons[i]->end,guide->strand,guide->getID());
+							covguides.Add(new CTCov(guide,fex,lex,ntr));
 							ntr++;
 						}
 						fex=lex+1;
@@ -7167,12 +7662,7 @@ void get_partial_covered(GffObj *guide,GPVec<CBundle>& bundle,GPVec<CBundlenode>
 		}
 		else { // current single exon is not covered up to the left -> maxlen is the exon length
 			if(maxlen>mintranscriptlen) {
-				bool partial=true;
-				if(guide->exons.Count()==1) partial=false;
-				if(partial) fprintf(c_out,"%s\tpartial\texon\t%u\t%u\t.\t%c\t.\ttranscript_id \"%s_part%d\";\n",guide->getGSeqName(),
-						guide->exons[fex]->start,guide->exons[fex]->end,guide->strand,guide->getID(),ntr);
-				else fprintf(c_out,"%s\tcomplete\texon\t%u\t%u\t.\t%c\t.\ttranscript_id \"%s\";\n",guide->getGSeqName(),
-						guide->exons[fex]->start,guide->exons[fex]->end,guide->strand,guide->getID());
+				covguides.Add(new CTCov(guide,fex,-1,ntr));
 				ntr++;
 			}
 			fex++;
@@ -7182,7 +7672,7 @@ void get_partial_covered(GffObj *guide,GPVec<CBundle>& bundle,GPVec<CBundlenode>
 }
 
 bool get_covered(GffObj *guide,GPVec<CBundle>& bundle,GPVec<CBundlenode>& bnode,GList<CJunction>& junction,
-		GVec<int>* bnodeguides,int g) {
+		GVec<int>* bnodeguides,int g,GPVec<CTCov>& covguides) {
 
 	bool covered=true;
 
@@ -7277,7 +7767,7 @@ bool get_covered(GffObj *guide,GPVec<CBundle>& bundle,GPVec<CBundlenode>& bnode,
 
 		//fprintf(stderr,"covered=%d guidelen=%d\n",covered,maxguidelen);
 
-		if(covered && maxguidelen>=(uint)mintranscriptlen) { if(c_out) guide->printTranscriptGff(c_out);}
+		if(covered && maxguidelen>=(uint)mintranscriptlen) { if(c_out) covguides.Add(new CTCov(guide));}
 		else covered=false;
 	}
 
@@ -7285,6 +7775,7 @@ bool get_covered(GffObj *guide,GPVec<CBundle>& bundle,GPVec<CBundlenode>& bnode,
 }
 
 void clean_read_junctions(CReadAln *read) {
+	for(int c=0;c<read->read_count;c++) // once for each copy of a collapsed read
 	for(int i=0;i<read->juncs.Count();i++) {
 		CJunction& jd=*(read->juncs[i]);
 		if(jd.strand) { // junction wasn't deleted -> it might need to be deleted now
@@ -7327,6 +7818,57 @@ bool guide_exon_overlap(GPVec<GffObj>& guides,int sno,uint start,uint end) {
 	return false;
 }
 
+void CGraphTask::run() {
+	// a stolen task allocates from the bundle's arena too
+	CBundleArena* prevarena=CBundleArena::current();
+	CBundleArena::setCurrent(arena);
+
+	// include source to guide starts links
+	GVec<CGuide> guidetrf;
+	if(guides->Count()) process_refguides(gno,*no2gnode,*transfrag,s,*guides,guidetrf);
+
+	//process transfrags to eliminate noise, and set compatibilities, and node memberships
+	CCompatTable compatible;
+	process_transfrags(gno,*no2gnode,*transfrag,tr2no,compatible);
+
+	// find transcripts now
+	ngenes=find_transcripts(gno,*no2gnode,*transfrag,compatible,0,s,guidetrf,pred,fast);
+
+	// clean up what can be cleaned (the guide transfrags are in the bundle arena)
+	delete tr2no;
+	tr2no=NULL;
+	CBundleArena::setCurrent(prevarena);
+}
+
+#ifndef NOTHREADS
+CGraphTask* CGraphTasks::claim() {
+	GLockGuard<GMutex> lock(mutex);
+	if (next==tasks.Count()) return NULL;
+	pending++;
+	return tasks[next++];
+}
+
+void CGraphTasks::finished() {
+	GLockGuard<GMutex> lock(mutex);
+	pending--;
+	if (pending==0 && next==tasks.Count()) allDone.notify_all();
+}
+
+void CGraphTasks::run() {
+	//stolen tasks allocate from the bundle's arena too, which the caller
+	//shares while the tasks run (see CBundleArena::setShared())
+	shareGraphTasks(this);
+	CGraphTask* task=NULL;
+	while ((task=claim())!=NULL) {
+		task->run();
+		finished();
+	}
+	unshareGraphTasks(this);
+	GLockGuard<GMutex> lock(mutex);
+	while (pending>0) allDone.wait(mutex);
+}
+#endif
+
 //int build_graphs(int refstart, GList<CReadAln>& readlist,
 //		GList<CJunction>& junction, GPVec<GffObj>& guides, GVec<float>& bpcov, GList<CPrediction>& pred,bool fast) {
 int build_graphs(BundleData* bdata, bool fast) {
@@ -7334,10 +7876,10 @@ int build_graphs(BundleData* bdata, bool fast) {
 	GList<CReadAln>& readlist = bdata->readlist;
 	GList<CJunction>& junction = bdata->junction;
 	GPVec<GffObj>& guides = bdata->keepguides;
-	GVec<float>& bpcov = bdata->bpcov;
+	CCovTrack& bpcov = bdata->bpcov;
 	GList<CPrediction>& pred = bdata->pred;
 	// form groups on strands: all groups below are like this: 0 = negative strand; 1 = unknown strand; 2 = positive strand
-	GPVec<CGroup> group;
+	GPVec<CGroup> group(false); // the groups, bundles and bundle nodes are freed with the bundle arena
 	CGroup *currgroup[3]={NULL,NULL,NULL}; // current group of each type
 	CGroup *startgroup[3]={NULL,NULL,NULL}; // start group of each type
 	int color=0; // next color to assign
@@ -7530,6 +8072,7 @@ int build_graphs(BundleData* bdata, bool fast) {
 	GVec<int> group2bundle[3]; // to retrace reads from group no to bundle
 	for(int sno=0;sno<3;sno++) {
 		group2bundle[sno].Resize(group.Count(),-1);
+		bundle[sno].setFreeItem(false);
 		bnode[sno].setFreeItem(false);
 	}
 
@@ -7644,7 +8187,7 @@ int build_graphs(BundleData* bdata, bool fast) {
 		for(int g=0;g<guides.Count();g++) {
 			int s=0;
 			if(guides[g]->strand=='+') s=2;
-			get_partial_covered(guides[g],bundle[s],bnode[s],junction);
+			get_partial_covered(guides[g],bundle[s],bnode[s],junction,bdata->covguides);
 		}
 		return(0);
 	}
@@ -7654,9 +8197,9 @@ int build_graphs(BundleData* bdata, bool fast) {
 			//fprintf(stderr,"consider guide %d\n",g);
 			int s=0;
 			if(guides[g]->strand=='+') s=2;
-			if((c_out && !get_covered(guides[g],bundle[s],bnode[s],junction,NULL,0)) ||
+			if((c_out && !get_covered(guides[g],bundle[s],bnode[s],junction,NULL,0,bdata->covguides)) ||
 					(bundle[1].Count() && bnode[1].Count() && guides[g]->exons.Count()==1))
-				get_covered(guides[g],bundle[1],bnode[1],junction,bnodeguides,g);
+				get_covered(guides[g],bundle[1],bnode[1],junction,bnodeguides,g,bdata->covguides);
 		}
 
 	/*
@@ -7753,7 +8296,7 @@ int build_graphs(BundleData* bdata, bool fast) {
     	// int ngraph[2]={0,0};   // how many graphs are in each strand: negative (0), or positive(1) -> keep one for each bundle
     	GPVec<CTransfrag> *transfrag[2]; // for each transfrag t on a strand s, in a graph g, transfrag[s][g][t] gives it's abundance and it's pattern
     	GPVec<CGraphnode> *no2gnode[2]; // for each graph g, on a strand s, no2gnode[s][g][i] gives the node i
-    	CTreePat **tr2no[2]; // for each graph g, on a strand s, tr2no[s][g] keeps the tree pattern structure for quick retrieval of the index t of a tansfrag
+    	CTrfIndex **tr2no[2]; // for each graph g, on a strand s, tr2no[s][g] keeps the pattern index for quick retrieval of the transfrag of a read
 
     	int bno[2]={0,0};
 
@@ -7770,7 +8313,7 @@ int build_graphs(BundleData* bdata, bool fast) {
     		if(bundle[sno].Count()) {
     			transfrag[s]=new GPVec<CTransfrag>[bundle[sno].Count()]; // for each bundle I have a graph ? only if I don't ignore the short bundles
     			no2gnode[s]=new GPVec<CGraphnode>[bundle[sno].Count()];
-    			GCALLOC(tr2no[s],bundle[sno].Count()*sizeof(CTreePat *));
+    			GCALLOC(tr2no[s],bundle[sno].Count()*sizeof(CTrfIndex *));
     			bno[s]=bundle[sno].Count();
 
     			for(int b=0;b<bundle[sno].Count();b++) {
@@ -7806,7 +8349,7 @@ int build_graphs(BundleData* bdata, bool fast) {
     					graphno[s][b]=create_graph(refstart,s,b,bundle[sno][b],bnode[sno],junction,ejunction,
     							bundle2graph,no2gnode,transfrag,bpcov); // also I need to remember graph coverages somewhere -> probably in the create_graph procedure
 
-    					if(graphno[s][b]) tr2no[s][b]=construct_treepat(graphno[s][b],transfrag[s][b]);
+    					if(graphno[s][b]) tr2no[s][b]=construct_trfindex(graphno[s][b],transfrag[s][b]);
     					else tr2no[s][b]=NULL;
     				}
     				else tr2no[s][b]=NULL;
@@ -7817,8 +8360,6 @@ int build_graphs(BundleData* bdata, bool fast) {
 
 		// I can clean up some data here:
     	for(int sno=0;sno<3;sno++) {
-    		int n=bnode[sno].Count();
-    		for(int b=0;b<n;b++) delete bnode[sno][b];
     		bnode[sno].Clear();
     		bundle[sno].Clear();
     	}
@@ -7839,9 +8380,8 @@ int build_graphs(BundleData* bdata, bool fast) {
     			fprintf(stderr, "There are %d stranded[%d]\n",bno[s],int(2*s));
     			for(int b=0;b<bno[s];b++) {
     				if(graphno[s][b]) {
-    					GStr pat;
     					fprintf(stderr,"Graph[%d][%d] with %d nodes:\n",int(2*s),b,graphno[s][b]);
-    					//print_pattern(tr2no[s][b],pat,graphno[s][b]);
+    					//tr2no[s][b]->print();
     				}
     			}
     		}
@@ -7851,64 +8391,43 @@ int build_graphs(BundleData* bdata, bool fast) {
     	// don't forget to clean up the allocated data here
     	delete [] readgroup;
 
-    	// parse graph
+    	// parse graph: each graph is a separate task
+    	GPVec<CGraphTask> tasks;
     	for(int s=0;s<2;s++) {
-
     		for(int b=0;b<bno[s];b++) {
-    			if(graphno[s][b]) {
-
-    				// include source to guide starts links
-    				GVec<CGuide> guidetrf;
-    				if(guides.Count()) process_refguides(graphno[s][b],no2gnode[s][b],transfrag[s][b],s,guides,guidetrf);
-
-    				//process transfrags to eliminate noise, and set compatibilities, and node memberships
-    				GVec<bool> compatible; // I might want to change this to gbitvec
-    				process_transfrags(graphno[s][b],no2gnode[s][b],transfrag[s][b],tr2no[s][b],compatible);
-
-    				/*
-    				{ //DEBUG ONLY
-    					printTime(stderr);
-    					fprintf(stderr,"There are %d nodes for graph[%d][%d]:\n",graphno[s][b],s,b);
-    					for(int i=0;i<graphno[s][b];i++) {
-    						fprintf(stderr,"%d (%d-%d): %f len=%d cov=%f",i,no2gnode[s][b][i]->start,no2gnode[s][b][i]->end,no2gnode[s][b][i]->cov,no2gnode[s][b][i]->len(),no2gnode[s][b][i]->cov/no2gnode[s][b][i]->len());
-    						fprintf(stderr," parents:");
-    						for(int j=0;j<no2gnode[s][b][i]->parent.Count();j++) fprintf(stderr," %d",no2gnode[s][b][i]->parent[j]);
-    						fprintf(stderr," trf=");
-    						for(int j=0;j<no2gnode[s][b][i]->trf.Count();j++) fprintf(stderr," %d",no2gnode[s][b][i]->trf[j]);
-    						fprintf(stderr,"\n");
-    					}
-    					fprintf(stderr,"There are %d transfrags[%d][%d]:\n",transfrag[s][b].Count(),s,b);
-    					for(int t=0;t<transfrag[s][b].Count();t++) {
-    						fprintf(stderr,"%d: ",t);
-    						printBitVec(transfrag[s][b][t]->pattern);
-    						fprintf(stderr," %f\n",transfrag[s][b][t]->abundance);
-    					}
-    				}
-    				*/
-
-    				// find transcripts now
-    				geneno=find_transcripts(graphno[s][b],no2gnode[s][b],transfrag[s][b],compatible,
-    						geneno,s,guidetrf,pred,fast);
-
-    				for(int g=0;g<guidetrf.Count();g++) {
-    					//GFREE(guidetrf[g].trf);
-    					delete guidetrf[g].trf;
-    				}
-
-    				/*
-    				{ //DEBUG ONLY
-    					printTime(stderr);
-    					fprintf(stderr,"Processed transcripts for s=%d b=%d\n",s,b);
-    				}
-					*/
-
-
-    			}
-    			// clean up what can be cleaned
-    			if(tr2no[s][b]) free_treepat(tr2no[s][b]);
+    			if(graphno[s][b]) tasks.Add(new CGraphTask(graphno[s][b],s,&no2gnode[s][b],&transfrag[s][b],
+    					tr2no[s][b],&guides,&bdata->arena,fast));
+    			else delete tr2no[s][b];
+    		}
+    	}
+#ifndef NOTHREADS
+    	if(tasks.Count()>1) { // idle worker threads can help with these
+    		CGraphTasks graphtasks(tasks);
+    		bdata->arena.setShared(true);
+    		graphtasks.run();
+    		bdata->arena.setShared(false);
+    	}
+    	else
+#endif
+    	for(int t=0;t<tasks.Count();t++) tasks[t]->run();
+
+    	// predictions are added in graph order, with genes numbered after the previous graphs'
+    	for(int t=0;t<tasks.Count();t++) {
+    		GList<CPrediction>& tpred=tasks[t]->pred;
+    		for(int p=0;p<tpred.Count();p++) {
+    			tpred[p]->geneno+=geneno;
+    			pred.Add(tpred[p]);
     		}
+    		geneno+=tasks[t]->ngenes;
+    	}
 
-    		// final clean up: no2gnode, no2tr, transfrag, bundle2graph
+    	for(int s=0;s<2;s++) {
+    		// final clean up: no2gnode, no2tr, transfrag, bundle2graph; the nodes and
+    		// transfrags themselves are freed with the bundle arena
+    		for(int b=0;b<bno[s];b++) {
+    			no2gnode[s][b].setFreeItem(false);
+    			transfrag[s][b].setFreeItem(false);
+    		}
     		if(bundle2graph[s]) delete [] bundle2graph[s];
     		if(transfrag[s]) delete [] transfrag[s];
     		if(no2gnode[s]) delete [] no2gnode[s];
@@ -7920,11 +8439,7 @@ int build_graphs(BundleData* bdata, bool fast) {
 
     	delete [] readgroup;
     	// clean up readgroup, bundle
-    	for(int sno=0;sno<3;sno++) {
-    		int n=bnode[sno].Count();
-    		for(int b=0;b<n;b++) delete bnode[sno][b];
-    		bnode[sno].Clear();
-    	}
+    	for(int sno=0;sno<3;sno++) bnode[sno].Clear();
     }
 
     // don't forget to clean up the allocated data here
@@ -7947,7 +8462,7 @@ void clean_junctions(GList<CJunction>& junction) {
 }
 */
 
-void clean_junctions(GList<CJunction>& junction, int refstart, GVec<float>& bpcov,GPVec<GffObj>& guides) {
+void clean_junctions(GList<CJunction>& junction, int refstart, CCovTrack& bpcov,GPVec<GffObj>& guides) {
 
 	GArray <CJunction> guideintrons(true,true);
 	if(guides.Count()) { // guides are not NULL
@@ -8017,6 +8532,9 @@ int infer_transcripts(BundleData* bundle, bool fast) {
 
 	//DEBUG ONLY: 	showReads(refname, readlist);
 
+	//predictions are inserted in order, whether or not the bundle's slot was
+	//used before (printResults() leaves the list sorted when it is cleared)
+	bundle->pred.setSorted(predCmp);
 	if(bundle->keepguides.Count() || !eonly) {
 
 		clean_junctions(bundle->junction, bundle->start, bundle->bpcov,bundle->keepguides);
@@ -8387,7 +8905,7 @@ int print_transcript_cluster(GList<CPrediction>& pred,GVec<int>& genes,GVec<int>
 */
 
 int print_signcluster(char strand,GList<CPrediction>& pred,GVec<int>& genes,GVec<int>& transcripts,
-		int nstart, int nend, int geneno,GStr& refname) {
+		int nstart, int nend, int geneno,GStr& refname, FILE* fout) {
 
   GVec<int> keep;
 
@@ -8439,21 +8957,7 @@ int print_signcluster(char strand,GList<CPrediction>& pred,GVec<int>& genes,GVec
 			  if (pred[n]->t_eq && pred[n]->t_eq->uptr) {
 				  t_id = ((RC_ScaffData*)pred[n]->t_eq->uptr)->t_id;
 			  }
-			  fprintf(f_out,"%d %d %d %.6f %.6f\n",pred[n]->exons.Count()+1,pred[n]->tlen, t_id, pred[n]->frag,pred[n]->cov);
-			  fprintf(f_out,"%s\tStringTie\ttranscript\t%d\t%d\t1000\t%c\t.\tgene_id \"%s.%d\"; transcript_id \"%s.%d.%d\"; ",
-					  refname.chars(),pred[n]->start,pred[n]->end,pred[n]->strand,label.chars(),genes[pred[n]->geneno],
-					  label.chars(),genes[pred[n]->geneno],transcripts[pred[n]->geneno]);
-			  if(pred[n]->t_eq) fprintf(f_out,"reference_id \"%s\"; ",pred[n]->t_eq->getID());
-			  //if(pred[n]->id) fprintf(f_out,"reference_id \"%s\"; ",pred[n]->id);
-			  fprintf(f_out,"cov \"%.6f\";\n",pred[n]->cov);
-			  for(int j=0;j<pred[n]->exons.Count();j++) {
-				  fprintf(f_out,"%s\tStringTie\texon\t%d\t%d\t1000\t%c\t.\tgene_id \"%s.%d\"; transcript_id \"%s.%d.%d\"; exon_number \"%d\"; ",
-						  refname.chars(),pred[n]->exons[j].start,pred[n]->exons[j].end,pred[n]->strand,label.chars(),genes[pred[n]->geneno],
-						  label.chars(),genes[pred[n]->geneno],transcripts[pred[n]->geneno],j+1); // maybe add exon coverage here
-				  if(pred[n]->t_eq) fprintf(f_out,"reference_id \"%s\"; ",pred[n]->t_eq->getID());
-				  //if(pred[n]->id) fprintf(f_out,"reference_id \"%s\"; ",pred[n]->id);
-				  fprintf(f_out,"cov \"%.6f\";\n",pred[n]->exoncov[j]);
-			  }
+			  write_transcript(fout,pred[n],genes[pred[n]->geneno],transcripts[pred[n]->geneno],t_id,refname);
 		  }
 		  else pred[n]->flag=true;
 	  }
@@ -8571,7 +9075,7 @@ void update_cov(GPVec<CPrediction>& pred,int big,int small,float frac=1) {
 
 }
 
-int print_cluster(GPVec<CPrediction>& pred,GVec<int>& genes,GVec<int>& transcripts, int geneno,GStr& refname) {
+int print_cluster(GPVec<CPrediction>& pred,GVec<int>& genes,GVec<int>& transcripts, int geneno,GStr& refname, FILE* fout) {
 
 	//fprintf(stderr,"start print cluster...\n");
 	// sort predictions from the most abundant to the least:
@@ -8704,21 +9208,7 @@ int print_cluster(GPVec<CPrediction>& pred,GVec<int>& genes,GVec<int>& transcrip
 			  if (pred[n]->t_eq && pred[n]->t_eq->uptr) {
 				  t_id = ((RC_ScaffData*)pred[n]->t_eq->uptr)->t_id;
 			  }
-			  fprintf(f_out,"%d %d %d %.6f %.6f\n",pred[n]->exons.Count()+1,pred[n]->tlen, t_id, pred[n]->frag,pred[n]->cov);
-			  fprintf(f_out,"%s\tStringTie\ttranscript\t%d\t%d\t1000\t%c\t.\tgene_id \"%s.%d\"; transcript_id \"%s.%d.%d\"; ",
-					  refname.chars(),pred[n]->start,pred[n]->end,pred[n]->strand,label.chars(),genes[pred[n]->geneno],
-					  label.chars(),genes[pred[n]->geneno],transcripts[pred[n]->geneno]);
-			  if(pred[n]->t_eq) fprintf(f_out,"reference_id \"%s\"; ",pred[n]->t_eq->getID());
-			  //if(pred[n]->id) fprintf(f_out,"reference_id \"%s\"; ",pred[n]->id);
-			  fprintf(f_out,"cov \"%.6f\";\n",pred[n]->cov);
-			  for(int j=0;j<pred[n]->exons.Count();j++) {
-				  fprintf(f_out,"%s\tStringTie\texon\t%d\t%d\t1000\t%c\t.\tgene_id \"%s.%d\"; transcript_id \"%s.%d.%d\"; exon_number \"%d\"; ",
-						  refname.chars(),pred[n]->exons[j].start,pred[n]->exons[j].end,pred[n]->strand,label.chars(),genes[pred[n]->geneno],
-						  label.chars(),genes[pred[n]->geneno],transcripts[pred[n]->geneno],j+1); // maybe add exon coverage here
-				  if(pred[n]->t_eq) fprintf(f_out,"reference_id \"%s\"; ",pred[n]->t_eq->getID());
-				  //if(pred[n]->id) fprintf(f_out,"reference_id \"%s\"; ",pred[n]->id);
-				  fprintf(f_out,"cov \"%.6f\";\n",pred[n]->exoncov[j]);
-			  }
+			  write_transcript(fout,pred[n],genes[pred[n]->geneno],transcripts[pred[n]->geneno],t_id,refname);
 		  }
 		  else pred[n]->flag=true;
 	  }
@@ -8731,7 +9221,8 @@ int print_cluster(GPVec<CPrediction>& pred,GVec<int>& genes,GVec<int>& transcrip
 }
 
 
-int print_cluster_inclusion(GPVec<CPrediction>& pred,GVec<int>& genes,GVec<int>& transcripts, int geneno,GStr& refname, int limit=3) {
+int print_cluster_inclusion(GPVec<CPrediction>& pred,GVec<int>& genes,GVec<int>& transcripts, int geneno,GStr& refname,
+		FILE* fout, int limit=3) {
 
 	//fprintf(stderr,"start print cluster...\n");
 	// sort predictions from the one with the most exons to the one with the least:
@@ -8822,21 +9313,7 @@ int print_cluster_inclusion(GPVec<CPrediction>& pred,GVec<int>& genes,GVec<int>&
 			  if (pred[n]->t_eq && pred[n]->t_eq->uptr) {
 				  t_id = ((RC_ScaffData*)pred[n]->t_eq->uptr)->t_id;
 			  }
-			  fprintf(f_out,"%d %d %d %.6f %.6f\n",pred[n]->exons.Count()+1,pred[n]->tlen, t_id, pred[n]->frag,pred[n]->cov);
-			  fprintf(f_out,"%s\tStringTie\ttranscript\t%d\t%d\t1000\t%c\t.\tgene_id \"%s.%d\"; transcript_id \"%s.%d.%d\"; ",
-					  refname.chars(),pred[n]->start,pred[n]->end,pred[n]->strand,label.chars(),genes[pred[n]->geneno],
-					  label.chars(),genes[pred[n]->geneno],transcripts[pred[n]->geneno]);
-			  if(pred[n]->t_eq) fprintf(f_out,"reference_id \"%s\"; ",pred[n]->t_eq->getID());
-			  //if(pred[n]->id) fprintf(f_out,"reference_id \"%s\"; ",pred[n]->id);
-			  fprintf(f_out,"cov \"%.6f\";\n",pred[n]->cov);
-			  for(int j=0;j<pred[n]->exons.Count();j++) {
-				  fprintf(f_out,"%s\tStringTie\texon\t%d\t%d\t1000\t%c\t.\tgene_id \"%s.%d\"; transcript_id \"%s.%d.%d\"; exon_number \"%d\"; ",
-						  refname.chars(),pred[n]->exons[j].start,pred[n]->exons[j].end,pred[n]->strand,label.chars(),genes[pred[n]->geneno],
-						  label.chars(),genes[pred[n]->geneno],transcripts[pred[n]->geneno],j+1); // maybe add exon coverage here
-				  if(pred[n]->t_eq) fprintf(f_out,"reference_id \"%s\"; ",pred[n]->t_eq->getID());
-				  //if(pred[n]->id) fprintf(f_out,"reference_id \"%s\"; ",pred[n]->id);
-				  fprintf(f_out,"cov \"%.6f\";\n",pred[n]->exoncov[j]);
-			  }
+			  write_transcript(fout,pred[n],genes[pred[n]->geneno],transcripts[pred[n]->geneno],t_id,refname);
 		  }
 		  else pred[n]->flag=true;
 	  }
@@ -8850,7 +9327,7 @@ int print_cluster_inclusion(GPVec<CPrediction>& pred,GVec<int>& genes,GVec<int>&
 
 
 int print_transcript_signcluster(char strand,GList<CPrediction>& pred,GVec<int>& genes,GVec<int>& transcripts,
-		int nstart, int nend, int geneno,GStr& refname) {
+		int nstart, int nend, int geneno,GStr& refname, FILE* fout) {
 
   GVec<int> keep;
 
@@ -8907,21 +9384,7 @@ int print_transcript_signcluster(char strand,GList<CPrediction>& pred,GVec<int>&
 			  if (pred[n]->t_eq && pred[n]->t_eq->uptr) {
 				  t_id = ((RC_ScaffData*)pred[n]->t_eq->uptr)->t_id;
 			  }
-			  fprintf(f_out,"%d %d %d %.6f %.6f\n",pred[n]->exons.Count()+1,pred[n]->tlen, t_id, pred[n]->frag,pred[n]->cov);
-			  fprintf(f_out,"%s\tStringTie\ttranscript\t%d\t%d\t1000\t%c\t.\tgene_id \"%s.%d\"; transcript_id \"%s.%d.%d\"; ",
-				  refname.chars(),pred[n]->start,pred[n]->end,pred[n]->strand,label.chars(),genes[pred[n]->geneno],
-				  label.chars(),genes[pred[n]->geneno],transcripts[pred[n]->geneno]);
-			  if(pred[n]->t_eq) fprintf(f_out,"reference_id \"%s\"; ",pred[n]->t_eq->getID());
-			  //if(pred[n]->id) fprintf(f_out,"reference_id \"%s\"; ",pred[n]->id);
-			  fprintf(f_out,"cov \"%.6f\";\n",pred[n]->cov);
-			  for(int j=0;j<pred[n]->exons.Count();j++) {
-				  fprintf(f_out,"%s\tStringTie\texon\t%d\t%d\t1000\t%c\t.\tgene_id \"%s.%d\"; transcript_id \"%s.%d.%d\"; exon_number \"%d\"; ",
-			  		 refname.chars(),pred[n]->exons[j].start,pred[n]->exons[j].end,pred[n]->strand,label.chars(),genes[pred[n]->geneno],
-			  		 label.chars(),genes[pred[n]->geneno],transcripts[pred[n]->geneno],j+1); // maybe add exon coverage here
-				  if(pred[n]->t_eq) fprintf(f_out, "reference_id \"%s\"; ", pred[n]->t_eq->getID());
-				  //if(pred[n]->id) fprintf(f_out,"reference_id \"%s\"; ",pred[n]->id);
-				  fprintf(f_out,"cov \"%.6f\";\n",pred[n]->exoncov[j]);
-			  }
+			  write_transcript(fout,pred[n],genes[pred[n]->geneno],transcripts[pred[n]->geneno],t_id,refname);
 		  }
 		  else pred[n]->flag=true;
 	  }
@@ -8965,7 +9428,89 @@ void add_pred(GList<CPrediction>& pred,int x,int y, float cov) { // add single e
 
 }
 
-int printResults(BundleData* bundleData, int ngenes, int geneno, GStr& refname) {
+void write_transcript(FILE* fout, CPrediction* pred, int geneno, int tno, uint t_id, GStr& refname) {
+	CTrRecord rec;
+	memset(&rec, 0, sizeof(CTrRecord));
+	const char* refid = pred->t_eq ? pred->t_eq->getID() : "";
+	rec.start=pred->start;
+	rec.end=pred->end;
+	rec.geneno=geneno;
+	rec.tno=tno;
+	rec.tlen=pred->tlen;
+	rec.t_id=t_id;
+	rec.numexons=pred->exons.Count();
+	rec.frag=pred->frag;
+	rec.cov=pred->cov;
+	rec.refnamelen=refname.length();
+	rec.refidlen=strlen(refid);
+	rec.strand=pred->strand;
+	int len=sizeof(CTrRecord)+rec.numexons*sizeof(CTrExon)+rec.refnamelen+rec.refidlen;
+	rec.reclen=(len+3) & ~3;
+	fwrite(&rec, sizeof(CTrRecord), 1, fout);
+	for(int j=0;j<rec.numexons;j++) {
+		CTrExon ex;
+		ex.start=pred->exons[j].start;
+		ex.end=pred->exons[j].end;
+		ex.cov=pred->exoncov[j];
+		fwrite(&ex, sizeof(CTrExon), 1, fout);
+	}
+	fwrite(refname.chars(), 1, rec.refnamelen, fout);
+	fwrite(refid, 1, rec.refidlen, fout);
+	static const char pad[4]={0,0,0,0};
+	if (rec.reclen>(uint32_t)len) fwrite(pad, 1, rec.reclen-len, fout);
+}
+
+void shift_transcripts(char* buf, size_t len, int shift) {
+	char* end=buf+len;
+	while (buf<end) {
+		CTrRecord* rec=(CTrRecord*)buf;
+		rec->geneno+=shift;
+		buf+=rec->reclen;
+	}
+}
+
+float transcript_cov(CTrRecord* rec) {
+	//the FPKM was always computed from the printed coverage value
+	char cov[64];
+	int n=fmtFixed(cov, 63, rec->cov, 6);
+	cov[GMIN(n, 63)]='\0';
+	return strtof(cov, NULL);
+}
+
+//the gene_id and transcript_id attributes, with a trailing space
+static void add_transcript_ids(GOutBuf& out, CTrRecord* rec) {
+	out.add("gene_id \"").add(label.chars(), label.length()).add('.').addInt(rec->geneno);
+	out.add("\"; transcript_id \"").add(label.chars(), label.length()).add('.').addInt(rec->geneno);
+	out.add('.').addInt(rec->tno).add("\"; ");
+}
+
+void print_transcript_gtf(GOutBuf& out, CTrRecord* rec, float fpkm) {
+	int rnlen=rec->refnamelen;
+	char* refname=rec->refname();
+	int ridlen=rec->refidlen;
+	char* refid=rec->refid();
+	out.add(refname, rnlen).add("\tStringTie\ttranscript\t").addInt(rec->start).add('\t').addInt(rec->end);
+	out.add("\t1000\t").add(rec->strand).add("\t.\t");
+	add_transcript_ids(out, rec);
+	if(ridlen) out.add("reference_id \"").add(refid, ridlen).add("\"; ");
+	out.add("cov \"").addFloat(rec->cov).add("\";FPKM \"").addFloat(fpkm).add("\";\n");
+	CTrExon* exons=rec->exons();
+	for(int j=0;j<rec->numexons;j++) {
+		out.add(refname, rnlen).add("\tStringTie\texon\t").addInt(exons[j].start).add('\t').addInt(exons[j].end);
+		out.add("\t1000\t").add(rec->strand).add("\t.\t");
+		add_transcript_ids(out, rec);
+		out.add("exon_number \"").addInt(j+1).add("\"; ");
+		if(ridlen) out.add("reference_id \"").add(refid, ridlen).add("\"; ");
+		out.add("cov \"").addFloat(exons[j].cov).add("\";\n");
+	}
+}
+
+void printCovered(BundleData* bundleData, FILE* f) {
+	for (int i=0;i<bundleData->covguides.Count();i++)
+		bundleData->covguides[i]->print(f);
+}
+
+int printResults(BundleData* bundleData, int ngenes, int geneno, GStr& refname, FILE* fout) {
 
 	// print transcripts including the necessary isoform fraction cleanings
 	GList<CPrediction>& pred = bundleData->pred;
@@ -9104,10 +9649,10 @@ int printResults(BundleData* bundleData, int ngenes, int geneno, GStr& refname)
 				// first print predictions I've seen so far
 				if(currentstartpos>-1) { // I've seen a cluster before
 					switch (sensitivitylevel) {
-					case 0: geneno=print_transcript_signcluster('+',pred,genes,transcripts,nstartpos,nendpos,geneno,refname);break;
-					case 1: geneno=print_cluster(pospred,genes,transcripts,geneno,refname);break;
-					case 2: geneno=print_cluster_inclusion(pospred,genes,transcripts,geneno,refname);break;
-					case 3: geneno=print_signcluster('+',pred,genes,transcripts,nstartpos,nendpos,geneno,refname);break;
+					case 0: geneno=print_transcript_signcluster('+',pred,genes,transcripts,nstartpos,nendpos,geneno,refname,fout);break;
+					case 1: geneno=print_cluster(pospred,genes,transcripts,geneno,refname,fout);break;
+					case 2: geneno=print_cluster_inclusion(pospred,genes,transcripts,geneno,refname,fout);break;
+					case 3: geneno=print_signcluster('+',pred,genes,transcripts,nstartpos,nendpos,geneno,refname,fout);break;
 					}
 					pospred.Clear();
 				}
@@ -9134,10 +9679,10 @@ int printResults(BundleData* bundleData, int ngenes, int geneno, GStr& refname)
 				if(currentstartneg>-1) { // I've seen a cluster before
 
 					switch (sensitivitylevel) {
-					case 0: geneno=print_transcript_signcluster('-',pred,genes,transcripts,nstartneg,nendneg,geneno,refname);break;
-					case 1: geneno=print_cluster(negpred,genes,transcripts,geneno,refname);break;
-					case 2: geneno=print_cluster_inclusion(negpred,genes,transcripts,geneno,refname);break;
-					case 3: geneno=print_signcluster('-',pred,genes,transcripts,nstartneg,nendneg,geneno,refname);break;
+					case 0: geneno=print_transcript_signcluster('-',pred,genes,transcripts,nstartneg,nendneg,geneno,refname,fout);break;
+					case 1: geneno=print_cluster(negpred,genes,transcripts,geneno,refname,fout);break;
+					case 2: geneno=print_cluster_inclusion(negpred,genes,transcripts,geneno,refname,fout);break;
+					case 3: geneno=print_signcluster('-',pred,genes,transcripts,nstartneg,nendneg,geneno,refname,fout);break;
 					}
 					negpred.Clear();
 
@@ -9161,10 +9706,10 @@ int printResults(BundleData* bundleData, int ngenes, int geneno, GStr& refname)
 	if(currentstartpos>-1) { // I've seen a cluster before
 
 		switch (sensitivitylevel) {
-		case 0: geneno=print_transcript_signcluster('+',pred,genes,transcripts,nstartpos,nendpos,geneno,refname);break;
-		case 1: geneno=print_cluster(pospred,genes,transcripts,geneno,refname);break;
-		case 2: geneno=print_cluster_inclusion(pospred,genes,transcripts,geneno,refname);break;
-		case 3: geneno=print_signcluster('+',pred,genes,transcripts,nstartpos,nendpos,geneno,refname);break;
+		case 0: geneno=print_transcript_signcluster('+',pred,genes,transcripts,nstartpos,nendpos,geneno,refname,fout);break;
+		case 1: geneno=print_cluster(pospred,genes,transcripts,geneno,refname,fout);break;
+		case 2: geneno=print_cluster_inclusion(pospred,genes,transcripts,geneno,refname,fout);break;
+		case 3: geneno=print_signcluster('+',pred,genes,transcripts,nstartpos,nendpos,geneno,refname,fout);break;
 		}
 		pospred.Clear();
 
@@ -9173,19 +9718,15 @@ int printResults(BundleData* bundleData, int ngenes, int geneno, GStr& refname)
 	if(currentstartneg>-1) { // I've seen a cluster before
 
 		switch (sensitivitylevel) {
-		case 0: geneno=print_transcript_signcluster('-',pred,genes,transcripts,nstartneg,nendneg,geneno,refname);break;
-		case 1: geneno=print_cluster(negpred,genes,transcripts,geneno,refname);break;
-		case 2: geneno=print_cluster_inclusion(negpred,genes,transcripts,geneno,refname);break;
-		case 3: geneno=print_signcluster('-',pred,genes,transcripts,nstartneg,nendneg,geneno,refname);break;
+		case 0: geneno=print_transcript_signcluster('-',pred,genes,transcripts,nstartneg,nendneg,geneno,refname,fout);break;
+		case 1: geneno=print_cluster(negpred,genes,transcripts,geneno,refname,fout);break;
+		case 2: geneno=print_cluster_inclusion(negpred,genes,transcripts,geneno,refname,fout);break;
+		case 3: geneno=print_signcluster('-',pred,genes,transcripts,nstartneg,nendneg,geneno,refname,fout);break;
 		}
 		negpred.Clear();
 
 	}
 
-	if (c_out) {
-		for (int i=0;i<bundleData->covguides.Count();i++)
-			bundleData->covguides[i]->print(c_out);
-	}
 	//rc_write_counts(refname.chars(), *bundleData);
 	return(geneno);
 }
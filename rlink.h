@@ -5,8 +5,12 @@
 #include "gff.h"
 #include "GBam.h"
 #include "GBitVec.h"
+#include "GOutBuf.h"
 #include "time.h"
 #include "tablemaker.h"
+#ifndef NOTHREADS
+#include "GThreads.h"
+#endif
 
 #define MAX_NODE 100000
 
@@ -19,6 +23,7 @@ const double epsilon=0.00000001; //-E
 const float trthr=1.0;   // transfrag pattern threshold
 const float MIN_VAL=-100000.0;
 const int MAX_MAXCOMP=200; // is 200 too much, or should I set it up to 150?
+const int MAX_COMPCACHE=100000; // maximum number of max components kept for reuse
 
 const int longintron=20000; // don't trust introns longer than this unless there is higher evidence; 93.5% of all annotated introns are shorter than this
 const int longintronanchor=25; // I need a higher anchor for long introns
@@ -64,12 +69,67 @@ struct GRefData {
 };
 
 
+#define ARENA_CLASSES 48 //size classes of the item arrays: 2^4 .. 2^51 bytes
+
+// bump allocator for the objects built while a bundle is processed (reads,
+// junctions, graph data); each BundleData owns one. While an arena is
+// selected for the current thread with setCurrent(), the objects of the
+// classes declared with BUNDLE_ARENA_OBJ are taken from it, and deleting
+// them only runs their destructor. The GVec, GPVec and CPattern members of
+// these objects are created with the arena as their GVecAlloc, so their
+// item arrays come from it too: an array is rounded up to a power of 2, and
+// a freed array is kept in a free list for its size, for the next array of
+// that size. The arena memory is reclaimed all at once by reset(), which
+// keeps the allocated blocks for the next bundle, so a bundle's objects need
+// not be deleted. While the graph tasks of the bundle can be run by other
+// threads, setShared() makes the arena take a lock for each allocation.
+class CBundleArena:public GVecAlloc {
+	GVec<char*> blocks;
+	GVec<size_t> sizes;
+	int curblock; //block being filled, or -1
+	size_t pos;   //first free byte in the current block
+	void* freelist[ARENA_CLASSES]; //freed item arrays, by size class
+#ifndef NOTHREADS
+	bool shared;
+	GFastMutex mutex;
+#endif
+	void* alloc(size_t size);
+	void lock() {
+#ifndef NOTHREADS
+		if (shared) mutex.lock();
+#endif
+	}
+	void unlock() {
+#ifndef NOTHREADS
+		if (shared) mutex.unlock();
+#endif
+	}
+ public:
+	CBundleArena();
+	~CBundleArena();
+	void reset(); //drops all the objects and arrays allocated here
+#ifndef NOTHREADS
+	void setShared(bool s) { shared=s; }
+#endif
+	void* allocItems(size_t size);
+	void freeItems(void* p, size_t size);
+	static void setCurrent(CBundleArena* arena); //NULL: use the heap
+	static CBundleArena* current();
+	static void* allocate(size_t size);
+	static void release(void* p);
+};
+
+#define BUNDLE_ARENA_OBJ \
+	static void* operator new(size_t size) { return CBundleArena::allocate(size); } \
+	static void operator delete(void* p) { CBundleArena::release(p); }
+
 struct CBundlenode:public GSeg {
 	float cov;
 	int bid; // bundle node id in bnode -> to easy retrieve it
 	CBundlenode *nextnode; // next node in the same bundle
 	CBundlenode(int rstart=0, int rend=0, float _cov=0, int _bid=-1, CBundlenode *_nextnode=NULL):GSeg(rstart, rend),
 			cov(_cov),bid(_bid),nextnode(_nextnode) {}
+	BUNDLE_ARENA_OBJ
 };
 
 
@@ -90,15 +150,131 @@ struct CBundle {
 	int lastnodeid; // id of last node added to bundle
 	CBundle(int _len=0, float _cov=0, float _nread=0,float _multi=0, int _start=-1, int _last=-1):
 		len(_len),cov(_cov),nread(_nread),multi(_multi), startnode(_start),lastnodeid(_last) {}
+	BUNDLE_ARENA_OBJ
+};
+
+// Node and edge pattern of a transfrag, path, or of the parents/children of
+// a graph node: the set bits of the former 1+gno*(gno+1)/2 bit vector, with
+// nodes 0..gno-1 followed by the edges numbered by edge(), kept as a sorted
+// array. As all node indexes are below the edge indexes, the array is the
+// sorted node list followed by the sorted edge list, and its size follows
+// the number of nodes and edges in the pattern instead of the graph size.
+class CPattern {
+	int* bits;
+	int num;
+	int cap;
+	GVecAlloc* alloc; //storage of bits, or NULL for the heap
+	int lower(int i, int from=0) const { //first position from 'from' with bits[pos]>=i
+		int hi=num;
+		while (from<hi) {
+			int m=(from+hi)>>1;
+			if (bits[m]<i) from=m+1;
+			else hi=m;
+		}
+		return from;
+	}
+	void grow(int n) {
+		if (n<=cap) return;
+		int newcap=GMAX(n, cap ? cap*2 : 8);
+		if (alloc) {
+			int* b=(int*)alloc->allocItems(newcap*sizeof(int));
+			if (num) memcpy(b, bits, num*sizeof(int));
+			alloc->freeItems(bits, cap*sizeof(int));
+			bits=b;
+		}
+		else GREALLOC(bits, newcap*sizeof(int));
+		cap=newcap;
+	}
+ public:
+	class Ref { //a single bit, as GBitVec's operator[]
+		CPattern& pat;
+		int idx;
+	 public:
+		Ref(CPattern& p, int i):pat(p), idx(i) { }
+		Ref& operator=(bool v) {
+			if (v) pat.set(idx);
+			else pat.reset(idx);
+			return *this;
+		}
+		Ref& operator=(const Ref& r) { return (*this=bool(r)); }
+		operator bool() const { return pat.test(idx); }
+	};
+	explicit CPattern(GVecAlloc* a=NULL):bits(NULL), num(0), cap(0), alloc(a) { }
+	CPattern(const CPattern& p):bits(NULL), num(p.num), cap(p.num), alloc(NULL) {
+		if (num) {
+			GMALLOC(bits, num*sizeof(int));
+			memcpy(bits, p.bits, num*sizeof(int));
+		}
+	}
+	~CPattern() {
+		if (alloc) alloc->freeItems(bits, cap*sizeof(int));
+		else GFREE(bits);
+	}
+	CPattern& operator=(const CPattern& p) {
+		if (this==&p) return *this;
+		num=0;
+		grow(p.num);
+		if (p.num) memcpy(bits, p.bits, p.num*sizeof(int));
+		num=p.num;
+		return *this;
+	}
+	bool test(int i) const {
+		if (num==0 || i>bits[num-1]) return false;
+		int p=lower(i);
+		return (bits[p]==i);
+	}
+	bool operator[](int i) const { return test(i); }
+	Ref operator[](int i) { return Ref(*this, i); }
+	void set(int i) {
+		if (num==0 || i>bits[num-1]) { //patterns are mostly built in order
+			grow(num+1);
+			bits[num++]=i;
+			return;
+		}
+		int p=lower(i);
+		if (bits[p]==i) return;
+		grow(num+1);
+		memmove(bits+p+1, bits+p, (num-p)*sizeof(int));
+		bits[p]=i;
+		num++;
+	}
+	void reset(int i) {
+		if (num==0 || i>bits[num-1]) return;
+		int p=lower(i);
+		if (bits[p]!=i) return;
+		num--;
+		memmove(bits+p, bits+p+1, (num-p)*sizeof(int));
+	}
+	void reset() { num=0; } //clear all bits
+	int count() const { return num; } //number of nodes and edges
+	int bit(int k) const { return bits[k]; } //k-th node or edge, in increasing order
+	bool contains(const CPattern& p) const; //p is a subset of this pattern
+	bool intersects(const CPattern& p) const;
+	bool operator==(const CPattern& p) const {
+		return (num==p.num && (num==0 || memcmp(bits, p.bits, num*sizeof(int))==0));
+	}
+	CPattern& operator|=(const CPattern& p);
 };
 
+inline CPattern operator|(const CPattern& a, const CPattern& b) {
+	CPattern r(a);
+	r|=b;
+	return r;
+}
+
 struct CTransfrag {
 	GVec<int> nodes;
-	GBitVec pattern;
+	CPattern pattern;
 	float abundance;
 	bool real;
-	CTransfrag(GVec<int>& _nodes,GBitVec& bit, float abund=0, bool treal=true):nodes(_nodes),pattern(bit),abundance(abund),real(treal) {}
-	CTransfrag(float abund=0, bool treal=true):nodes(),pattern(),abundance(abund),real(treal) {}
+	CTransfrag(GVec<int>& _nodes,CPattern& bit, float abund=0, bool treal=true):nodes(CBundleArena::current()),
+			pattern(CBundleArena::current()),abundance(abund),real(treal) {
+		nodes.Add(_nodes);
+		pattern=bit;
+	}
+	CTransfrag(float abund=0, bool treal=true):nodes(CBundleArena::current()),pattern(CBundleArena::current()),
+			abundance(abund),real(treal) {}
+	BUNDLE_ARENA_OBJ
 };
 
 struct CGuide {
@@ -119,6 +295,7 @@ struct CGroup:public GSeg {
 	CGroup(int rstart=0, int rend=0, int _color=-1, int _grid=0, float _cov_sum=0,float _nread=0,float _multi=0,
 			CGroup *_next_gr=NULL): GSeg(rstart, rend), grid(_grid),
 			color(_color), cov_sum(_cov_sum), nread(_nread),multi(_multi), next_gr(_next_gr) { }
+	BUNDLE_ARENA_OBJ
 };
 
 struct CPrediction:public GSeg {
@@ -154,12 +331,15 @@ struct CReadAln:public GSeg {
 	char strand; // 1, 0 (unkown), -1 (reverse)
 	short int nh;
 	int pair_idx; //mate index alignment in CReadAln list
+	int read_count; //number of identical single alignments collapsed into this one
 	GVec<GSeg> segs; //"exons"
 	GPVec<CJunction> juncs; //junction index in CJunction list
 	//DEBUG ONLY: (discard rname when no debugging needed)
 	CReadAln(char _strand=0, short int _nh=0,
 			int rstart=0, int rend=0 /*,  const char* rname=NULL */): GSeg(rstart, rend), //name(rname),
-					strand(_strand), nh(_nh), pair_idx(-1), segs(), juncs(false) { }
+					strand(_strand), nh(_nh), pair_idx(-1), read_count(1), segs(CBundleArena::current()),
+					juncs(CBundleArena::current(), false) { }
+	BUNDLE_ARENA_OBJ
 };
 
 struct CGraphinfo {
@@ -168,34 +348,41 @@ struct CGraphinfo {
 	CGraphinfo(int ng=-1,int nnode=-1):ngraph(ng),nodeno(nnode){}
 };
 
-struct CTreePat {
-	int nodeno;
-	int childno;
-	CTransfrag *tr;
-	CTreePat **nextpat;
-	CTreePat(int n=0,int cno=0):nodeno(n),childno(cno),tr(NULL),nextpat(NULL){
-		if(cno) {
-			GCALLOC(nextpat,cno*sizeof(CTreePat *));
-			for(int i=0;i<cno;i++) nextpat[i]=NULL;
-		}
-	}
-	void setchilds(int cno) {
-		if(cno && !nextpat) {
-			GCALLOC(nextpat,cno*sizeof(CTreePat *));
-			for(int i=0;i<cno;i++) nextpat[i]=NULL;
-		}
-		childno=cno;
-	}
-	void settree(int i, CTreePat *t) {
-		if(i<childno) nextpat[i]=t;
-	}
-	CTreePat *settree(int nextpos,int n,int cno) {
-		if(nextpos<childno) {
-			if(!nextpat[nextpos]) nextpat[nextpos]=new CTreePat(n,cno);
-			return(nextpat[nextpos]);
-		}
-		return(NULL);
-	}
+// hash index of the transfrags of a graph by their node path, for the quick
+// retrieval of the transfrag a read pattern belongs to; the key of a path is
+// its list of nodes, each node n stored as 2*n+1 if there is an edge from the
+// previous node in the path to it, or 2*n otherwise. The entries, keys and
+// buckets are kept in three arrays taken from the bundle arena, so the index
+// is freed at once with the other graph data.
+class CTrfIndex {
+	struct Entry {
+		int key;  //start of the key in keys
+		int len;  //key length (number of nodes)
+		uint hash;
+		int next; //next entry in the same bucket, or -1
+		CTransfrag *tr;
+	};
+	int gno;
+	Entry *entries;
+	int num;
+	int cap;
+	int *keys;
+	int keynum;
+	int keycap;
+	int *buckets; //first entry of each bucket, or -1
+	int nbuckets; //a power of 2
+	int last; //entry found by the last lookup: consecutive reads often share a path
+	static void *grow(void *p,int count,int newcount,int size);
+	void rehash();
+	int lookup(GVec<int>& node,CPattern& pattern,uint& hash);
+ public:
+	CTrfIndex(int _gno);
+	~CTrfIndex();
+	CTransfrag *find(GVec<int>& node,CPattern& pattern);
+	void set(GVec<int>& node,CPattern& pattern,CTransfrag *t); //adds the path if it's not in the index
+	void reset(GVec<int>& node,CPattern& pattern); //the path no longer has a transfrag
+	void print();
+	BUNDLE_ARENA_OBJ
 };
 
 struct CTrimPoint { // this can work as a guide keeper too, where pos is the guideidx, abundance is the flow, and start is the included status
@@ -226,6 +413,58 @@ struct CNetEdge {
 	CNetEdge(int lnk=0.0,float r=0.0, bool f=false):link(lnk),rate(r),fake(f){}
 };
 
+struct CFlowEdge { //plain data (GVec clears its spare slots with memset), set by CFlowNet::edge()
+	int node; //node the edge goes to
+	float capacity;
+	float flow;
+	float rate; //conversion rate used by weight_max_flow()
+};
+
+// sparse flow network for the max flow computations on a path: the nodes
+// are the path positions (and any extra nodes a computation needs). Each node
+// keeps its edges sorted by the node they go to, and its neighbours in the
+// order in which the augmenting path searches visit them; an edge that was
+// never set has no capacity or flow, and a rate of 1. Memory is linear in the
+// number of edges, instead of the square of the path length.
+// A network can be init()-ed again for each path: the edge lists keep their
+// memory, so a graph's paths reuse the same storage.
+class CFlowNet {
+	int n;
+	int cap; //nodes with allocated edge lists
+	GVec<CFlowEdge> *edges;
+	GVec<int> *link;
+	GVec<int> color;
+	GVec<int> queue;
+	int findpos(int u,int v); //position of edge u->v, or -1-(its insertion position)
+ public:
+	GVec<int> pred; //the augmenting path found by a search, from the sink back to node 0
+	CFlowNet(int nodes=0):n(0),cap(0),edges(NULL),link(NULL),color(),queue(),pred() { init(nodes); }
+	~CFlowNet() { delete [] edges; delete [] link; }
+	void init(int nodes); //a network with no edges
+	CFlowEdge *find(int u,int v) {
+		int p=findpos(u,v);
+		return(p<0 ? NULL : &edges[u][p]);
+	}
+	CFlowEdge& edge(int u,int v); //adds the edge if it's not there yet
+	float capacity(int u,int v) { CFlowEdge *e=find(u,v); return(e ? e->capacity : 0); }
+	float flow(int u,int v) { CFlowEdge *e=find(u,v); return(e ? e->flow : 0); }
+	float rate(int u,int v) { CFlowEdge *e=find(u,v); return(e ? e->rate : 1); }
+	void addlink(int u,int v) { //u and v become neighbours
+		link[u].Add(v);
+		link[v].Add(u);
+		edge(u,v);
+		edge(v,u);
+	}
+	GVec<int>& links(int u) { return(link[u]); }
+	//breadth first search of an augmenting path from node 0 to sink; the
+	//neighbours of a node are visited from the last one so longer transcripts
+	//are considered first
+	bool bfs(int sink);
+	//as bfs(), but neighbours are visited in order, and going forward from a
+	//node also needs capacity left in the node (its edge to itself)
+	bool weight_bfs(int sink);
+};
+
 struct CComponent {
 	float size;
 	GVec<int> *set;
@@ -233,6 +472,44 @@ struct CComponent {
 	~CComponent() { if(set) delete set;}
 };
 
+// memo of the max components computed for the sets of agreeing transfrags:
+// the key of a set is the list of its transfrag numbers, each with a flag for
+// a non-zero abundance and one for a non-zero penalty. The keys are found by
+// a 128 bit hash and then compared in full. At most MAX_COMPCACHE components
+// are kept; when the cache is full the oldest one is dropped.
+class CComponentCache {
+	struct Entry {
+		uint64_t h1,h2;
+		int *key;
+		int len;
+		CComponent *comp;
+		int next; //next entry in the same bucket, or -1
+	};
+	Entry *entries;
+	int num; //entries in use
+	int cap;
+	int oldest; //entry replaced next when the cache is full
+	int *buckets; //first entry of each bucket, or -1
+	int nbuckets; //a power of 2
+	void unlink(int e);
+	void rehash(int newnbuckets);
+ public:
+	static int keyval(CTrInfo& t) { return (t.trno<<2) | ((t.abundance!=0)<<1) | (t.penalty!=0); }
+	static void hash(uint64_t& h1,uint64_t& h2,int v) {
+		h1=(h1^(uint32_t)v)*0x100000001b3ULL;
+		h2=(h2+(uint32_t)v)*0x9e3779b97f4a7c15ULL;
+		h2^=h2>>29;
+	}
+	CComponentCache():entries(NULL),num(0),cap(0),oldest(0),buckets(NULL),nbuckets(0) { }
+	~CComponentCache() { Clear(); GFREE(entries); GFREE(buckets); }
+	//the component of a set hashed to h1,h2, or NULL
+	CComponent *find(uint64_t h1,uint64_t h2,GVec<CTrInfo>& set);
+	//takes over comp; the components returned by find() or add() before
+	//may be deleted by this
+	void add(uint64_t h1,uint64_t h2,GVec<CTrInfo>& set,CComponent *comp);
+	void Clear();
+};
+
 struct CGraphnode:public GSeg {
 	int nodeid;
 	float cov;
@@ -241,11 +518,13 @@ struct CGraphnode:public GSeg {
 	float frag; // number of fragments included in node
 	GVec<int> child;
 	GVec<int> parent;
-	GBitVec childpat;
-	GBitVec parentpat;
+	CPattern childpat;
+	CPattern parentpat;
 	GVec<int> trf; // transfrags that pass the node
 	CGraphnode(int s=0,int e=0,int id=MAX_NODE,float nodecov=0,float cap=0,float r=0,float f=0):GSeg(s,e),nodeid(id),
-			cov(nodecov),capacity(cap),rate(r),frag(f),child(),parent(),childpat(),parentpat(),trf(){}
+			cov(nodecov),capacity(cap),rate(r),frag(f),child(CBundleArena::current()),parent(CBundleArena::current()),
+			childpat(CBundleArena::current()),parentpat(CBundleArena::current()),trf(CBundleArena::current()) {}
+	BUNDLE_ARENA_OBJ
 };
 
 // # 0: strand; 1: start; 2: end; 3: nreads; 4: nreads_good;
@@ -266,6 +545,7 @@ struct CJunction:public GSeg {
 	bool operator==(CJunction& b) {
 		return (start==b.start && end==b.end && strand==b.strand);
 	}
+	BUNDLE_ARENA_OBJ
 };
 
 struct CTCov { //covered transcript info
@@ -300,12 +580,237 @@ struct CTCov { //covered transcript info
 	}
 };
 
+#define RREAD_FRAG    0x01 //read counts as a new fragment
+#define RREAD_SAMEREF 0x02 //mate is mapped on the same reference sequence
+
+// read alignment as loaded into a bundle by the main thread; it is added to
+// the bundle data (coverage, junctions, readlist) by processBundleReads()
+struct CBundleRead {
+	int start;
+	int end;
+	int exonidx;    //first exon segment in BundleData::rexons
+	int numexons;
+	int nameidx;    //offset of the read name in BundleData::rnames (RREAD_SAMEREF only)
+	int mate_start; //1-based
+	int mate;       //bundle index of the first mate, or -1/-2 (see GAlnSource::mateLink())
+	int nh;
+	int hi;
+	int cend;       //bundle end when the read was loaded
+	int rcguides;   //number of BundleData::rcguides stored before this read
+	char xs;        //XS tag strand
+	char flags;
+};
+
+// open addressing table (linear probing) of E entries, found by a 64-bit hash
+// of their key; the table is kept between bundles: reset() just starts a new
+// generation, so the entries of the earlier ones become empty slots.
+// E must have the members
+//   uint64_t hash;
+//   uint32_t gen; //the entry is only valid if gen==curgen
+//   bool live() const; //false for a removed entry (dropped when the table grows)
+//   bool matches(const K& key) const; //for each key type K given to find()
+template <class E> class CGenTable {
+	E* table;
+	uint32_t cap; //table size, a power of 2
+	uint32_t used; //valid entries, including removed ones
+	uint32_t curgen;
+	void grow() {
+		E* old=table;
+		uint32_t oldcap=cap;
+		cap = (cap==0) ? 1024 : cap*2;
+		GCALLOC(table, cap*sizeof(E));
+		used=0;
+		uint32_t mask=cap-1;
+		for (uint32_t j=0;j<oldcap;j++) {
+			E& e=old[j];
+			if (e.gen!=curgen || !e.live()) continue;
+			uint32_t i=(uint32_t)e.hash & mask;
+			while (table[i].gen==curgen) i=(i+1) & mask;
+			table[i]=e;
+			used++;
+		}
+		GFREE(old);
+	}
+ public:
+	CGenTable():table(NULL), cap(0), used(0), curgen(1) { }
+	~CGenTable() { GFREE(table); }
+	static uint64_t mix(uint64_t h) { //murmur3 finalizer
+		h^=h>>33; h*=0xff51afd7ed558ccdULL;
+		h^=h>>33; h*=0xc4ceb9fe1a85ec53ULL;
+		h^=h>>33;
+		return h;
+	}
+	void reset() { //remove all entries
+		used=0;
+		if (++curgen==0) { //generation counter wrapped around
+			for (uint32_t i=0;i<cap;i++) table[i].gen=0;
+			curgen=1;
+		}
+	}
+	//valid entry with hash h matching key, or NULL
+	template <class K> E* find(uint64_t h, const K& key) {
+		if (cap==0) return NULL;
+		uint32_t mask=cap-1;
+		for (uint32_t i=(uint32_t)h & mask;;i=(i+1) & mask) {
+			E& e=table[i];
+			if (e.gen!=curgen) return NULL;
+			if (e.hash==h && e.matches(key)) return &e;
+		}
+	}
+	//new entry with hash h, for a key that is not in the table yet;
+	//the caller sets the other members
+	E& add(uint64_t h) {
+		if ((used+1)*4>cap*3) grow(); //keep the load under 75%
+		uint32_t mask=cap-1;
+		uint32_t i=(uint32_t)h & mask;
+		while (table[i].gen==curgen) i=(i+1) & mask;
+		E& e=table[i];
+		e.hash=h;
+		e.gen=curgen;
+		used++;
+		return e;
+	}
+};
+
+// mate pairing index: (read name, alignment start, HI) => readlist index;
+// the read names are compared on hash matches, so collisions are harmless.
+class CMateTable {
+	struct MateKey {
+		const char* name;
+		int pos;
+		int hi;
+	};
+	struct MateEntry {
+		uint64_t hash;
+		uint32_t gen;
+		const char* name;
+		int pos;
+		int hi;
+		int n; //readlist index, or -1 for a removed entry
+		bool live() const { return n>=0; }
+		bool matches(const MateKey& k) const {
+			return n>=0 && pos==k.pos && hi==k.hi && strcmp(name, k.name)==0;
+		}
+	};
+	CGenTable<MateEntry> table;
+	static uint64_t keyHash(uint64_t nhash, int pos, int hi) {
+		return CGenTable<MateEntry>::mix(nhash ^ ((uint64_t)(uint32_t)pos<<32 | (uint32_t)hi));
+	}
+	MateEntry* find(uint64_t nhash, const char* name, int pos, int hi) {
+		MateKey k={name, pos, hi};
+		return table.find(keyHash(nhash, pos, hi), k);
+	}
+ public:
+	static uint64_t nameHash(const char* name) { //FNV-1a
+		uint64_t h=0xcbf29ce484222325ULL;
+		while (*name) { h^=(unsigned char)(*name++); h*=0x100000001b3ULL; }
+		return h;
+	}
+	void reset() { table.reset(); } //remove all entries
+	//readlist index stored for this key, or -1 if not found
+	int get(uint64_t nhash, const char* name, int pos, int hi) {
+		MateEntry* e=find(nhash, name, pos, hi);
+		return e ? e->n : -1;
+	}
+	//store a key that is not in the table yet; name must remain valid
+	//until reset()
+	void add(uint64_t nhash, const char* name, int pos, int hi, int n) {
+		MateEntry& e=table.add(keyHash(nhash, pos, hi));
+		e.name=name;
+		e.pos=pos;
+		e.hi=hi;
+		e.n=n;
+	}
+	void remove(uint64_t nhash, const char* name, int pos, int hi) {
+		MateEntry* e=find(nhash, name, pos, hi);
+		if (e) e->n=-1;
+	}
+};
+
+// junction lookup by coordinates and strand while the reads of a bundle
+// are added (see add_junction()); kept between bundles like CMateTable
+class CJunctionIndex {
+	struct JKey {
+		int start;
+		int end;
+		char strand;
+	};
+	struct JEntry {
+		uint64_t hash;
+		uint32_t gen;
+		CJunction* j;
+		bool live() const { return true; }
+		bool matches(const JKey& k) const {
+			return (int)j->start==k.start && (int)j->end==k.end && j->strand==k.strand;
+		}
+	};
+	CGenTable<JEntry> table;
+	static uint64_t keyHash(int start, int end, char strand) {
+		return CGenTable<JEntry>::mix(((uint64_t)(uint32_t)start<<32 | (uint32_t)end) ^ ((uint64_t)(unsigned char)strand<<56));
+	}
+ public:
+	void reset() { table.reset(); } //remove all entries
+	CJunction* get(int start, int end, char strand) {
+		JKey k={start, end, strand};
+		JEntry* e=table.find(keyHash(start, end, strand), k);
+		return e ? e->j : NULL;
+	}
+	void add(CJunction* j) { //j must not be in the index already
+		table.add(keyHash(j->start, j->end, j->strand)).j=j;
+	}
+};
+
+#define COVCHUNK_BITS 16 //positions per coverage chunk: 2^16
+#define COV_SCALE 4294967296.0 //fixed point unit of the coverage values (2^32)
+
+// per-base read coverage of a bundle, indexed from the bundle start.
+// Reads are added as difference array updates, one at each end of an exon
+// segment; the coverage values are computed from the differences as the
+// bundle start positions advance (freeze()), or when queried. Values are
+// kept in fixed point so that the updates cancel exactly, and the storage
+// is a list of chunks, allocated only for the chunks that get updates.
+// The cumulative coverage needed by sum() is computed on its first use,
+// which also makes all the coverage values final.
+class CCovTrack {
+	struct CovChunk {
+		int64_t* val; //differences, then coverage values below fin; NULL: no updates
+		double* cum; //cumulative coverage, up to the end of the chunk
+		int64_t carry; //coverage before the chunk start (valid below fin)
+		double cumcarry; //cumulative coverage before the chunk start
+	};
+	GVec<CovChunk> chunks;
+	int len;    //positions covered by updates (like the old bpcov.Count())
+	int fin;    //the coverage values are final below this position
+	int cumfin; //chunks with cumulative coverage computed
+	int64_t value(int p); //fixed point coverage at p
+	int64_t* chunk(int p);
+	double cumulative(int p); //total coverage over [0,p]
+ public:
+	CCovTrack():chunks(), len(0), fin(0), cumfin(0) { }
+	~CCovTrack() { Clear(); }
+	void Clear();
+	int Count() { return len; }
+	void add(int i, int j, float v); //add v to the coverage of [i,j)
+	//no more updates will be made below position p
+	void freeze(int p);
+	float get(int p) { return (p<0 || p>=len) ? 0 : (float)(value(p)/COV_SCALE); }
+	float operator[](int p) { return get(p); }
+	//total coverage over [i,j]
+	double sum(int i, int j) {
+		if (j>=len) j=len-1;
+		if (i<0) i=0;
+		if (j<i) return 0;
+		return cumulative(j)-(i ? cumulative(i-1) : 0);
+	}
+};
+
 // bundle data structure, holds all input data parsed from BAM file
 // - r216 regression
 struct BundleData {
  BundleStatus status;
  //int64_t bamStart; //start of bundle in BAM file
  int idx; //index in the main bundles array
+ int seqno; //input order of the bundle, its results are printed in this order
  int start;
  int end;
  bool covSaturated;
@@ -313,16 +818,26 @@ struct BundleData {
  int num_fragments; //aligned read/pairs
  int frag_len;
  GStr refseq;
- GList<CReadAln> readlist;
- GVec<float> bpcov;
+ GList<CReadAln> readlist; //the reads and junctions are freed with the arena
+ CCovTrack bpcov;
  GList<CJunction> junction;
  GPVec<GffObj> keepguides;
  GPVec<CTCov> covguides;
  GList<CPrediction> pred;
  RC_BundleData* rc_data;
- BundleData():status(BUNDLE_STATUS_CLEAR), idx(0), start(0), end(0),
-		 covSaturated(false), numreads(0), num_fragments(0), frag_len(0),refseq(), readlist(false,true),
-		 bpcov(1024), junction(true, true, true), keepguides(false), pred(false), rc_data(NULL) { }
+ //loaded read alignments, not yet processed:
+ GVec<CBundleRead> rreads;
+ GVec<GSeg> rexons;
+ GVec<char> rnames;
+ GPVec<GffObj> rcguides; //reference transcripts for Ballgown, in loading order
+ CMateTable mates; //mate pairing index used by processRead(), kept across bundles
+ CJunctionIndex jindex; //junction index used by processRead(), kept across bundles
+ int lastsingle; //readlist index of the last alignment if it was added as a single read, or -1
+ CBundleArena arena; //storage for the reads, junctions and graph objects of this bundle
+ BundleData():status(BUNDLE_STATUS_CLEAR), idx(0), seqno(0), start(0), end(0),
+		 covSaturated(false), numreads(0), num_fragments(0), frag_len(0),refseq(), readlist(false,false),
+		 bpcov(), junction(true, false, true), keepguides(false), pred(false), rc_data(NULL),
+		 rreads(), rexons(), rnames(), rcguides(false), mates(), jindex(), lastsingle(-1), arena() { }
 
  void getReady(int currentstart, int currentend) {
 	 start=currentstart;
@@ -344,15 +859,25 @@ struct BundleData {
  */
  void rc_store_t(GffObj* scaff);
 
- bool rc_count_hit(GBamRecord& brec, char strand, int nh); //, int hi);
+ bool rc_count_hit(CBundleRead& rd, char strand, int nh); //, int hi);
+
+ //append a read alignment to the bundle, for processBundleReads()
+ void addRead(GBamRecord& brec, char xs, int nh, int hi, int cend, int mate);
+
+ //estimated memory needed to process the loaded reads of this bundle
+ size_t footprint();
 
  void Clear() {
 	keepguides.Clear();
 	pred.Clear();
 	readlist.Clear();
 	bpcov.Clear();
-	bpcov.setCapacity(1024);
 	junction.Clear();
+	rreads.Clear();
+	rexons.Clear();
+	rnames.Clear();
+	rcguides.Clear();
+	covguides.Clear();
 	start=0;
 	end=0;
 	status=BUNDLE_STATUS_CLEAR;
@@ -362,6 +887,7 @@ struct BundleData {
 	frag_len=0;
 	delete rc_data;
 	rc_data=NULL;
+	arena.reset();
  }
 
  ~BundleData() {
@@ -420,15 +946,147 @@ struct BundleData {
  }
 };
 */
+
+// compatibility of the transfrags of a graph (whether two transfrags can be
+// part of the same transcript), set up after the transfrags are sorted. Only
+// the pairs that are asked for are checked, in blocks of 64 transfrags: row t1
+// keeps a bit for each t2>t1 of the blocks checked so far, and a bit for each
+// block telling if it was checked. Rows are allocated when first used.
+class CCompatTable {
+	int gno;
+	GPVec<CGraphnode>* no2gnode;
+	GPVec<CTransfrag>* transfrag;
+	int n; //number of transfrags
+	uint64_t** rows; //row t1: the checked block bits, then the compatibility bits of blocks t1/64 .. (n-1)/64
+	int checkwords(int t1) { return ((((n-1)>>6)-(t1>>6))>>6)+1; }
+	bool check(int t1,int t2);
+	void fill(int t1,int b); //check the pairs of t1 with the transfrags of its row's block b
+ public:
+	CCompatTable():gno(0),no2gnode(NULL),transfrag(NULL),n(0),rows(NULL) { }
+	~CCompatTable() { clear(); }
+	void init(int _gno,GPVec<CGraphnode>& _no2gnode,GPVec<CTransfrag>& _transfrag);
+	void clear();
+	bool operator()(int t1,int t2) {
+		if(t1==t2) return(true);
+		if(t1>t2) Gswap(t1,t2);
+		int b=(t2>>6)-(t1>>6);
+		uint64_t* r=rows[t1];
+		if(r==NULL || !((r[b>>6]>>(b&63)) & 1)) {
+			fill(t1,b);
+			r=rows[t1];
+		}
+		return((r[checkwords(t1)+b]>>(t2&63)) & 1);
+	}
+};
+
+// the part of build_graphs() done for one graph: guide and transfrag
+// processing, then transcript prediction; the graphs of a bundle share no
+// data, so they can be assembled by different threads
+struct CGraphTask {
+	int gno;
+	int s; //strand
+	GPVec<CGraphnode>* no2gnode;
+	GPVec<CTransfrag>* transfrag;
+	CTrfIndex* tr2no;
+	GPVec<GffObj>* guides;
+	CBundleArena* arena; //the bundle's, used by the thread running the task
+	bool fast;
+	int ngenes; //number of genes in pred, which are numbered from 0
+	GList<CPrediction> pred; //predictions of this graph, merged into the bundle's
+	CGraphTask(int _gno, int _s, GPVec<CGraphnode>* _no2gnode, GPVec<CTransfrag>* _transfrag,
+			CTrfIndex* _tr2no, GPVec<GffObj>* _guides, CBundleArena* _arena, bool _fast):gno(_gno), s(_s),
+			no2gnode(_no2gnode), transfrag(_transfrag), tr2no(_tr2no), guides(_guides),
+			arena(_arena), fast(_fast), ngenes(0), pred(false, false) { }
+	void run();
+};
+
+#ifndef NOTHREADS
+// the graph tasks of a bundle: the thread processing the bundle runs them,
+// unless idle worker threads steal some of them first (see shareGraphTasks())
+class CGraphTasks {
+	GPVec<CGraphTask>& tasks;
+	int next; //first task not claimed yet
+	int pending; //claimed tasks not finished yet
+	GMutex mutex;
+	GConditionVar allDone;
+ public:
+	CGraphTasks(GPVec<CGraphTask>& graphtasks):tasks(graphtasks), next(0), pending(0),
+			mutex(), allDone() { }
+	CGraphTask* claim(); //next task to run, or NULL if all were claimed
+	void finished(); //a claimed task was run
+	void run(); //run the tasks not stolen, then wait for the stolen ones
+};
+
+//provided by the worker threads pool: make the tasks available for
+//stealing by the idle worker threads, or withdraw them
+void shareGraphTasks(CGraphTasks* tasks);
+void unshareGraphTasks(CGraphTasks* tasks);
+#endif
+
+//adds a read alignment to the bundle data; mate is the readlist index of the
+//first mate linked by the read digest, -1 to pair mates by read name, or
+//-2 if the read might still be linked to a later mate; returns the readlist
+//index of the alignment the read was stored or collapsed into, or -1
 int processRead(int currentstart, int currentend, BundleData& bdata,
-		 GHash<int>& hashread, GBamRecord& brec, char strand, int nh, int hi);
+		 CMateTable& mates, CBundleRead& rd, char strand, int nh, int hi, int mate);
 
-void countRead(BundleData& bdata, GBamRecord& brec, int hi);
+void countRead(BundleData& bdata, CBundleRead& rd, int hi);
+
+//first stage of bundle processing: add the loaded reads to the bundle
+void processBundleReads(BundleData& bdata);
 
 //int process_read(int currentstart, int currentend, GList<CReadAln>& readlist, GHash<int>& hashread,
 //		GList<CJunction>& junction, GBamRecord& brec, char strand, int nh, int hi, GVec<float>& bpcov);
 
-int printResults(BundleData* bundleData, int ngenes, int geneno, GStr& refname);
+//order of the predictions of a bundle: its pred list is kept sorted by it
+int predCmp(const pointer p1, const pointer p2);
+
+int printResults(BundleData* bundleData, int ngenes, int geneno, GStr& refname, FILE* fout);
+//print the reference transcripts found covered in a bundle (-C, -P)
+void printCovered(BundleData* bundleData, FILE* f);
+
+// Transcript records of the intermediate output: the FPKM values are only
+// known after all bundles were processed, so the predicted transcripts are
+// first written in this binary form, then rendered as GTF in a single pass.
+// A record is a CTrRecord, its exons (CTrExon), the reference sequence name
+// and the reference transcript ID (not 0 terminated), padded to 4 bytes.
+// All values are in the native byte order.
+struct CTrExon {
+	int32_t start;
+	int32_t end;
+	float cov;
+};
+
+struct CTrRecord {
+	uint32_t reclen; //length of the whole record
+	int32_t start;
+	int32_t end;
+	int32_t geneno; //gene number; local to a bundle or region until written to the output
+	int32_t tno; //transcript number in its gene
+	int32_t tlen;
+	uint32_t t_id; //Ballgown id of the reference transcript, or 0
+	int32_t numexons;
+	float frag;
+	float cov;
+	uint16_t refnamelen;
+	uint16_t refidlen; //0 if there is no reference transcript
+	char strand;
+	char pad[3];
+	CTrExon* exons() { return (CTrExon*)(this+1); }
+	char* refname() { return (char*)(exons()+numexons); }
+	char* refid() { return refname()+refnamelen; }
+};
+
+void write_transcript(FILE* fout, CPrediction* pred, int geneno, int tno, uint t_id, GStr& refname);
+
+//add shift to the gene numbers of the transcript records in buf
+void shift_transcripts(char* buf, size_t len, int shift);
+
+//coverage of a transcript record, as it is printed (6 decimals)
+float transcript_cov(CTrRecord* rec);
+
+//print a transcript record as GTF, with its FPKM value
+void print_transcript_gtf(GOutBuf& out, CTrRecord* rec, float fpkm);
 
 //int print_transcripts(GList<CPrediction>& pred, int ngenes, int geneno, GStr& refname);
 
@@ -198,6 +198,7 @@ open_write(int fd, int compress_level) // compress_level==-1 for the default lev
     fp->block_offset = 0;
     fp->block_length = 0;
     fp->error = NULL;
+    fp->readahead = NULL;
     return fp;
 }
 
@@ -260,15 +261,13 @@ bgzf_fdopen(int fd, const char * __restrict mode)
     }
 }
 
-static
 int
-deflate_block(BGZF* fp, int block_length)
+bgzf_deflate_raw_block(const void* udata, int ulen, void* cdata, int csize, int level)
 {
-    // Deflate the block in fp->uncompressed_block into fp->compressed_block.
+    // Deflate ulen bytes of udata into a complete BGZF block in cdata.
     // Also adds an extra field that stores the compressed block length.
 
-    bgzf_byte_t* buffer = fp->compressed_block;
-    int buffer_size = fp->compressed_block_size;
+    bgzf_byte_t* buffer = cdata;
 
     // Init gzip header
     buffer[0] = GZIP_ID1;
@@ -290,63 +289,64 @@ deflate_block(BGZF* fp, int block_length)
     buffer[16] = 0; // placeholder for block length
     buffer[17] = 0;
 
+    z_stream zs;
+    zs.zalloc = NULL;
+    zs.zfree = NULL;
+    zs.next_in = (Bytef*)udata;
+    zs.avail_in = ulen;
+    zs.next_out = (void*)&buffer[BLOCK_HEADER_LENGTH];
+    zs.avail_out = csize - BLOCK_HEADER_LENGTH - BLOCK_FOOTER_LENGTH;
+
+    int status = deflateInit2(&zs, level, Z_DEFLATED,
+                              GZIP_WINDOW_BITS, Z_DEFAULT_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+    if (status != Z_OK) return -1;
+    status = deflate(&zs, Z_FINISH);
+    if (status != Z_STREAM_END) {
+        deflateEnd(&zs);
+        // Not enough space in buffer: the input doesn't compress enough.
+        return (status == Z_OK) ? 0 : -1;
+    }
+    status = deflateEnd(&zs);
+    if (status != Z_OK) return -1;
+    int compressed_length = zs.total_out;
+    compressed_length += BLOCK_HEADER_LENGTH + BLOCK_FOOTER_LENGTH;
+    if (compressed_length > MAX_BLOCK_SIZE) return -1; // should never happen
+
+    packInt16((uint8_t*)&buffer[16], compressed_length-1);
+    uint32_t crc = crc32(0L, NULL, 0L);
+    crc = crc32(crc, udata, ulen);
+    packInt32((uint8_t*)&buffer[compressed_length-8], crc);
+    packInt32((uint8_t*)&buffer[compressed_length-4], ulen);
+    return compressed_length;
+}
+
+static
+int
+deflate_block(BGZF* fp, int block_length)
+{
+    // Deflate the block in fp->uncompressed_block into fp->compressed_block.
+
     // loop to retry for blocks that do not compress enough
     int input_length = block_length;
     int compressed_length = 0;
     while (1) {
-        z_stream zs;
-        zs.zalloc = NULL;
-        zs.zfree = NULL;
-        zs.next_in = fp->uncompressed_block;
-        zs.avail_in = input_length;
-        zs.next_out = (void*)&buffer[BLOCK_HEADER_LENGTH];
-        zs.avail_out = buffer_size - BLOCK_HEADER_LENGTH - BLOCK_FOOTER_LENGTH;
-
-        int status = deflateInit2(&zs, fp->compress_level, Z_DEFLATED,
-                                  GZIP_WINDOW_BITS, Z_DEFAULT_MEM_LEVEL, Z_DEFAULT_STRATEGY);
-        if (status != Z_OK) {
-            report_error(fp, "deflate init failed");
-            return -1;
-        }
-        status = deflate(&zs, Z_FINISH);
-        if (status != Z_STREAM_END) {
-            deflateEnd(&zs);
-            if (status == Z_OK) {
-                // Not enough space in buffer.
-                // Can happen in the rare case the input doesn't compress enough.
-                // Reduce the amount of input until it fits.
-                input_length -= 1024;
-                if (input_length <= 0) {
-                    // should never happen
-                    report_error(fp, "input reduction failed");
-                    return -1;
-                }
-                continue;
-            }
+        compressed_length = bgzf_deflate_raw_block(fp->uncompressed_block, input_length,
+                                                   fp->compressed_block, fp->compressed_block_size,
+                                                   fp->compress_level);
+        if (compressed_length < 0) {
             report_error(fp, "deflate failed");
             return -1;
         }
-        status = deflateEnd(&zs);
-        if (status != Z_OK) {
-            report_error(fp, "deflate end failed");
-            return -1;
-        }
-        compressed_length = zs.total_out;
-        compressed_length += BLOCK_HEADER_LENGTH + BLOCK_FOOTER_LENGTH;
-        if (compressed_length > MAX_BLOCK_SIZE) {
+        if (compressed_length > 0) break;
+        // Reduce the amount of input until it fits.
+        input_length -= 1024;
+        if (input_length <= 0) {
             // should never happen
-            report_error(fp, "deflate overflow");
+            report_error(fp, "input reduction failed");
             return -1;
         }
-        break;
     }
 
-    packInt16((uint8_t*)&buffer[16], compressed_length-1);
-    uint32_t crc = crc32(0L, NULL, 0L);
-    crc = crc32(crc, fp->uncompressed_block, input_length);
-    packInt32((uint8_t*)&buffer[compressed_length-8], crc);
-    packInt32((uint8_t*)&buffer[compressed_length-4], input_length);
-
     int remaining = block_length - input_length;
     if (remaining > 0) {
         if (remaining > input_length) {
@@ -362,40 +362,43 @@ deflate_block(BGZF* fp, int block_length)
     return compressed_length;
 }
 
-static
 int
-inflate_block(BGZF* fp, int block_length)
+bgzf_inflate_raw_block(const void* cdata, int clen, void* udata, int usize)
 {
-    // Inflate the block in fp->compressed_block into fp->uncompressed_block
+    // Inflate the compressed block in cdata into udata
 
     z_stream zs;
 	int status;
     zs.zalloc = NULL;
     zs.zfree = NULL;
-    zs.next_in = fp->compressed_block + 18;
-    zs.avail_in = block_length - 16;
-    zs.next_out = fp->uncompressed_block;
-    zs.avail_out = fp->uncompressed_block_size;
+    zs.next_in = (Bytef*)cdata + 18;
+    zs.avail_in = clen - 16;
+    zs.next_out = udata;
+    zs.avail_out = usize;
 
     status = inflateInit2(&zs, GZIP_WINDOW_BITS);
-    if (status != Z_OK) {
-        report_error(fp, "inflate init failed");
-        return -1;
-    }
+    if (status != Z_OK) return -1;
     status = inflate(&zs, Z_FINISH);
     if (status != Z_STREAM_END) {
         inflateEnd(&zs);
-        report_error(fp, "inflate failed");
         return -1;
     }
     status = inflateEnd(&zs);
-    if (status != Z_OK) {
-        report_error(fp, "inflate failed");
-        return -1;
-    }
+    if (status != Z_OK) return -1;
     return zs.total_out;
 }
 
+static
+int
+inflate_block(BGZF* fp, int block_length)
+{
+    // Inflate the block in fp->compressed_block into fp->uncompressed_block
+    int count = bgzf_inflate_raw_block(fp->compressed_block, block_length,
+                                       fp->uncompressed_block, fp->uncompressed_block_size);
+    if (count < 0) report_error(fp, "inflate failed");
+    return count;
+}
+
 static
 int
 check_header(const bgzf_byte_t* header)
@@ -468,35 +471,27 @@ static void cache_block(BGZF *fp, int size)
 }
 
 int
-bgzf_read_block(BGZF* fp)
+bgzf_read_raw_block(BGZF* fp, void* cdata, int64_t* address)
 {
-    bgzf_byte_t header[BLOCK_HEADER_LENGTH];
-	int count, size = 0, block_length, remaining;
+    bgzf_byte_t* compressed_block = (bgzf_byte_t*) cdata;
+	int count, block_length, remaining;
 #ifdef _USE_KNETFILE
-    int64_t block_address = knet_tell(fp->x.fpr);
-	if (load_block_from_cache(fp, block_address)) return 0;
-    count = knet_read(fp->x.fpr, header, sizeof(header));
+    *address = knet_tell(fp->x.fpr);
+    count = knet_read(fp->x.fpr, compressed_block, BLOCK_HEADER_LENGTH);
 #else
-    int64_t block_address = ftello(fp->file);
-	if (load_block_from_cache(fp, block_address)) return 0;
-    count = fread(header, 1, sizeof(header), fp->file);
+    *address = ftello(fp->file);
+    count = fread(compressed_block, 1, BLOCK_HEADER_LENGTH, fp->file);
 #endif
-    if (count == 0) {
-        fp->block_length = 0;
-        return 0;
-    }
-	size = count;
-    if (count != sizeof(header)) {
+    if (count == 0) return 0;
+    if (count != BLOCK_HEADER_LENGTH) {
         report_error(fp, "read failed");
         return -1;
     }
-    if (!check_header(header)) {
+    if (!check_header(compressed_block)) {
         report_error(fp, "invalid block header");
         return -1;
     }
-    block_length = unpackInt16((uint8_t*)&header[16]) + 1;
-    bgzf_byte_t* compressed_block = (bgzf_byte_t*) fp->compressed_block;
-    memcpy(compressed_block, header, BLOCK_HEADER_LENGTH);
+    block_length = unpackInt16((uint8_t*)&compressed_block[16]) + 1;
     remaining = block_length - BLOCK_HEADER_LENGTH;
 #ifdef _USE_KNETFILE
     count = knet_read(fp->x.fpr, &compressed_block[BLOCK_HEADER_LENGTH], remaining);
@@ -507,7 +502,27 @@ bgzf_read_block(BGZF* fp)
         report_error(fp, "read failed");
         return -1;
     }
-	size += count;
+    return block_length;
+}
+
+int
+bgzf_read_block(BGZF* fp)
+{
+	int count, block_length;
+    int64_t block_address;
+    if (fp->readahead) return fp->readahead->next_block(fp->readahead, fp);
+#ifdef _USE_KNETFILE
+    block_address = knet_tell(fp->x.fpr);
+#else
+    block_address = ftello(fp->file);
+#endif
+	if (load_block_from_cache(fp, block_address)) return 0;
+    block_length = bgzf_read_raw_block(fp, fp->compressed_block, &block_address);
+    if (block_length < 0) return -1;
+    if (block_length == 0) {
+        fp->block_length = 0;
+        return 0;
+    }
     count = inflate_block(fp, block_length);
     if (count < 0) return -1;
     if (fp->block_length != 0) {
@@ -516,7 +531,7 @@ bgzf_read_block(BGZF* fp)
     }
     fp->block_address = block_address;
     fp->block_length = count;
-	cache_block(fp, size);
+	cache_block(fp, block_length);
     return 0;
 }
 
@@ -553,6 +568,8 @@ bgzf_read(BGZF* fp, void* data, int length)
         bytes_read += copy_length;
     }
     if (fp->block_offset == fp->block_length) {
+        if (fp->readahead) fp->block_address = fp->readahead->next_address;
+        else
 #ifdef _USE_KNETFILE
         fp->block_address = knet_tell(fp->x.fpr);
 #else
@@ -564,6 +581,46 @@ bgzf_read(BGZF* fp, void* data, int length)
     return bytes_read;
 }
 
+int
+bgzf_skip(BGZF* fp, int length)
+{
+    int bytes_skipped = 0;
+    if (length <= 0) {
+        return 0;
+    }
+    if (fp->open_mode != 'r') {
+        report_error(fp, "file not open for reading");
+        return -1;
+    }
+    while (bytes_skipped < length) {
+        int skip_length, available = fp->block_length - fp->block_offset;
+        if (available <= 0) {
+            if (bgzf_read_block(fp) != 0) {
+                return -1;
+            }
+            available = fp->block_length - fp->block_offset;
+            if (available <= 0) {
+                break;
+            }
+        }
+        skip_length = bgzf_min(length-bytes_skipped, available);
+        fp->block_offset += skip_length;
+        bytes_skipped += skip_length;
+    }
+    if (fp->block_offset == fp->block_length) {
+        if (fp->readahead) fp->block_address = fp->readahead->next_address;
+        else
+#ifdef _USE_KNETFILE
+        fp->block_address = knet_tell(fp->x.fpr);
+#else
+        fp->block_address = ftello(fp->file);
+#endif
+        fp->block_offset = 0;
+        fp->block_length = 0;
+    }
+    return bytes_skipped;
+}
+
 int bgzf_flush(BGZF* fp)
 {
     while (fp->block_offset > 0) {
@@ -699,6 +756,12 @@ int64_t bgzf_seek(BGZF* fp, int64_t pos, int where)
     }
     block_offset = pos & 0xFFFF;
     block_address = (pos >> 16) & 0xFFFFFFFFFFFFLL;
+    if (fp->readahead) {
+        if (fp->readahead->seek(fp->readahead, fp, block_address) != 0) {
+            report_error(fp, "seek failed");
+            return -1;
+        }
+    } else
 #ifdef _USE_KNETFILE
     if (knet_seek(fp->x.fpr, block_address, SEEK_SET) != 0) {
 #else
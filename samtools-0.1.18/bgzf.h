@@ -55,8 +55,24 @@ typedef struct {
 	int cache_size;
     const char* error;
 	void *cache; // a pointer to a hash table
+	struct bgzf_readahead_t *readahead; // optional block supplier for reading
 } BGZF;
 
+/*
+ * Read-ahead hook. When fp->readahead is set, bgzf_read_block() takes the
+ * next block from next_block() instead of reading and inflating it inline,
+ * and bgzf_seek() is forwarded to seek(). The hook owns the underlying file
+ * position while it is installed. next_block() must behave like
+ * bgzf_read_block(): fill fp->uncompressed_block and set block_address and
+ * block_length (0 at end of file); next_address must hold the compressed
+ * offset that follows the last block handed out.
+ */
+typedef struct bgzf_readahead_t {
+	int (*next_block)(struct bgzf_readahead_t *ra, BGZF *fp);
+	int (*seek)(struct bgzf_readahead_t *ra, BGZF *fp, int64_t block_address);
+	int64_t next_address;
+} bgzf_readahead_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -91,6 +107,13 @@ int bgzf_close(BGZF* fp);
  */
 int bgzf_read(BGZF* fp, void* data, int length);
 
+/*
+ * Skip over length bytes of uncompressed data, like bgzf_read()
+ * without copying them anywhere.
+ * Returns the number of bytes actually skipped, or -1 on error.
+ */
+int bgzf_skip(BGZF* fp, int length);
+
 /*
  * Write length bytes from data to the file.
  * Returns the number of bytes written.
@@ -130,6 +153,26 @@ int bgzf_flush(BGZF* fp);
 int bgzf_flush_try(BGZF *fp, int size);
 int bgzf_check_bgzf(const char *fn);
 
+/*
+ * Low level block access, used by read-ahead hooks.
+ * bgzf_read_raw_block() reads the next compressed block at the current file
+ * position into cdata (at least 64KB) and stores its offset in *address;
+ * returns the compressed block length, 0 at end of file or -1 on error.
+ * bgzf_inflate_raw_block() inflates such a block into udata and returns the
+ * uncompressed length or -1 on error. It is safe to call from any thread.
+ */
+int bgzf_read_raw_block(BGZF* fp, void* cdata, int64_t* address);
+int bgzf_inflate_raw_block(const void* cdata, int clen, void* udata, int usize);
+
+/*
+ * bgzf_deflate_raw_block() is the writing counterpart: it compresses ulen
+ * bytes of udata into a complete BGZF block in cdata (csize bytes, at most
+ * 64KB are used) and returns its length, 0 if the input did not compress
+ * enough to fit, or -1 on error. Up to 0xff00 bytes of input always fit.
+ * It is safe to call from any thread.
+ */
+int bgzf_deflate_raw_block(const void* udata, int ulen, void* cdata, int csize, int level);
+
 #ifdef __cplusplus
 }
 #endif
@@ -143,6 +186,8 @@ static inline int bgzf_getc(BGZF *fp)
 	}
 	c = ((unsigned char*)fp->uncompressed_block)[fp->block_offset++];
     if (fp->block_offset == fp->block_length) {
+        if (fp->readahead) fp->block_address = fp->readahead->next_address;
+        else
 #ifdef _USE_KNETFILE
         fp->block_address = knet_tell(fp->x.fpr);
 #else
@@ -1,7 +1,14 @@
 #include "rlink.h"
+#include "alninput.h"
+#include "gtfindex.h"
 #ifndef NOTHREADS
 #include "GThreads.h"
 #endif
+#ifndef __WIN32__
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 //#undef GMEMTRACE //-- comment out to track memory use for GDEBUG in Linux
 
@@ -32,7 +39,10 @@
  stringtie <input.bam> [-G <guide_gff>] [-l <label>] [-o <out_gtf>] [-p <cpus>]\n\
   [-v] [-a <min_anchor_len>] [-m <min_tlen>] [-j <min_anchor_cov>] [-n sens]\n\
   [-C <coverage_file_name>] [-s <maxcov>] [-c <min_bundle_cov>] [-g <bdist>]\n\
-  {-B | -b <dir_path>} [-e]\n\
+  {-B | -b <dir_path>} [-e] [--regions] [--decode-ring <n>]\n\
+  [--prefetch <n>] [--mem-limit <size>] [--bgzf]\n\
+ stringtie <input.bam> --digest <out.digest>\n\
+ stringtie <out_gtf.gz> --query <chr[:start-end]>\n\
 \nAssemble RNA-Seq alignments into potential transcripts.\n\
  \n\
  Options:\n\
@@ -53,12 +63,28 @@
  -g gap between read mappings triggering a new bundle (default: 50)\n\
  -C output file with reference transcripts that are covered by reads\n\
  -M fraction of bundle allowed to be covered by multi-hit reads (default:0.95)\n\
- -p number of threads (CPUs) to use (default: 1)\n\
+ -p number of threads (CPUs) to use (default: 1); BAM decompression\n\
+    is also spread over this many threads\n\
  -B enable output of Ballgown table files which will be created in the\n\
     same directory as the output GTF (requires -G, -o recommended)\n\
  -b enable output of Ballgown table files but these files will be \n\
     created under the directory path given as <dir_path>\n\
  -e only estimates the abundance of given reference transcripts (requires -G)\n\
+ --regions use the BAM index to read and assemble reference sequences in\n\
+    parallel, one reader per thread (-p); the index is built if missing\n\
+ --decode-ring number of alignments decoded ahead of bundle building by\n\
+    a separate decoding thread (default: 1024, 0 disables this thread)\n\
+ --prefetch number of bundles loaded ahead of the worker threads (default: 4)\n\
+ --mem-limit memory budget for the bundles being processed, e.g. 24G;\n\
+    loading stops while the estimated memory of the bundles in process\n\
+    reaches this limit (K, M or G suffix; default: no limit)\n\
+ --digest only write a compact read digest of <input.bam> to <out.digest>;\n\
+    the digest can then be given as input instead of the BAM file\n\
+ --bgzf compress the output GTF and the Ballgown tables with BGZF (.gz suffix\n\
+    added), using -p threads; with -o, a transcript index <out_gtf.gz>.tix\n\
+    is also written\n\
+ --query print the transcripts of the indexed <out_gtf.gz> overlapping\n\
+    the given genomic range\n\
  "
 /* 
  -n sensitivity level: 0,1, or 2, 3, with 3 the most sensitive level (default 0)\n\
@@ -107,6 +133,7 @@ GStr label("STRG");
 GStr ballgown_dir;
 
 GStr guidegff;
+GStr digestfname; //--digest: only write the read digest of the input BAM to this file
 
 bool debugMode=false;
 bool verbose=false;
@@ -118,6 +145,13 @@ int maxReadCov=1000000; //max local read coverage (changed with -s option)
 
 bool singlePass=true; //-O will set this to False
 
+bool regionMode=false; //--regions: assemble reference sequences in parallel through the BAM index
+int decodeRing=1024; //--decode-ring: alignments decoded ahead by the decoding thread (0: no decoding thread)
+int prefetchBundles=4; //--prefetch: bundles loaded ahead of the worker threads
+size_t memLimit=0; //--mem-limit: memory budget for the bundles in process (0: no limit)
+bool bgzfOutput=false; //--bgzf: BGZF compressed output GTF and Ballgown tables
+GStr queryRange; //--query: only print the indexed transcripts overlapping this range
+
 int GeneNo=0; //-- global "gene" counter
 unsigned long long int Num_Fragments=0; //global fragment counter (aligned pairs)
 unsigned long long int Frag_Len=0;
@@ -134,44 +168,118 @@ GffNames* gseqNames=NULL; //used as a dictionary for genomic sequence names and
 
 #ifndef NOTHREADS
 
-GFastMutex dataMutex; //to manage availability of data records ready to be loaded by main thread
-GVec<int> dataClear; //indexes of data bundles cleared for loading by main thread (clear data pool)
-
-GFastMutex waitMutex; // for main program to make sure there are threads ready/waiting
-int threadsWaiting=0; // how many worker threads are waiting
-
-GFastMutex printMutex; //for writing the output to file
+// hand-off of the bundles between the main thread and the worker threads:
+// a FIFO of loaded bundles ready to be processed, and the pool of cleared
+// bundles available for loading; either side only blocks (on a condition
+// variable) while there is nothing for it to take. Idle worker threads also
+// steal the graph tasks of the bundles being processed (see CGraphTasks).
+// With a memory budget, a loaded bundle is only queued when its estimated
+// footprint fits along with the bundles already queued or in process
+struct GBundleQueue {
+	GMutex mutex;
+	GConditionVar haveBundles; //a bundle or graph tasks were queued, or no more bundles are coming
+	GConditionVar haveClear; //a bundle was cleared for loading, its memory is available
+	BundleData** ring; //bundles ready to be processed
+	int cap; //one slot for each bundle, so a push never has to wait for a slot
+	int head; //next bundle to be processed
+	int count; //number of queued bundles
+	GVec<int> clear; //indexes of the bundles cleared for loading (clear data pool)
+	bool done; //no more bundles will be queued
+	GPVec<CGraphTasks> shared; //graph tasks open for stealing
+	int pushed; //number of bundles queued so far
+	size_t memlimit; //memory budget (0: no limit)
+	size_t inuse; //estimated memory of the bundles queued or in process
+	size_t* bmem; //estimated memory of each queued or in process bundle
+	GBundleQueue():mutex(), haveBundles(), haveClear(), ring(NULL), cap(0), head(0),
+			count(0), clear(), done(false), shared(false), pushed(0), memlimit(0), inuse(0), bmem(NULL) { }
+	~GBundleQueue() { GFREE(ring); GFREE(bmem); }
+	void init(int numbundles, size_t memlimit);
+	void push(BundleData* bundle); //queue a loaded bundle for the workers, within the memory budget
+	BundleData* pop(); //next bundle to process, NULL when all were processed;
+	                   //runs the graph tasks it can steal while waiting for one
+	void finish(); //no more bundles are coming
+	void release(int bidx); //bundle bidx was cleared, it can be loaded again
+	int acquire(); //wait for a cleared bundle and return its index
+};
+
+GBundleQueue bundleQueue;
+
+// formatted results of a bundle, with its genes numbered from 0
+struct GBundleOutput {
+	int seqno; //input order of the bundle
+	int bidx; //bundle slot, released once the output is written
+	char* buf;
+	size_t len;
+	int ngenes;
+	char* cbuf; //covered reference transcripts (-C, -P)
+	size_t clen;
+};
+
+// the worker threads format the results of each bundle into its own buffer,
+// which is only handed to the writer thread; the writer writes the outputs
+// in input order, so the output is the same for any number of threads, and
+// shifts their gene numbers after the previous bundles'. A bundle slot is
+// only released after its output is written, which bounds the buffering
+struct GOutputWriter {
+	GMutex mutex;
+	GConditionVar haveOutput;
+	GVec<GBundleOutput> outputs; //handed over, not written yet
+	bool done; //no more outputs are coming
+	GThread thread;
+	GOutputWriter():mutex(), haveOutput(), outputs(), done(false), thread() { }
+	void start();
+	void put(GBundleOutput& out);
+	void finish(); //write the remaining outputs and stop the writer thread
+	static void writer(GThreadData& td);
+};
+
+GOutputWriter outputWriter;
+GFastMutex countMutex; //for updating the global fragment counters
 GFastMutex logMutex; //only when verbose - to avoid mangling the log output
-GMutex queueMutex; //whenever bundleQueue is updated
-GFastMutex bamReadingMutex;
-GConditionVar haveBundles; //will notify all threads when bundles are pushed in the ready queue
-                           //or no more bundles are coming
-
-int bundleWork=1; // bit 0 set if bundles are still being prepared (BAM file not exhausted yet)
-                  // bit 1 set if there are Bundles ready in the queue
 #endif
 
-bool NoMoreBundles=false;
-bool moreBundles(); //thread-safe retrieves NoMoreBundles
-void noMoreBundles(); //sets NoMoreBundles to true
+const char* ERR_BAM_SORT="\nError: the input alignment file is not sorted!\n";
+
+// region mode: a range of reference sequences read through the BAM index,
+// bundled and assembled by a single thread into its own temporary file
+struct GRegionTask {
+	int tid_start; //first BAM reference id in this region
+	int tid_end;   //last BAM reference id + 1
+	int gseq_id;   //gseqNames id of the reference currently being read
+	GStr tmpfname;
+	FILE* fout;
+	GStr ctmpfname; //covered reference transcripts (-C, -P)
+	FILE* covout;
+	int geneno; //region-local gene counter
+	unsigned long long int num_fragments;
+	unsigned long long int frag_len;
+	GRegionTask(int tstart=0, int tend=0):tid_start(tstart), tid_end(tend), gseq_id(-1),
+			tmpfname(), fout(NULL), ctmpfname(), covout(NULL), geneno(0), num_fragments(0), frag_len(0) { }
+};
+
 //--
 GStr Process_Options(GArgs* args);
 char* sprintTime();
 
-void processBundle(BundleData* bundle);
+void bundleReads(GAlnSource& alnsrc, GVec<GRefData>& refguides, GVec<int>& alncounts,
+		BundleData* bundles, BundleData* bundle, GRegionTask* region);
+void processBundle(BundleData* bundle, GRegionTask* region=NULL);
+
+//write the final GTF from the transcript records in t_out, adding the FPKM values
+void writeGTF(FILE* t_out, GPVec<RC_ScaffData>& refguides_RC_Data);
 //void processBundle1stPass(BundleData* bundle); //two-pass testing
 
 #ifndef NOTHREADS
 
-bool waitForThreads(); //wait for at least 1 worker thread to enter "ready" state
-
 void workerThread(GThreadData& td); // Thread function
 
-//check if a worker thread popped the data queue:
-bool queuePopped(GPVec<BundleData>& bundleQueue, int prevCount); 
+//format the results of a processed bundle and clear it; they are written,
+//and the bundle released for loading, after the bundles loaded before it
+void printInOrder(BundleData* bundle, int ngenes);
 
-//prepare the next free bundle for loading
-int waitForData(BundleData* bundles);
+void assembleRegions(GBamReader& bamreader, bam_index_t* bam_idx,
+		GVec<GRefData>& refguides, GStr& bamfname);
+void regionThread(GThreadData& td); // Thread function for region mode
 #endif
 
 int main(int argc, char * const argv[]) {
@@ -179,12 +287,25 @@ int main(int argc, char * const argv[]) {
  // == Process arguments.
  GArgs args(argc, argv, 
    //"debug;help;fast;xhvntj:D:G:C:l:m:o:a:j:c:f:p:g:");
-   "debug;help;xyzwShvtien:j:s:D:G:C:l:m:o:a:j:c:f:p:g:P:M:Bb:");
+   "debug;help;regions;bgzf;query=;digest=;decode-ring=;prefetch=;mem-limit=;xyzwShvtien:j:s:D:G:C:l:m:o:a:j:c:f:p:g:P:M:Bb:");
  args.printError(USAGE, true);
 
  GStr bamfname=Process_Options(&args);
  // == Done argument processing.
 
+ if (!digestfname.is_empty()) { //preprocessing only: write the read digest and exit
+	 fclose(f_out);
+	 remove(tmpfname.chars());
+	 writeDigest(bamfname.chars(), digestfname.chars());
+	 return 0;
+ }
+ if (!queryRange.is_empty()) { //only query an indexed output GTF
+	 fclose(f_out);
+	 remove(tmpfname.chars());
+	 queryGTF(bamfname.chars(), queryRange.chars(), stdout);
+	 return 0;
+ }
+
  GVec<GRefData> refguides; // plain vector with transcripts for each chromosome
  GPVec<RC_ScaffData> refguides_RC_Data(true);
  GPVec<RC_Feature> refguides_RC_exons(true);
@@ -195,8 +316,6 @@ int main(int argc, char * const argv[]) {
   verbose=true;
 #endif
 
-const char* ERR_BAM_SORT="\nError: the input alignment file is not sorted!\n";
-
  if(guided) { // read guiding transcripts from input gff file
 	 if (verbose) {
 		 printTime(stderr);
@@ -251,21 +370,15 @@ const char* ERR_BAM_SORT="\nError: the input alignment file is not sorted!\n";
  gseqNames=GffObj::names; //might have been populated already by gff data
  gffnames_ref(gseqNames);  //initialize the names collection if not guided
 
- GBamReader bamreader(bamfname.chars());
-
- GHash<int> hashread;      //read_name:pos:hit_index => readlist index
- //my %hashjunction;  //junction coords and strand => junction index
- // we won't need this because we can quick-search in junction GList directly
- //my @guides=(); //set of annotation transcript for the current locus
- GList<GffObj>* guides=NULL; //list of transcripts on a specific chromosome
-
- int currentstart=0, currentend=0;
- int ng_start=0;
- int ng_end=-1;
- int ng=0;
- GStr lastref;
- int lastref_id=-1; //last seen gseq_id
- // int ncluster=0; used it for debug purposes only
+ GBamReader* bamreader=NULL;
+ GAlnSource* alnsrc=NULL;
+ if (GDigestSource::isDigest(bamfname.chars())) {
+	 alnsrc=new GDigestSource(bamfname.chars());
+ }
+ else {
+	 bamreader=new GBamReader(bamfname.chars());
+	 alnsrc=new GBamSource(*bamreader);
+ }
 
  //Ballgown files
  FILE* f_tdata=NULL;
@@ -276,42 +389,144 @@ const char* ERR_BAM_SORT="\nError: the input alignment file is not sorted!\n";
 if (ballgown)
  Ballgown_setupFiles(f_tdata, f_edata, f_idata, f_e2t, f_i2t);
 #ifndef NOTHREADS
- GThread* threads=new GThread[num_cpus];
- GPVec<BundleData> bundleQueue(false);
- BundleData* bundles=new BundleData[num_cpus+1]; //extra one being prepared while all others are processed
- dataClear.setCapacity(num_cpus+1);
- for (int b=0;b<num_cpus;b++) {
-	 threads[b].kickStart(workerThread, (void*) &bundleQueue);
-	 bundles[b+1].idx=b+1;
-	 dataClear.Push(b);
-   }
- BundleData* bundle = &(bundles[num_cpus]);
+ bam_index_t* bam_idx=NULL;
+ if (regionMode && bamreader==NULL) {
+	 GMessage("Warning: --regions requires BAM input, ignored for the read digest %s.\n",
+			 bamfname.chars());
+	 regionMode=false;
+ }
+ if (regionMode) {
+	 if (verbose) {
+		 printTime(stderr);
+		 GMessage(" Loading BAM index..\n");
+	 }
+	 bam_idx=GBamReader::loadIndex(bamfname.chars());
+	 if (bam_idx==NULL) {
+		 GMessage("Warning: no index could be loaded or built for %s, --regions ignored.\n",
+				 bamfname.chars());
+		 regionMode=false;
+	 }
+ }
+ if (regionMode) {
+	 assembleRegions(*bamreader, bam_idx, refguides, bamfname);
+	 bam_index_destroy(bam_idx);
+ }
+ else {
+	 //BGZF inflate is the bulk of the input work, spread it over the CPUs
+	 if (num_cpus>1 && bamreader) bamreader->setReadAhead(num_cpus);
+	 //decode the BAM records in their own thread, overlapping with bundle building
+	 GAlnPrefetch* prefetch=NULL;
+	 if (decodeRing>0 && bamreader) prefetch=new GAlnPrefetch(*alnsrc, decodeRing);
+	 GThread* threads=new GThread[num_cpus];
+	 //one bundle for each worker thread, and the ones loaded ahead of them
+	 int numbundles=num_cpus+prefetchBundles;
+	 BundleData* bundles=new BundleData[numbundles];
+	 bundleQueue.init(numbundles, memLimit);
+	 for (int b=0;b<numbundles;b++) bundles[b].idx=b;
+	 outputWriter.start();
+	 for (int t=0;t<num_cpus;t++)
+		 threads[t].kickStart(workerThread, (void*) &bundleQueue);
+	 for (int b=0;b<numbundles-1;b++) bundleQueue.release(b);
+	 bundleReads(prefetch ? *prefetch : *alnsrc, refguides, alncounts, bundles, &(bundles[numbundles-1]), NULL);
+	 delete prefetch;
+	 for (int t=0;t<num_cpus;t++)
+		 threads[t].join();
+	 outputWriter.finish();
+	 delete[] threads;
+	 delete[] bundles;
+ }
+ if (verbose) {
+   printTime(stderr);
+   GMessage(" All threads finished.\n");
+ }
 #else
  BundleData bundles[1];
- BundleData* bundle = &(bundles[0]);
+ bundleReads(*alnsrc, refguides, alncounts, bundles, &(bundles[0]), NULL);
+ if (verbose) {
+    printTime(stderr);
+    GMessage(" Done.\n");
+ }
+#endif
+
+ delete alnsrc;
+ if (bamreader) {
+	 bamreader->bclose();
+	 delete bamreader;
+ }
+ //if (f_out && f_out!=stdout) fclose(f_out);
+ fclose(f_out);
+
+ // write the FPKMs
+
+ if(verbose) {
+	 GMessage("Total count of aligned fragments: %llu\n",Num_Fragments);
+	 //GMessage("Fragment length:%llu\n",Frag_Len);
+	 GMessage("Average fragment length:%g\n",(float)Frag_Len/Num_Fragments);
+ }
+
+ f_out=stdout;
+ if(outfname!="stdout") {
+	 f_out=fopen(outfname.chars(), bgzfOutput ? "wb" : "w");
+	 if (f_out==NULL) GError("Error creating output file %s\n", outfname.chars());
+ }
+ FILE* t_out=fopen(tmpfname.chars(),"rb");
+ if (t_out==NULL) {
+	 fclose(f_out);
+	 GError("No temporary file %s present!\n",tmpfname.chars());
+ }
+ writeGTF(t_out, refguides_RC_Data);
+ fclose(t_out);
+ fclose(f_out);
+ remove(tmpfname.chars());
+
+ //lastly, for ballgown, rewrite the tdata file with updated cov and fpkm
+ if (ballgown) {
+	 rc_writeRC(refguides_RC_Data, refguides_RC_exons, refguides_RC_introns,
+			 f_tdata, f_edata, f_idata, f_e2t, f_i2t);
+ }
+
+ gffnames_unref(gseqNames); //deallocate names collection
+
+
+#ifdef GMEMTRACE
+ if(verbose) GMessage(" Max bundle memory: %6.1fMB for bundle %s\n", maxMemRS/1024, maxMemBundle.chars());
 #endif
- GBamRecord* brec=NULL;
+} // -- END main
+
+//read the alignments and group them into bundles; the bundles are queued
+//for the worker threads, or processed right away by the calling thread
+//in region mode (region!=NULL); the reads are only appended to the bundle
+//here, processBundle() adds them to the bundle data
+void bundleReads(GAlnSource& alnsrc, GVec<GRefData>& refguides, GVec<int>& alncounts,
+		BundleData* bundles, BundleData* bundle, GRegionTask* region) {
+ //my @guides=(); //set of annotation transcript for the current locus
+ GList<GffObj>* guides=NULL; //list of transcripts on a specific chromosome
+
+ int currentstart=0, currentend=0;
+ int ng_start=0;
+ int ng_end=-1;
+ int ng=0;
+ GStr lastref;
+ int lastref_id=-1; //last seen gseq_id
+ // int ncluster=0; used it for debug purposes only
+
+ GBamRecord* brec=new GBamRecord(); //reused for every alignment
  bool more_alns=true;
  int prev_pos=0;
  while (more_alns) {
 	 bool chr_changed=false;
 	 int pos=0;
 	 const char* rname=NULL;
-	 char strand=0;
 	 char xstrand=0;
 	 int nh=1;
 	 int hi=0;
 	 int gseq_id=lastref_id;  //current chr id
 	 bool new_bundle=false;
-	 delete brec;
-	 if ((brec=bamreader.next())!=NULL) {
-		 if (brec->isUnmapped()) continue;
-		 rname=brec->refName();
-		 if (rname==NULL) GError("Error: cannot retrieve target seq name from BAM record!\n");
+	 if (alnsrc.next(*brec, rname, nh, hi, xstrand)) {
 		 pos=brec->start; //BAM is 0 based, but GBamRecord makes it 1-based
 		 chr_changed=(lastref.is_empty() || lastref!=rname);
 		 if (chr_changed) {
-			 gseq_id=gseqNames->gseqs.addName(rname);
+			 gseq_id=region ? region->gseq_id : gseqNames->gseqs.addName(rname);
 			 if (alncounts.Count()<=gseq_id) {
 				 alncounts.Resize(gseq_id+1, 0);
 			 }
@@ -321,12 +536,7 @@ if (ballgown)
 		 if (pos<prev_pos) GError(ERR_BAM_SORT);
 		 alncounts[gseq_id]++;
 		 prev_pos=pos;
-		 xstrand=brec->spliceStrand();
-		 if (xstrand=='+') strand=1;
-		 else if (xstrand=='-') strand=-1;
-		 nh=brec->tag_int("NH");
 		 if (nh==0) nh=1;
-		 hi=brec->tag_int("HI");
 		 if (!chr_changed && currentend>0 && pos>currentend+(int)bundledist)
 			   new_bundle=true;
 	 }
@@ -335,8 +545,8 @@ if (ballgown)
 		 new_bundle=true; //fake a new start (end of last bundle)
 	 }
 	 if (new_bundle || chr_changed) {
-		 hashread.Clear();
-		 if (bundle->readlist.Count()>0) { // process reads in previous bundle
+		 alnsrc.newBundle();
+		 if (bundle->rreads.Count()>0) { // process reads in previous bundle
 			 if (guides && ng_end>=ng_start) {
 				 for (int gi=ng_start;gi<=ng_end;gi++)
 					 bundle->keepguides.Add((*guides)[gi]);
@@ -347,34 +557,24 @@ if (ballgown)
 				bundle->rc_data->setupFiles(f_tdata, f_edata, f_idata, f_e2t, f_i2t);
 			}*/
 			bundle->getReady(currentstart, currentend);
+			if (region) { //region mode: this thread processes its own bundles
+				processBundle(bundle, region);
+			}
+			else {
 #ifndef NOTHREADS
-			//push this in the bundle queue, where it'll be picked up by the threads
-			DBGPRINT2("##> Locking queueMutex to push loaded bundle into the queue (bundle.start=%d)\n", bundle->start);
-			queueMutex.lock();
-			bundleQueue.Push(bundle);
-			bundleWork |= 0x02; //set bit 1
-			int qCount=bundleQueue.Count();
-			queueMutex.unlock();
-			do {
-			     waitForThreads();
-			     DBGPRINT("##> NOTIFY any thread...\n");
-			     haveBundles.notify_one();
-			     //this_thread::sleep_for(chrono::milliseconds(1));
-			     sleep(0);
-			} while (!queuePopped(bundleQueue, qCount));
+				//push this in the bundle queue, where it'll be picked up by the threads
+				DBGPRINT2("##> Pushing loaded bundle into the queue (bundle.start=%d)\n", bundle->start);
+				bundleQueue.push(bundle);
 #else //no threads
-			Num_Fragments+=bundle->num_fragments;
-			Frag_Len+=bundle->frag_len;
-			processBundle(bundle);
+				processBundle(bundle);
 #endif
+			}
 			// ncluster++; used it for debug purposes only
 		 } //have alignments to process
 		 else { //no read alignments in this bundle?
 			bundle->Clear();
 #ifndef NOTHREADS
-	dataMutex.lock();
-	dataClear.Push(bundle->idx);
-	dataMutex.unlock();
+	if (region==NULL) bundleQueue.release(bundle->idx);
 #endif
 		 }
 
@@ -395,6 +595,7 @@ if (ballgown)
 		 }
 
 		 if (!more_alns) {
+				if (region) break;
 				if (verbose) {
 #ifndef NOTHREADS
 						GLockGuard<GFastMutex> lock(logMutex);
@@ -403,17 +604,18 @@ if (ballgown)
 					GMessage(" %llu aligned fragments found.\n", Num_Fragments);
 					//GMessage(" Done reading alignments.\n");
 				}
-			 noMoreBundles();
+#ifndef NOTHREADS
+			 bundleQueue.finish();
+#endif
 			 break;
 		 }
 #ifndef NOTHREADS
-		 int new_bidx=waitForData(bundles);
-		 if (new_bidx<0) {
-			 //should never happen!
-			 GError("Error: waitForData() returned invalid bundle index(%d)!\n",new_bidx);
-			 break;
+		 if (region==NULL) {
+			 bundle=&(bundles[bundleQueue.acquire()]);
+			 bundle->status=BUNDLE_STATUS_LOADING;
 		 }
-		 bundle=&(bundles[new_bidx]);
+#else
+		 bundle=&(bundles[0]); //the single bundle is reloaded after each processBundle()
 #endif
 		 currentstart=pos;
 		 currentend=brec->end;
@@ -428,7 +630,7 @@ if (ballgown)
 					 currentstart=(*guides)[ng_ovlstart]->start;
 				 if (currentend<(int)(*guides)[ng_ovlstart]->end)
 					 currentend=(*guides)[ng_ovlstart]->end;
-				 if (ballgown) bundle->rc_store_t((*guides)[ng_ovlstart]);
+				 if (ballgown) bundle->rcguides.Add((*guides)[ng_ovlstart]);
 				 ng_ovlstart++;
 			 }
 			 if (ng_ovlstart>ng_start) ng_end=ng_ovlstart-1;
@@ -459,7 +661,7 @@ if (ballgown)
 				 while (ng_end+1<ng && (int)(*guides)[ng_end+1]->start<=currentend) {
 					 ng_end++;
 					 //more transcripts overlapping this bundle
-					 if (ballgown) bundle->rc_store_t((*guides)[ng_end]);
+					 if (ballgown) bundle->rcguides.Add((*guides)[ng_end]);
 					 if(currentend<(int)(*guides)[ng_end]->end) {
 						 currentend=(*guides)[ng_end]->end;
 						 cend_changed=true;
@@ -468,12 +670,7 @@ if (ballgown)
 			 } while (cend_changed);
 		 }
 	 } //adjusted currentend and checked for overlapping reference transcripts
-     bool ref_overlap=false;
-	 if (ballgown && bundle->rc_data) ref_overlap=bundle->rc_count_hit(*brec, xstrand, nh);
-	 countRead(*bundle, *brec, hi);
-	 if (!ballgown || ref_overlap) {
-	    processRead(currentstart, currentend, *bundle, hashread, *brec, strand, nh, hi);
-	 }
+	 bundle->addRead(*brec, xstrand, nh, hi, currentend, alnsrc.mateLink());
    //update current end to be at least as big as the start of the read pair in the fragment?? -> maybe not because then I could introduce some false positives with paired reads mapped badly
 
 	 /*
@@ -488,95 +685,8 @@ if (ballgown)
 	 */
  } //for each read alignment
 
- //cleaning up
  delete brec;
- bamreader.bclose();
-#ifndef NOTHREADS
- for (int t=0;t<num_cpus;t++)
-	 threads[t].join();
- if (verbose) {
-   printTime(stderr);
-   GMessage(" All threads finished.\n");
- }
- delete[] threads;
- delete[] bundles;
-#else
- if (verbose) {
-    printTime(stderr);
-    GMessage(" Done.\n");
- }
-#endif
-
- //if (f_out && f_out!=stdout) fclose(f_out);
- fclose(f_out);
-
- // write the FPKMs
-
- if(verbose) {
-	 GMessage("Total count of aligned fragments: %llu\n",Num_Fragments);
-	 //GMessage("Fragment length:%llu\n",Frag_Len);
-	 GMessage("Average fragment length:%g\n",(float)Frag_Len/Num_Fragments);
- }
-
- f_out=stdout;
- if(outfname!="stdout") {
-	 f_out=fopen(outfname.chars(), "w");
-	 if (f_out==NULL) GError("Error creating output file %s\n", outfname.chars());
- }
- FILE* t_out=fopen(tmpfname.chars(),"rt");
- if (t_out!=NULL) {
-	 char* linebuf=NULL;
-	 int linebuflen=5000;
-     GMALLOC(linebuf, linebuflen);
-	 int nl;
-	 int tlen;
-	 float tcov;
-	 float fpkm;
-	 float calc_fpkm;
-	 int t_id;
-	 while(fgetline(linebuf,linebuflen,t_out)) {
-		 sscanf(linebuf,"%d %d %d %g %g", &nl, &tlen, &t_id, &fpkm, &tcov);
-		 calc_fpkm=tcov*1000000000/Frag_Len;
-		 if (ballgown && t_id>0) {
-			 refguides_RC_Data[t_id-1]->fpkm=calc_fpkm;
-			 refguides_RC_Data[t_id-1]->cov=tcov;
-		 }
-		 for(int i=0;i<nl;i++) {
-			 fgetline(linebuf,linebuflen,t_out);
-			 if(!i) {
-				 //linebuf[strlen(line)-1]='\0';
-				 fprintf(f_out,"%s",linebuf);
-				 fprintf(f_out,"FPKM \"%.6f\";",calc_fpkm);
-				 //fprintf(f_out,"FPKM \"%.6f\"; calculated_FPKM \"%.6f\";",tcov*1000000000/Frag_Len,fpkm*1000000000/(Num_Fragments*tlen));
-				 //fprintf(f_out,"flen \"%.6f\"; FPKM \"%.6f\";",fpkm,fpkm*1000000000/Num_Fragments);
-				 fprintf(f_out,"\n");
-			 }
-			 else fprintf(f_out,"%s\n",linebuf);
-		 }
-	 }
-	 fclose(f_out);
-	 fclose(t_out);
-	 GFREE(linebuf);
-	 remove(tmpfname.chars());
- }
- else {
-	 fclose(f_out);
-	 GError("No temporary file %s present!\n",tmpfname.chars());
- }
-
- //lastly, for ballgown, rewrite the tdata file with updated cov and fpkm
- if (ballgown) {
-	 rc_writeRC(refguides_RC_Data, refguides_RC_exons, refguides_RC_introns,
-			 f_tdata, f_edata, f_idata, f_e2t, f_i2t);
- }
-
- gffnames_unref(gseqNames); //deallocate names collection
-
-
-#ifdef GMEMTRACE
- if(verbose) GMessage(" Max bundle memory: %6.1fMB for bundle %s\n", maxMemRS/1024, maxMemBundle.chars());
-#endif
-} // -- END main
+}
 
 //----------------------------------------
 char* sprintTime() {
@@ -632,6 +742,41 @@ GStr Process_Options(GArgs* args) {
 		   num_cpus=s.asInt();
 		   if (num_cpus<=0) num_cpus=1;
 	 }
+	 regionMode=(args->getOpt("regions")!=NULL);
+	 digestfname=args->getOpt("digest");
+	 bgzfOutput=(args->getOpt("bgzf")!=NULL);
+	 queryRange=args->getOpt("query");
+	 s=args->getOpt("decode-ring");
+	 if (!s.is_empty()) {
+		 decodeRing=s.asInt();
+		 if (decodeRing<0) decodeRing=0;
+	 }
+	 s=args->getOpt("prefetch");
+	 if (!s.is_empty()) {
+		 prefetchBundles=s.asInt();
+		 if (prefetchBundles<1) prefetchBundles=1;
+	 }
+	 s=args->getOpt("mem-limit");
+	 if (!s.is_empty()) {
+		 char* suffix=NULL;
+		 double m=strtod(s.chars(), &suffix);
+		 if (suffix==s.chars() || m<0) GError("Error: invalid --mem-limit value (%s)\n", s.chars());
+		 if (*suffix) { //only a single K, M or G may follow the number
+			 char u=toupper(*suffix);
+			 if (u=='K') m*=1024.0;
+			 else if (u=='M') m*=1024.0*1024;
+			 else if (u=='G') m*=1024.0*1024*1024;
+			 else GError("Error: invalid --mem-limit value (%s)\n", s.chars());
+			 if (suffix[1]) GError("Error: invalid --mem-limit value (%s)\n", s.chars());
+		 }
+		 memLimit=(size_t)m;
+	 }
+#ifdef NOTHREADS
+	 if (regionMode) {
+		 GMessage("Warning: --regions requires thread support, ignored.\n");
+		 regionMode=false;
+	 }
+#endif
 
 	 s=args->getOpt('a');
 	 if (!s.is_empty()) junctionsupport=s.asInt();
@@ -657,6 +802,7 @@ GStr Process_Options(GArgs* args) {
 	 out_dir="./";
 	 if (!tmpfname.is_empty() && tmpfname!="-") {
 		 outfname=tmpfname;
+		 if (bgzfOutput && !outfname.endsWith(".gz")) outfname+=".gz";
 		 int pidx=outfname.rindex('/');
 		 if (pidx>=0) //path given
 			 out_dir=outfname.substr(0,pidx+1);
@@ -674,7 +820,7 @@ GStr Process_Options(GArgs* args) {
 		 }
 	 }
 	 tmpfname+=".tmp";
-	 f_out=fopen(tmpfname.chars(), "w");
+	 f_out=fopen(tmpfname.chars(), "wb");
 	 if (f_out==NULL) GError("Error creating output file %s\n", tmpfname.chars());
 
      /*
@@ -746,7 +892,6 @@ GStr Process_Options(GArgs* args) {
 			 if(!guided) GError("Error: invalid -C usage, GFF reference not given (-G option required).\n");
 			 c_out=fopen(s.chars(), "w");
 			 if (c_out==NULL) GError("Error creating output file %s\n", s.chars());
-			 num_cpus=1;
 		 }
 	 }
 
@@ -761,44 +906,6 @@ GStr Process_Options(GArgs* args) {
 	 return(s);
 }
 
-//---------------
-bool moreBundles() { //getter (interogation)
-	bool v=true;
-#ifndef NOTHREADS
-  GLockGuard<GFastMutex> lock(bamReadingMutex);
-#endif
-  v = ! NoMoreBundles;
-  return v;
-}
-
-void noMoreBundles() { //setter
-#ifndef NOTHREADS
-		bamReadingMutex.lock();
-		NoMoreBundles=true;
-		bamReadingMutex.unlock();
-		queueMutex.lock();
-		bundleWork &= ~(int)0x01; //clear bit 0;
-		queueMutex.unlock();
-		bool areThreadsWaiting=true;
-		do {
-		  waitMutex.lock();
-		   areThreadsWaiting=(threadsWaiting>0);
-		  waitMutex.unlock();
-		  if (areThreadsWaiting) {
-		    DBGPRINT("##> NOTIFY ALL workers: no more data!\n");
-		    haveBundles.notify_all();
-		    this_thread::sleep_for(chrono::milliseconds(30));
-		    waitMutex.lock();
-		     areThreadsWaiting=(threadsWaiting>0);
-		    waitMutex.unlock();
-		    this_thread::sleep_for(chrono::milliseconds(30));
-		  }
-		} while (areThreadsWaiting); //paranoid check that all threads stopped waiting
-#else
-	  NoMoreBundles=true;
-#endif
-}
-
 /*
 void processBundle1stPass(BundleData* bundle) {
 	// code executed on bundle data after 1st pass
@@ -871,7 +978,30 @@ void processBundle(BundleData* bundle) {
 
 */
 
-void processBundle(BundleData* bundle) {
+void processBundle(BundleData* bundle, GRegionTask* region) {
+	//the reads, junctions and graph data of this bundle are allocated
+	//from its arena
+	CBundleArena::setCurrent(&bundle->arena);
+	processBundleReads(*bundle);
+	if (bundle->readlist.Count()==0) { //no read alignments kept for this bundle
+		bundle->Clear();
+		CBundleArena::setCurrent(NULL);
+#ifndef NOTHREADS
+		if (region==NULL) printInOrder(bundle, 0);
+#endif
+		return;
+	}
+	if (region) {
+		region->num_fragments+=bundle->num_fragments;
+		region->frag_len+=bundle->frag_len;
+	}
+	else {
+#ifndef NOTHREADS
+		GLockGuard<GFastMutex> lock(countMutex);
+#endif
+		Num_Fragments+=bundle->num_fragments;
+		Frag_Len+=bundle->frag_len;
+	}
 	if (verbose) {
 	#ifndef NOTHREADS
 			GLockGuard<GFastMutex> lock(logMutex);
@@ -896,12 +1026,18 @@ void processBundle(BundleData* bundle) {
 		//rc_write_counts(refname.chars(), *bundleData);
 		rc_update_exons(*(bundle->rc_data));
 	}
-	if (bundle->pred.Count()>0) {
-#ifndef NOTHREADS
-		GLockGuard<GFastMutex> lock(printMutex);
-#endif
-		GeneNo=printResults(bundle, ngenes, GeneNo, bundle->refseq);
+	if (region) { //region output is private to this thread
+		if (bundle->pred.Count()>0)
+			region->geneno=printResults(bundle, ngenes, region->geneno, bundle->refseq, region->fout);
+		if (region->covout) printCovered(bundle, region->covout);
+	}
+#ifdef NOTHREADS
+	else {
+		if (bundle->pred.Count()>0)
+			GeneNo=printResults(bundle, ngenes, GeneNo, bundle->refseq, f_out);
+		if (c_out) printCovered(bundle, c_out);
 	}
+#endif
 	if (verbose) {
 	#ifndef NOTHREADS
 			GLockGuard<GFastMutex> lock(logMutex);
@@ -920,90 +1056,484 @@ void processBundle(BundleData* bundle) {
 		    }
 	#endif
 	    }
-	bundle->Clear();
 #ifndef NOTHREADS
-	dataMutex.lock();
-	dataClear.Push(bundle->idx);
-	dataMutex.unlock();
+	if (region==NULL) {
+		CBundleArena::setCurrent(NULL);
+		printInOrder(bundle, ngenes);
+		return;
+	}
 #endif
+	bundle->Clear();
+	CBundleArena::setCurrent(NULL);
+}
+
+#ifndef NOTHREADS
+void printInOrder(BundleData* bundle, int ngenes) {
+	GBundleOutput out={bundle->seqno, bundle->idx, NULL, 0, 0, NULL, 0};
+	if (bundle->pred.Count()>0) {
+		CBundleArena::setCurrent(&bundle->arena);
+		FILE* fbuf=open_memstream(&out.buf, &out.len);
+		if (fbuf==NULL) GError("Error: could not open an output buffer!\n");
+		out.ngenes=printResults(bundle, ngenes, 0, bundle->refseq, fbuf);
+		fclose(fbuf);
+		CBundleArena::setCurrent(NULL);
+	}
+	if (bundle->covguides.Count()>0) {
+		FILE* fbuf=open_memstream(&out.cbuf, &out.clen);
+		if (fbuf==NULL) GError("Error: could not open an output buffer!\n");
+		printCovered(bundle, fbuf);
+		fclose(fbuf);
+	}
+	bundle->Clear();
+	outputWriter.put(out);
+}
+
+void GOutputWriter::start() {
+	setvbuf(f_out, NULL, _IOFBF, 1<<20); //large writes; nothing was written yet
+	thread.kickStart(writer, (void*) this);
+}
+
+void GOutputWriter::put(GBundleOutput& out) {
+	mutex.lock();
+	outputs.Add(out);
+	mutex.unlock();
+	haveOutput.notify_one();
 }
 
+void GOutputWriter::finish() {
+	mutex.lock();
+	done=true;
+	mutex.unlock();
+	haveOutput.notify_one();
+	thread.join();
+}
+
+void GOutputWriter::writer(GThreadData& td) {
+	GOutputWriter* w=(GOutputWriter*)td.udata;
+	GVec<GBundleOutput> pending; //outputs waiting for their turn
+	int next=0; //input order of the next output to write
+	while (true) {
+		w->mutex.lock();
+		while (w->outputs.Count()==0 && !w->done) w->haveOutput.wait(w->mutex);
+		bool done=(w->outputs.Count()==0);
+		pending.Add(w->outputs);
+		w->outputs.Clear();
+		w->mutex.unlock();
+		if (done) break;
+		//write the outputs whose turn came
+		for (int i=0;i<pending.Count();) {
+			if (pending[i].seqno!=next) { i++; continue; }
+			GBundleOutput& out=pending[i];
+			shift_transcripts(out.buf, out.len, GeneNo);
+			fwrite(out.buf, 1, out.len, f_out);
+			free(out.buf);
+			if (out.clen>0) fwrite(out.cbuf, 1, out.clen, c_out);
+			free(out.cbuf);
+			GeneNo+=out.ngenes;
+			bundleQueue.release(out.bidx);
+			pending.Delete(i);
+			next++;
+			i=0;
+		}
+	}
+}
+#endif
+
 #ifndef NOTHREADS
 
-bool waitForThreads() {
-	bool noneWaiting=true;
-	DBGPRINT("##> waiting for workers to enter wait state..\n");
-	while (noneWaiting) {
-	  waitMutex.lock();
-	  noneWaiting=(threadsWaiting<1);
-	  waitMutex.unlock();
-	  if (noneWaiting)
-	    this_thread::sleep_for(chrono::milliseconds(30));
-	}
- DBGPRINT("##> there are workers ready now.\n");
- return(!noneWaiting);
+void GBundleQueue::init(int numbundles, size_t maxmem) {
+	cap=numbundles;
+	memlimit=maxmem;
+	GMALLOC(ring, cap*sizeof(BundleData*));
+	GCALLOC(bmem, cap*sizeof(size_t));
+	clear.setCapacity(cap);
 }
 
+void GBundleQueue::push(BundleData* bundle) {
+	size_t mem=memlimit ? bundle->footprint() : 0;
+	mutex.lock();
+	//a bundle larger than the budget is still processed, but on its own
+	while (memlimit && inuse>0 && inuse+mem>memlimit) haveClear.wait(mutex);
+	if (count==cap) GError("Error: bundle queue overflow!\n"); //should never happen
+	ring[(head+count)%cap]=bundle;
+	count++;
+	bundle->seqno=pushed++;
+	bmem[bundle->idx]=mem;
+	inuse+=mem;
+	mutex.unlock();
+	haveBundles.notify_one();
+}
+
+BundleData* GBundleQueue::pop() {
+	BundleData* bundle=NULL;
+	GLockGuard<GMutex> lock(mutex);
+	while (true) {
+		//finishing the bundles already started comes first
+		CGraphTasks* tasks=NULL;
+		CGraphTask* task=NULL;
+		for (int i=0;i<shared.Count() && task==NULL;i++) {
+			tasks=shared[i];
+			task=tasks->claim();
+		}
+		if (task) {
+			mutex.unlock();
+			task->run();
+			tasks->finished();
+			mutex.lock();
+			continue;
+		}
+		if (count>0) {
+			bundle=ring[head];
+			head=(head+1)%cap;
+			count--;
+			break;
+		}
+		if (done && shared.Count()==0) break;
+		haveBundles.wait(mutex);
+	}
+	return bundle;
+}
+
+void shareGraphTasks(CGraphTasks* tasks) {
+	bundleQueue.mutex.lock();
+	bundleQueue.shared.Add(tasks);
+	bundleQueue.mutex.unlock();
+	bundleQueue.haveBundles.notify_all();
+}
+
+void unshareGraphTasks(CGraphTasks* tasks) {
+	bundleQueue.mutex.lock();
+	bundleQueue.shared.RemovePtr(tasks);
+	bool last=(bundleQueue.done && bundleQueue.shared.Count()==0);
+	bundleQueue.mutex.unlock();
+	if (last) bundleQueue.haveBundles.notify_all(); //let the idle workers exit
+}
+
+void GBundleQueue::finish() {
+	mutex.lock();
+	done=true;
+	mutex.unlock();
+	DBGPRINT("##> NOTIFY ALL workers: no more data!\n");
+	haveBundles.notify_all();
+}
+
+void GBundleQueue::release(int bidx) {
+	mutex.lock();
+	clear.Push(bidx);
+	inuse-=bmem[bidx];
+	bmem[bidx]=0;
+	mutex.unlock();
+	haveClear.notify_one();
+}
+
+int GBundleQueue::acquire() {
+	GLockGuard<GMutex> lock(mutex);
+	while (clear.Count()==0) haveClear.wait(mutex);
+	return clear.Pop();
+}
 
 void workerThread(GThreadData& td) {
-	GPVec<BundleData>* bundleQueue = (GPVec<BundleData>*)td.udata;
-	//wait for a ready bundle in the queue, until there is no hope for incoming bundles
+	GBundleQueue* queue=(GBundleQueue*)td.udata;
+	//process the queued bundles until there is no hope for incoming bundles
 	DBGPRINT2("---->> Thread%d starting..\n",td.thread->get_id());
-	DBGPRINT2("---->> Thread%d locking queueMutex..\n",td.thread->get_id());
-	queueMutex.lock(); //enter wait-for-notification loop
-	while (bundleWork) {
-		DBGPRINT3("---->> Thread%d: waiting.. (queue len=%d)\n",td.thread->get_id(), bundleQueue->Count());
-		waitMutex.lock();
-		 threadsWaiting++;
-		waitMutex.unlock();
-		haveBundles.wait(queueMutex);
-		waitMutex.lock();
-		 if (threadsWaiting>0) threadsWaiting--;
-		waitMutex.unlock();
-		DBGPRINT3("---->> Thread%d: awakened! (queue len=%d)\n",td.thread->get_id(),bundleQueue->Count());
-		BundleData* readyBundle=NULL;
-		if ((bundleWork & 0x02)!=0 && (readyBundle=bundleQueue->Pop())!=NULL) { //is bit 1 set?
-			 //while ()!=NULL) {
-				if (bundleQueue->Count()==0)
-					 bundleWork &= ~(int)0x02; //clear bit 1 (queue is empty)
-				Num_Fragments+=readyBundle->num_fragments;
-				Frag_Len+=readyBundle->frag_len;
-				queueMutex.unlock();
-				processBundle(readyBundle);
-				DBGPRINT2("---->> Thread%d processed bundle, now locking back queueMutex\n", td.thread->get_id());
-				queueMutex.lock();
-				DBGPRINT2("---->> Thread%d locked back queueMutex\n", td.thread->get_id());
-			// }
-		}
-	} //while there is reason to live
-	queueMutex.unlock();
+	BundleData* readyBundle=NULL;
+	while ((readyBundle=queue->pop())!=NULL) {
+		processBundle(readyBundle);
+		DBGPRINT2("---->> Thread%d processed bundle\n", td.thread->get_id());
+	}
 	DBGPRINT2("---->> Thread%d DONE.\n", td.thread->get_id());
 }
 
-bool queuePopped(GPVec<BundleData>& bundleQueue, int prevCount) {
-  int c;
-  queueMutex.lock();
-   c=bundleQueue.Count();
-  queueMutex.unlock();
-  DBGPRINT3("##> post-notification check: qlen is now %d (was %d)\n", c, prevCount);
-  return (c==0 || c<prevCount);
+//region mode: tasks are handed to the threads largest first,
+//their outputs are merged back in reference order
+struct GRegionQueue {
+	GPVec<GRegionTask> order; //tasks by decreasing size
+	int next; //next task in order to be assembled
+	GFastMutex mutex;
+	const char* bamfname;
+	bam_index_t* bam_idx;
+	GVec<int> gseq_ids; //gseqNames id for each BAM reference id
+	GVec<GRefData>* refguides;
+	GRegionQueue():order(false), next(0), mutex(), bamfname(NULL), bam_idx(NULL),
+			gseq_ids(), refguides(NULL) { }
+};
+
+uint64 regionLen(GRegionTask* r, bam_header_t* header) {
+	uint64 len=0;
+	for (int tid=r->tid_start;tid<r->tid_end;tid++) len+=header->target_len[tid];
+	return len;
 }
 
-//prepare the next free bundle for loading
-int waitForData(BundleData* bundles) {
-	int bidx=-1;
-	while (bidx<0) {
-	  dataMutex.lock();
-	  if (dataClear.Count()>0) {
-	    bidx=dataClear.Pop();
-	    bundles[bidx].status=BUNDLE_STATUS_LOADING;
-	    dataMutex.unlock();
-	    return bidx;
-	    }
-	  dataMutex.unlock();
-	  this_thread::sleep_for(chrono::milliseconds(20));
+bam_header_t* regionHeader=NULL; //for sorting the tasks
+
+int regionCmpBySize(const pointer p1, const pointer p2) {
+	uint64 l1=regionLen((GRegionTask*)p1, regionHeader);
+	uint64 l2=regionLen((GRegionTask*)p2, regionHeader);
+	if (l1!=l2) return (l1>l2) ? -1 : 1;
+	return ((GRegionTask*)p1)->tid_start - ((GRegionTask*)p2)->tid_start;
+}
+
+void regionThread(GThreadData& td) {
+	GRegionQueue* rq=(GRegionQueue*)td.udata;
+	GBamReader bamreader(rq->bamfname);
+	GBamSource bamsrc(bamreader);
+	BundleData bundle;
+	while (true) {
+		GRegionTask* region=NULL;
+		rq->mutex.lock();
+		if (rq->next<rq->order.Count()) region=rq->order[rq->next++];
+		rq->mutex.unlock();
+		if (region==NULL) break;
+		region->fout=fopen(region->tmpfname.chars(), "wb");
+		if (region->fout==NULL) GError("Error creating output file %s\n", region->tmpfname.chars());
+		if (c_out) {
+			region->covout=fopen(region->ctmpfname.chars(), "wb");
+			if (region->covout==NULL) GError("Error creating output file %s\n", region->ctmpfname.chars());
+		}
+		for (int tid=region->tid_start;tid<region->tid_end;tid++) {
+			GVec<int> alncounts;
+			region->gseq_id=rq->gseq_ids[tid];
+			bamreader.setRegion(rq->bam_idx, tid);
+			bundleReads(bamsrc, *(rq->refguides), alncounts, &bundle, &bundle, region);
+		}
+		fclose(region->fout);
+		region->fout=NULL;
+		if (region->covout) {
+			fclose(region->covout);
+			region->covout=NULL;
+		}
+	}
+}
+
+void assembleRegions(GBamReader& bamreader, bam_index_t* bam_idx,
+		GVec<GRefData>& refguides, GStr& bamfname) {
+	bam_header_t* header=bamreader.header();
+	GRegionQueue rq;
+	rq.bamfname=bamfname.chars();
+	rq.bam_idx=bam_idx;
+	rq.refguides=&refguides;
+	//all names are registered here as gseqNames is not thread-safe
+	uint64 total_len=0;
+	for (int tid=0;tid<header->n_targets;tid++) {
+		int gseq_id=gseqNames->gseqs.addName(header->target_name[tid]);
+		rq.gseq_ids.Add(gseq_id);
+		total_len+=header->target_len[tid];
+	}
+	//reference sequences are never split (bundles cannot span them),
+	//but small ones are grouped to keep the number of tasks reasonable
+	uint64 chunk_len=total_len/(num_cpus*16)+1;
+	GPVec<GRegionTask> tasks(true); //in reference order
+	uint64 len=0;
+	int tid_start=0;
+	for (int tid=0;tid<header->n_targets;tid++) {
+		len+=header->target_len[tid];
+		if (len>=chunk_len || tid==header->n_targets-1) {
+			GRegionTask* region=new GRegionTask(tid_start, tid+1);
+			region->tmpfname.format("%s.r%d", tmpfname.chars(), tasks.Count());
+			region->ctmpfname.format("%s.c%d", tmpfname.chars(), tasks.Count());
+			tasks.Add(region);
+			rq.order.Add(region);
+			tid_start=tid+1;
+			len=0;
+		}
+	}
+	regionHeader=header;
+	rq.order.Sort(regionCmpBySize);
+	if (verbose) {
+		printTime(stderr);
+		GMessage(" Assembling %d regions with %d threads..\n", tasks.Count(), num_cpus);
+	}
+	int nthreads=GMIN(num_cpus, tasks.Count());
+	GThread* threads=new GThread[nthreads];
+	for (int t=0;t<nthreads;t++)
+		threads[t].kickStart(regionThread, (void*) &rq);
+	for (int t=0;t<nthreads;t++)
+		threads[t].join();
+	delete[] threads;
+	//merge the region outputs in reference order, renumbering the genes
+	char* recbuf=NULL;
+	uint32_t recbuflen=0;
+	for (int i=0;i<tasks.Count();i++) {
+		GRegionTask* region=tasks[i];
+		FILE* r_out=fopen(region->tmpfname.chars(), "rb");
+		if (r_out==NULL) GError("Error: could not open region output %s!\n", region->tmpfname.chars());
+		CTrRecord rec;
+		while (fread(&rec, sizeof(CTrRecord), 1, r_out)==1) {
+			if (rec.reclen>recbuflen) {
+				recbuflen=rec.reclen;
+				GREALLOC(recbuf, recbuflen);
+			}
+			memcpy(recbuf, &rec, sizeof(CTrRecord));
+			uint32_t len=rec.reclen-sizeof(CTrRecord);
+			if (fread(recbuf+sizeof(CTrRecord), 1, len, r_out)!=len)
+				GError("Error: truncated region output %s!\n", region->tmpfname.chars());
+			shift_transcripts(recbuf, rec.reclen, GeneNo);
+			fwrite(recbuf, 1, rec.reclen, f_out);
+		}
+		fclose(r_out);
+		remove(region->tmpfname.chars());
+		if (c_out) {
+			r_out=fopen(region->ctmpfname.chars(), "rb");
+			if (r_out==NULL) GError("Error: could not open region output %s!\n", region->ctmpfname.chars());
+			char buf[65536];
+			size_t n;
+			while ((n=fread(buf, 1, sizeof(buf), r_out))>0)
+				fwrite(buf, 1, n, c_out);
+			fclose(r_out);
+			remove(region->ctmpfname.chars());
+		}
+		GeneNo+=region->geneno;
+		Num_Fragments+=region->num_fragments;
+		Frag_Len+=region->frag_len;
+	}
+	GFREE(recbuf);
+	if (verbose) {
+		printTime(stderr);
+		GMessage(" %llu aligned fragments found.\n", Num_Fragments);
+	}
+}
+
+#endif
+
+// rendering of the final GTF: the transcript records are split in chunks
+// of about GTF_CHUNK bytes, rendered in parallel (num_cpus at a time)
+// into memory buffers, then written in order
+#define GTF_CHUNK (1<<20)
+
+struct GTrChunk {
+	char* start; //first transcript record
+	char* end;
+	char* buf; //rendered GTF
+	size_t len;
+	uint64* pos; //for the GTF index: position of each transcript in buf
+	int poscap;
+};
+
+void renderChunk(GTrChunk& chunk, GOutBuf& out) {
+	uint64 base=out.tell();
+	int t=0;
+	for (char* p=chunk.start;p<chunk.end;t++) {
+		CTrRecord* rec=(CTrRecord*)p;
+		if (chunk.pos) chunk.pos[t]=out.tell()-base;
+		float tcov=transcript_cov(rec);
+		float calc_fpkm=tcov*1000000000/Frag_Len;
+		print_transcript_gtf(out, rec, calc_fpkm);
+		p+=rec->reclen;
+	}
+}
+
+//add the transcripts of a chunk written at position base to the GTF index
+void indexChunk(GTrChunk& chunk, GTFIndexWriter& idx, uint64 base) {
+	int t=0;
+	for (char* p=chunk.start;p<chunk.end;t++) {
+		CTrRecord* rec=(CTrRecord*)p;
+		idx.add(rec->refname(), rec->refnamelen, rec->start, rec->end,
+				rec->numexons+1, base+chunk.pos[t]);
+		p+=rec->reclen;
 	}
-	return -1; // should NEVER happen
 }
 
+#ifndef NOTHREADS
+void renderThread(GThreadData& td) {
+	GTrChunk* chunk=(GTrChunk*)td.udata;
+	GOutBuf out(NULL, GTF_CHUNK*4);
+	renderChunk(*chunk, out);
+	chunk->buf=out.detach(chunk->len);
+}
+#endif
+
+void writeGTF(FILE* t_out, GPVec<RC_ScaffData>& refguides_RC_Data) {
+	GOutBuf out(f_out);
+	GTFIndexWriter* idx=NULL;
+	if (bgzfOutput) {
+		out.setBgzf(num_cpus>1 ? num_cpus : 0);
+		if (outfname!="stdout") idx=new GTFIndexWriter();
+	}
+	fseeko(t_out, 0, SEEK_END);
+	size_t size=ftello(t_out);
+	fseeko(t_out, 0, SEEK_SET);
+	char* data=NULL;
+	if (size>0) {
+#ifndef __WIN32__
+		void* m=mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(t_out), 0);
+		if (m==MAP_FAILED) GError("Error: cannot map temporary file %s in memory\n", tmpfname.chars());
+		data=(char*)m;
+		madvise(data, size, MADV_SEQUENTIAL);
+#else
+		GMALLOC(data, size);
+		if (fread(data, 1, size, t_out)!=size) GError("Error: truncated temporary file %s\n", tmpfname.chars());
+#endif
+	}
+	char* end=data+size;
+	int nchunks=1;
+#ifndef NOTHREADS
+	nchunks=num_cpus;
+	GThread* threads=new GThread[nchunks];
+#endif
+	GTrChunk* chunks=NULL;
+	GCALLOC(chunks, nchunks*sizeof(GTrChunk));
+	char* p=data;
+	while (p<end) {
+		//split the next records in chunks; the Ballgown values are set
+		//along the way, in the order the transcripts are written
+		int n=0;
+		for (;n<nchunks && p<end;n++) {
+			GTrChunk& chunk=chunks[n];
+			chunk.start=p;
+			char* cend=p+GTF_CHUNK;
+			int numrecs=0;
+			while (p<end && p<cend) {
+				CTrRecord* rec=(CTrRecord*)p;
+				if (rec->reclen<sizeof(CTrRecord) || rec->reclen>(size_t)(end-p))
+					GError("Error: invalid temporary file %s\n", tmpfname.chars());
+				if (ballgown && rec->t_id>0) {
+					float tcov=transcript_cov(rec);
+					refguides_RC_Data[rec->t_id-1]->fpkm=tcov*1000000000/Frag_Len;
+					refguides_RC_Data[rec->t_id-1]->cov=tcov;
+				}
+				p+=rec->reclen;
+				numrecs++;
+			}
+			chunk.end=p;
+			if (idx && numrecs>chunk.poscap) {
+				chunk.poscap=numrecs;
+				GREALLOC(chunk.pos, numrecs*sizeof(uint64));
+			}
+		}
+#ifndef NOTHREADS
+		if (n>1) {
+			for (int i=0;i<n;i++)
+				threads[i].kickStart(renderThread, (void*) &chunks[i]);
+			for (int i=0;i<n;i++) {
+				threads[i].join();
+				if (idx) indexChunk(chunks[i], *idx, out.tell());
+				out.add(chunks[i].buf, chunks[i].len);
+				GFREE(chunks[i].buf);
+			}
+			continue;
+		}
 #endif
+		uint64 base=out.tell();
+		renderChunk(chunks[0], out);
+		if (idx) indexChunk(chunks[0], *idx, base);
+	}
+	for (int i=0;i<nchunks;i++) GFREE(chunks[i].pos);
+	GFREE(chunks);
+#ifndef NOTHREADS
+	delete[] threads;
+#endif
+	out.close();
+	if (idx) {
+		GStr idxfname(outfname);
+		idxfname+=GTFIDX_EXT;
+		idx->write(idxfname.chars(), out);
+		delete idx;
+	}
+	if (data) {
+#ifndef __WIN32__
+		munmap(data, size);
+#else
+		GFREE(data);
+#endif
+	}
+}
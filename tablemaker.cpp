@@ -3,6 +3,8 @@
 #include <numeric>
 
 extern GStr ballgown_dir;
+extern bool bgzfOutput;
+extern int num_cpus;
 
 int rc_cov_inc(int i) {
   return ++i;
@@ -48,7 +50,7 @@ void rc_updateExonCounts(const RC_Feature* exon, int nh) {
   if (nh<=1)  exon->ucount++;
 }
 
-bool BundleData::rc_count_hit(GBamRecord& brec, char strand, int nh) { //, int hi) {
+bool BundleData::rc_count_hit(CBundleRead& rd, char strand, int nh) { //, int hi) {
  if (rc_data==NULL) return false; //no ref transcripts available for this reads' region
  if (rc_data->tdata.Count()==0) return false; //nothing to do without transcripts
 
@@ -62,7 +64,7 @@ bool BundleData::rc_count_hit(GBamRecord& brec, char strand, int nh) { //, int h
    rc_data->lmin=gstart;
  }
  */
- if ((int)brec.end<rc_data->lmin || (int)brec.start>rc_data->rmax) {
+ if (rd.end<rc_data->lmin || rd.start>rc_data->rmax) {
 	 return false; //hit outside coverage area
  }
  /*
@@ -72,12 +74,13 @@ bool BundleData::rc_count_hit(GBamRecord& brec, char strand, int nh) { //, int h
  */
  vector<RC_Seg> rsegs;
  vector<RC_Seg> rintrons;
- for (int i=0;i<brec.exons.Count();i++) {
-	 rc_data->updateCov(strand, nh, brec.exons[i].start, brec.exons[i].len());
-	 rsegs.push_back(RC_Seg(brec.exons[i].start, brec.exons[i].end) );
+ GSeg* rexons=&(this->rexons[rd.exonidx]);
+ for (int i=0;i<rd.numexons;i++) {
+	 rc_data->updateCov(strand, nh, rexons[i].start, rexons[i].len());
+	 rsegs.push_back(RC_Seg(rexons[i].start, rexons[i].end) );
 	 if (i>0) {
 		 //add intron
-		 rintrons.push_back(RC_Seg(brec.exons[i-1].end+1, brec.exons[i].start-1));
+		 rintrons.push_back(RC_Seg(rexons[i-1].end+1, rexons[i].start-1));
 	 }
  }
  //now check rexons and rintrons with findExons() and findIntron()
@@ -135,7 +138,8 @@ FILE* rc_fwopen(const char* fname) {
  //fpath += "/";
  //fpath += fname;
  fpath += ".ctab";
- FILE* fh=fopen(fpath.chars(), "w");
+ if (bgzfOutput) fpath += ".gz";
+ FILE* fh=fopen(fpath.chars(), bgzfOutput ? "wb" : "w");
  if (fh==NULL) {
    fprintf(stderr, "Error: cannot create file %s\n",
 					fpath.chars());
@@ -177,14 +181,16 @@ void rc_frendel(const char* fname) {
 }
 
 void rc_write_f2t(FILE* fh, map<uint, set<uint> >& f2t) {
+  GOutBuf out(fh);
   for (map<uint, set<uint> >::iterator m=f2t.begin(); m!=f2t.end(); ++m) {
     uint f_id=(*m).first;
     set<uint>& tset = (*m).second;
     for (set<uint>::iterator it=tset.begin();it!=tset.end();++it) {
  	 uint t_id = *it;
- 	 fprintf(fh, "%u\t%u\n", f_id, t_id);
+ 	 out.addUInt(f_id).add('\t').addUInt(t_id).add('\n');
     }
   }
+  out.flush();
   fflush(fh);
 }
 
@@ -246,23 +252,42 @@ void rc_update_exons(RC_BundleData& rc) {
 }
 
 
+//a table writer, BGZF compressed with --bgzf
+static void rc_setupOut(GOutBuf& out) {
+  if (bgzfOutput) out.setBgzf(num_cpus>1 ? num_cpus : 0);
+}
+
 void rc_write_RCfeature( GPVec<RC_ScaffData>& rcdata, GPVec<RC_Feature>& features, FILE*& fdata, FILE*& f2t,
 		               bool is_exon=false) {
+  GOutBuf dout(fdata);
+  GOutBuf tout(f2t);
+  rc_setupOut(dout);
+  rc_setupOut(tout);
+  if (is_exon) {
+	dout.add("e_id\tchr\tstrand\tstart\tend\trcount\tucount\tmrcount\tcov\tcov_sd\tmcov\tmcov_sd\n");
+	tout.add("e_id\tt_id\n");
+  }
+  else {
+	dout.add("i_id\tchr\tstrand\tstart\tend\trcount\tucount\tmrcount\n");
+	tout.add("i_id\tt_id\n");
+  }
   for (int i=0;i<features.Count();++i) {
 	RC_Feature& f=*(features[i]);
 	const char* ref_name=rcdata[f.t_id-1]->scaff->getGSeqName();
+	//rcount and ucount were always printed with %d
+	dout.addUInt(f.id).add('\t').add(ref_name).add('\t').add(f.strand).add('\t');
+	dout.addInt(f.l).add('\t').addInt(f.r).add('\t').addInt((int)f.rcount).add('\t');
+	dout.addInt((int)f.ucount).add('\t').addFloat(f.mrcount, 2);
 	if (is_exon) {
-	  fprintf(fdata, "%u\t%s\t%c\t%d\t%d\t%d\t%d\t%.2f\t%.4f\t%.4f\t%.4f\t%.4f\n",
-		  f.id, ref_name, f.strand, f.l, f.r, f.rcount,
-		  f.ucount, f.mrcount, f.avg, f.stdev, f.mavg, f.mstdev);
-	}
-    else { //introns
-	  fprintf(fdata,"%u\t%s\t%c\t%d\t%d\t%d\t%d\t%.2f\n",f.id, ref_name,
-		  f.strand, f.l, f.r, f.rcount, f.ucount, f.mrcount);
+	  dout.add('\t').addFloat(f.avg, 4).add('\t').addFloat(f.stdev, 4);
+	  dout.add('\t').addFloat(f.mavg, 4).add('\t').addFloat(f.mstdev, 4);
 	}
+	dout.add('\n');
   // f2t -------
-	fprintf(f2t, "%u\t%u\n", f.id, f.t_id);
+	tout.addUInt(f.id).add('\t').addUInt(f.t_id).add('\n');
   } //for each feature
+  dout.close();
+  tout.close();
   fclose(fdata);
   fclose(f2t);
 }
@@ -279,6 +304,9 @@ void rc_writeRC(GPVec<RC_ScaffData>& RC_data,
 		FILE* &f_tdata, FILE* &f_edata, FILE* &f_idata,
         FILE* &f_e2t, FILE* &f_i2t) {
 
+ GOutBuf tout(f_tdata);
+ rc_setupOut(tout);
+ tout.add("t_id\tchr\tstrand\tstart\tend\tt_name\tnum_exons\tlength\tgene_id\tgene_name\tcov\tFPKM\n");
  for (int t=0;t<RC_data.Count();++t) {
   //File: t_data.ctab
   //t_id tname chr strand start end num_exons gene_id gene_name cufflinks_cov cufflinks_fpkm
@@ -286,11 +314,14 @@ void rc_writeRC(GPVec<RC_ScaffData>& RC_data,
    const char* refname = sd.scaff->getGSeqName();
    const char* genename= sd.scaff->getGeneName();
    if (genename==NULL) genename=".";
-   fprintf(f_tdata, "%u\t%s\t%c\t%d\t%d\t%s\t%d\t%d\t%s\t%s\t%f\t%f\n",
-	  sd.t_id, refname, sd.strand, sd.l, sd.r, sd.scaff->getID(),
-	  sd.num_exons, sd.eff_len, sd.scaff->getGeneID(),
-	  genename, sd.cov, sd.fpkm);
+   //"%u\t%s\t%c\t%d\t%d\t%s\t%d\t%d\t%s\t%s\t%f\t%f\n"
+   tout.addUInt(sd.t_id).add('\t').add(refname).add('\t').add(sd.strand).add('\t');
+   tout.addInt(sd.l).add('\t').addInt(sd.r).add('\t').add(sd.scaff->getID()).add('\t');
+   tout.addInt(sd.num_exons).add('\t').addInt(sd.eff_len).add('\t');
+   tout.add(sd.scaff->getGeneID()).add('\t').add(genename).add('\t');
+   tout.addFloat(sd.cov).add('\t').addFloat(sd.fpkm).add('\n');
  }//for each transcript
+ tout.close();
  //fflush(f_tdata);
  fclose(f_tdata);
 
@@ -370,17 +401,12 @@ void RC_ScaffData::addFeature(int fl, int fr, GPVec<RC_Feature>& fvec,
 void Ballgown_setupFiles(FILE* &f_tdata, FILE* &f_edata, FILE* &f_idata,
 	            FILE* &f_e2t, FILE* &f_i2t) {
   if (f_tdata == NULL) {
-	//first call, create the files
+	//first call, create the files (the headers are written by rc_writeRC)
 	 f_tdata = rc_fwopen("t_data");
-	 fprintf(f_tdata, "t_id\tchr\tstrand\tstart\tend\tt_name\tnum_exons\tlength\tgene_id\tgene_name\tcov\tFPKM\n");
 	 f_edata = rc_fwopen("e_data");
-    fprintf(f_edata, "e_id\tchr\tstrand\tstart\tend\trcount\tucount\tmrcount\tcov\tcov_sd\tmcov\tmcov_sd\n");
 	 f_idata = rc_fwopen("i_data");
-    fprintf(f_idata, "i_id\tchr\tstrand\tstart\tend\trcount\tucount\tmrcount\n");
     f_e2t = rc_fwopen("e2t");
-    fprintf(f_e2t,  "e_id\tt_id\n");
     f_i2t = rc_fwopen("i2t");
-    fprintf(f_i2t,  "i_id\tt_id\n");
   }
 }
 